@@ -14,13 +14,33 @@
 #include <stdint.h>
 #define FLASHSPI_CMD_PP         0x02  /*!< Page Program */
 #define FLASHSPI_CMD_READ       0x03  /*!< Read Page Register instruction */
+#define FLASHSPI_CMD_FAST_READ  0x0B  /*!< Fast Read instruction, one dummy byte */
 #define FLASHSPI_CMD_RDSR       0x05  /*!< Read Status Register instruction */
 #define FLASHSPI_CMD_WREN       0x06  /*!< Write enable instruction */
 #define FLASHSPI_CMD_SE         0x20  /*!< Sector Erase instruction */
+#define FLASHSPI_CMD_BE32       0x52  /*!< 32kB Block Erase instruction */
+#define FLASHSPI_CMD_BE64       0xD8  /*!< 64kB Block Erase instruction */
+#define FLASHSPI_CMD_RDSFDP     0x5A  /*!< Read SFDP, one dummy byte */
+#define FLASHSPI_CMD_READ4      0x13  /*!< Read with 4-byte address */
+#define FLASHSPI_CMD_FAST_READ4 0x0C  /*!< Fast Read with 4-byte address */
+#define FLASHSPI_CMD_PP4        0x12  /*!< Page Program with 4-byte address */
+#define FLASHSPI_CMD_EN4B       0xB7  /*!< Enter 4-byte address mode */
+#define FLASHSPI_CMD_SUSPEND    0x75  /*!< Erase/Program Suspend */
+#define FLASHSPI_CMD_RESUME     0x7A  /*!< Erase/Program Resume */
 #define FLASHSPI_CMD_REMS       0x90  /*!< Read Electronic Manufacturer Signature */
 #define FLASHSPI_CMD_RDID       0x9F  /*!< Read ID (JEDEC Manufacturer ID and JEDEC CFI) */
 #define FLASHSPI_CMD_CE         0xC7  /*!< Chip Erase */
 #define FLASHSPI_SR_BSY         0x01
+#define FLASHSPI_BE32_SIZE      0x8000
+#define FLASHSPI_BE64_SIZE      0x10000
+#define FLASHSPI_ADDR3_SIZE     0x1000000   /*!< Range reached with 3-byte address */
+#define FLASHSPI_ADDR3          0           /*!< 3-byte address */
+#define FLASHSPI_ADDR4_CMD      1           /*!< 4-byte address instructions */
+#define FLASHSPI_ADDR4_EN4B     2           /*!< 4-byte address mode entered at init */
+#define FLASHSPI_ADDR4          3           /*!< 4-byte address only device */
+#define FLASHSPI_OP_PROGRAM     0           /*!< Program range, expected to be erased */
+#define FLASHSPI_OP_ERASE       1           /*!< Erase sectors fully covered by range */
+#define FLASHSPI_OP_CHIP_ERASE  2           /*!< Erase whole device, range unused */
 typedef enum {
     FLASHSPI_OK = 0,            /* (0) Success */
     FLASHSPI_ERROR,             /* (1) Generic error */
@@ -28,28 +48,67 @@ typedef enum {
     FLASHSPI_ERROR_TIMEOUT,     /* (3) Operation timedout */
     FLASHSPI_ERROR_NOMEM,       /* (4) No memory available */
     FLASHSPI_ERROR_BP,          /* (5) Block protected */
-    FLASHSPI_ERROR_PP           /* (6) Page program */
+    FLASHSPI_ERROR_PP,          /* (6) Page program */
+    FLASHSPI_BUSY               /* (7) Operation queued or in progress */
 }flashspi_res_t;
 typedef struct {
     const char *name;
-    const uint32_t size;
-    const uint32_t sectorsize;
-    const uint32_t pagesize;
-    const uint32_t mid;             // Manufacturer/id
+    uint32_t size;
+    uint32_t sectorsize;
+    uint32_t pagesize;
+    uint32_t mid;                   // Manufacturer/id
+    uint8_t se_cmd;                 // Sector erase instruction, 0 for FLASHSPI_CMD_SE
+    uint8_t be32_cmd;               // 32kB block erase instruction, 0 if not supported
+    uint8_t be64_cmd;               // 64kB block erase instruction, 0 if not supported
+    uint8_t addr4;                  // Addressing mode, FLASHSPI_ADDR3/ADDR4_CMD/ADDR4_EN4B/ADDR4
+    uint8_t sus_cmd;                // Erase suspend instruction, 0 if not supported
+    uint8_t res_cmd;                // Erase resume instruction
+    uint16_t tse;                   // Maximum sector erase time (ms)
+    uint16_t tbe32;                 // Maximum 32kB block erase time (ms)
+    uint16_t tbe64;                 // Maximum 64kB block erase time (ms)
+    uint16_t tpp;                   // Maximum page program time (ms)
+    uint32_t tce;                   // Maximum chip erase time (ms)
+    uint32_t fr;                    // Maximum clock for read instruction (Hz)
+    uint32_t fc;                    // Maximum clock for fast read and others (Hz), 0 no fast read
     flashspi_res_t (*init)(void);
     flashspi_res_t (*wait_ready)(void);
 }flashspi_t;
+typedef struct flashspi_op_s {
+    uint8_t type;                   // FLASHSPI_OP_xxx
+    const uint8_t *buf;             // Data to program
+    uint32_t addr;
+    uint32_t len;
+    void (*done)(struct flashspi_op_s *op); // Completion callback, may be NULL
+    volatile flashspi_res_t res;    // FLASHSPI_BUSY until completed
+    uint32_t pos;                   // Internal, bytes done
+    struct flashspi_op_s *next;     // Internal, queue link
+}flashspi_op_t;
 flashspi_res_t flashspi_init(void);
-flashspi_res_t flashspi_write(const uint8_t* pbuffer, uint32_t writeaddr, uint16_t numbytetowrite);
+flashspi_res_t flashspi_write(const uint8_t* pbuffer, uint32_t writeaddr, uint32_t numbytetowrite);
+flashspi_res_t flashspi_write_run(const uint8_t* pbuffer, uint32_t writeaddr, uint32_t numbytetowrite, uint32_t runend);
 flashspi_res_t flashspi_read(uint8_t* pbuffer, uint32_t readaddr, uint16_t numbytetoread);
+void flashspi_read_start(uint8_t* pbuffer, uint32_t readaddr, uint16_t numbytetoread, void (*done)(flashspi_res_t res));
 void flashspi_write_enable(void);
 const flashspi_t *flashspi_get_device(void);
 uint32_t flashspi_get_size(void);
 uint32_t flashspi_get_sector_size(void);
 uint32_t flashspi_get_page_size(void);
 const char* flashspi_get_name (void);
+uint32_t flashspi_get_clock(void);
 flashspi_res_t flashspi_erase(void);
+flashspi_res_t flashspi_erase_range(uint32_t addr, uint32_t len);
+flashspi_res_t flashspi_erase_sector(uint32_t addr);
+flashspi_res_t flashspi_erase_blocks(uint32_t addr, uint32_t len);
+flashspi_res_t flashspi_program(const uint8_t* pbuffer, uint32_t writeaddr, uint16_t numbytetowrite);
 uint32_t flashspi_read_id_jedec(void);
 uint8_t flashspi_read_status(void);
 flashspi_res_t flashspi_wait_ready(uint32_t timeout);
+void flashspi_set_suspend_hook(uint8_t (*pending)(void), void (*serve)(void));
+flashspi_res_t flashspi_submit(flashspi_op_t *op);
+void flashspi_task(void);
+void flashspi_flush(void);
+uint8_t flashspi_busy(void);
+uint8_t flashspi_chip_erasing(void);
+flashspi_res_t flashspi_sfdp_probe(flashspi_t *dev, const flashspi_t *quirks, uint32_t mid);
+uint32_t flashspi_sfdp_tables(uint8_t *pbuffer, uint32_t len);
 #endif
\ No newline at end of file
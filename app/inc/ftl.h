@@ -0,0 +1,37 @@
+// =============================================================================
+/*!
+ * @file       ftl.h
+ *
+ * This file contains definitions for the spi flash translation layer
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#ifndef FTL_H
+#define FTL_H
+#include <stdint.h>
+#include "flashspi.h"
+
+#define FTL_SECTOR_SIZE         512         /*!< Logical sector size */
+#ifndef FTL_MAX_SIZE
+#define FTL_MAX_SIZE            0x100000    /*!< Flash area managed, bounds ram usage */
+#endif
+#define FTL_MIN_BLOCK_SIZE      0x1000      /*!< Smallest supported erase block */
+#define FTL_MAX_SLOTS           15          /*!< Data slots per block, 8kB blocks */
+#ifndef FTL_SPARE_BLOCKS
+#define FTL_SPARE_BLOCKS        8           /*!< Blocks not exported, gc needs 3 at least */
+#endif
+#define FTL_GC_FREE_BLOCKS      2           /*!< Free blocks kept before each write */
+#define FTL_BG_FREE_BLOCKS      8           /*!< Free blocks kept by background gc */
+#define FTL_WL_THRESHOLD        64          /*!< Erase count spread that moves cold data */
+#define FTL_IDLE_MS             200         /*!< Quiet time before background work */
+
+flashspi_res_t ftl_mount(void);
+flashspi_res_t ftl_read(uint8_t* pbuffer, uint32_t readaddr, uint32_t numbytetoread);
+flashspi_res_t ftl_write(const uint8_t* pbuffer, uint32_t writeaddr, uint32_t numbytetowrite);
+flashspi_res_t ftl_discard(uint32_t addr, uint32_t len);
+uint32_t ftl_get_size(void);
+void ftl_idle(void);
+#endif
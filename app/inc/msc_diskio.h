@@ -37,21 +37,68 @@
 /** @addtogroup 415_USB_device_msc
   * @{
   */
-#ifndef SD_CARD_LUN
-#define SD_CARD_LUN                      0
-#endif
 #ifndef SPI_FLASH_LUN
-#define SPI_FLASH_LUN                    1
+#define SPI_FLASH_LUN                    0
+#endif
+#ifndef SD_CARD_LUN
+#define SD_CARD_LUN                      1
 #endif
 #ifndef INTERNAL_FLASH_LUN
+#ifdef ENABLE_DISK_SDCARD
 #define INTERNAL_FLASH_LUN               2
+#else
+#define INTERNAL_FLASH_LUN               1
+#endif
+#endif
+#ifndef RAMDISK_LUN
+#define RAMDISK_LUN                      3
 #endif
 
+#ifndef MSC_SUPPORT_MAX_LUN
+#if defined(ENABLE_DISK_RAMDISK) && (RAMDISK_LUN > INTERNAL_FLASH_LUN || !defined(ENABLE_DISK_INTFLASH))
+#define MSC_SUPPORT_MAX_LUN              (RAMDISK_LUN + 1)
+#elif defined(ENABLE_DISK_INTFLASH)
+#define MSC_SUPPORT_MAX_LUN              (INTERNAL_FLASH_LUN + 1)
+#endif
+#endif
+
+/**
+  * @brief block device operations, one per lun. addresses and lengths
+  *        are in bytes, optional operations may be left null.
+  *        direct is called from usb interrupt, it returns a pointer to
+  *        memory holding the data at addr and may reduce len to the
+  *        mapped part, null makes the engine fall back to read.
+  *        write_begin is called once per write command before its
+  *        data with the whole range, in the context writes are made
+  *        from. It must not access media, the transfer may be aborted.
+  *        read_start starts a read and returns, done is called when
+  *        data is in buf, possibly from interrupt or before returning.
+  *        write_start likewise, buf is kept until done is called.
+  *        write_end is called after the last chunk of a command written
+  *        with write_start, before its status, to wait for data to
+  *        reach media and report a failure against the command
+  */
+typedef struct
+{
+  usb_sts_type (*read)(uint64_t addr, uint8_t *buf, uint32_t len);
+  usb_sts_type (*write)(uint64_t addr, uint8_t *buf, uint32_t len);
+  usb_sts_type (*capacity)(uint64_t *blk_nbr, uint32_t *blk_size);
+  usb_sts_type (*unmap)(uint64_t addr, uint64_t len);          /*!< optional, discard range */
+  usb_sts_type (*sync)(void);                                   /*!< optional, flush volatile cache */
+  void         (*idle)(void);                                   /*!< optional, background work */
+  uint8_t*     (*direct)(uint64_t addr, uint32_t *len);         /*!< optional, zero-copy read pointer */
+  void         (*write_begin)(uint64_t addr, uint64_t len);     /*!< optional, whole range of a write before its data */
+  void         (*read_start)(uint64_t addr, uint8_t *buf, uint32_t len,
+                             void (*done)(usb_sts_type status)); /*!< optional, asynchronous read */
+  void         (*write_start)(uint64_t addr, uint8_t *buf, uint32_t len,
+                              void (*done)(usb_sts_type status)); /*!< optional, asynchronous write */
+  usb_sts_type (*write_end)(void);                              /*!< optional, wait end of asynchronous writes */
+  uint8_t      write_cache;                                     /*!< volatile write cache enabled */
+}msc_disk_ops_type;
+
 uint8_t*     get_inquiry(uint8_t lun);
 usb_sts_type msc_disk_init(uint8_t lun);
-usb_sts_type msc_disk_read(uint8_t lun, uint32_t addr, uint8_t *read_buf, uint32_t len);
-usb_sts_type msc_disk_write(uint8_t lun, uint32_t addr, uint8_t *buf, uint32_t len);
-usb_sts_type msc_disk_capacity(uint8_t lun, uint32_t *blk_nbr, uint32_t *blk_size);
+const msc_disk_ops_type *msc_disk_get_ops(uint8_t lun);
 
 /**
   * @}
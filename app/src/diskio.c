@@ -14,138 +14,1247 @@
  * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
  */
 // =============================================================================
+#include <string.h>
 #include "diskio.h"
 #include "flashspi.h"
-#include "cdc_msc_class.h"
+#include "ftl.h"
+#include "board.h"
+#include "at32_sdio.h"
+#ifdef ENABLE_DISK_INTFLASH
+#include "at32_intflash.h"
+#endif
+#include "msc_bot_scsi.h"
 #include "msc_diskio.h"
 
-#define PRINT_DISKIO_DBG 0
-#if PRINT_DISKIO_DBG && ENABLE_DBG_LOG
-   #include "board.h"
-   #define PRINT_DISKIO(fmt, ...) dbg_log("[DISKIO] "fmt, ##__VA_ARGS__)
-#else
-   #define PRINT_DISKIO(...)
-#endif
-uint8_t scsi_inquiry[MSC_SUPPORT_MAX_LUN][SCSI_INQUIRY_DATA_LENGTH] = {
-    /* lun = 0 */
-    {
-#ifdef MSC_CDROM
-        0x05,
-        0x08,
-        0x02,
-        0x02,
-#else   // mass strorage
-        0x00, /* peripheral device type (direct-access device) */
-        0x80, /* removable media bit */
-        0x00, /* ansi version, ecma version, iso version */
-        0x01, /* respond data format */
-#endif
-        SCSI_INQUIRY_DATA_LENGTH - 5, /* additional length */
-        0x00, 0x00, 0x00, /* reserved */
-        'B', 'I', 'T', 'H', 'I', 'U', 'M', ' ', /* vendor information "AT32" */
-        'D', 'i', 's', 'k', '0', ' ', ' ', ' ',' ', ' ', ' ', ' ', ' ', ' ', ' ',  ' ', /* Product identification "Disk" */
-        '2', '.', '0', '0' /* product revision level */
-    }
-};
+#define PRINT_DISKIO_DBG 0
+#if PRINT_DISKIO_DBG && ENABLE_DBG_LOG
+   #define PRINT_DISKIO(fmt, ...) dbg_log("[DISKIO] "fmt, ##__VA_ARGS__)
+#else
+   #define PRINT_DISKIO(...)
+#endif
+/**
+ * Flash translation layer for spi flash, sectors are written out of place
+ * and erases are done by garbage collection. Changes on-flash layout and
+ * exports at most FTL_MAX_SIZE, so existing disks must be reformatted.
+ */
+#ifndef DISKIO_FTL
+#define DISKIO_FTL            0
+#endif
+/**
+ * Write-back cache for spi flash, holds one dirty flash sector so that
+ * consecutive small writes to it are merged into a single erase/program.
+ * Cache is flushed on sync, on sector change and after DISKIO_CACHE_IDLE_MS
+ * without writes. Not needed with ftl.
+ */
+#ifndef DISKIO_WRITE_CACHE
+#if defined(ENABLE_DISK_SPIFLASH) && !DISKIO_FTL
+#define DISKIO_WRITE_CACHE    1
+#else
+#define DISKIO_WRITE_CACHE    0
+#endif
+#endif
+#define DISKIO_CACHE_SIZE     4096
+#define DISKIO_CACHE_IDLE_MS  500
+/**
+ * Background pre-erase for spi flash, sectors freed by host unmap or
+ * FatFs trim are queued and erased after DISKIO_ERASE_IDLE_MS without
+ * writes, so later writes to them are page programs only. Up to
+ * DISKIO_ERASE_RANGES ranges are queued, further ones are erased
+ * at once. Not needed with ftl.
+ */
+#ifndef DISKIO_PRE_ERASE
+#if defined(ENABLE_DISK_SPIFLASH) && !DISKIO_FTL
+#define DISKIO_PRE_ERASE      1
+#else
+#define DISKIO_PRE_ERASE      0
+#endif
+#endif
+#define DISKIO_ERASE_RANGES   8
+#define DISKIO_ERASE_IDLE_MS  200
+#define DISKIO_ERASE_STEP     0x10000   /* largest erase done per idle call */
+/**
+ * Sd card blocks per sd_read_disk/sd_write_disk call, block count is
+ * 8 bit. Longer requests are split, each part goes as one CMD18/CMD25
+ * multi-block transfer.
+ */
+#define DISKIO_SD_MAX_BLOCKS  128
+
+#if DISKIO_WRITE_CACHE
+typedef struct {
+   uint32_t addr;          /* flash address of cached sector */
+   uint32_t tick;          /* time of last write */
+   uint8_t valid;
+   uint8_t dirty;
+   uint8_t buf[DISKIO_CACHE_SIZE];
+}diskio_cache_t;
+
+static diskio_cache_t cache;
+#endif
+
+#if DISKIO_PRE_ERASE
+typedef struct {
+   uint32_t start[DISKIO_ERASE_RANGES];   /* sector aligned, empty if end == start */
+   uint32_t end[DISKIO_ERASE_RANGES];
+   uint32_t tick;                         /* time of last write */
+}diskio_erase_t;
+
+static diskio_erase_t erase_queue;
+#endif
+
+#if defined(ENABLE_DISK_SPIFLASH) && !DISKIO_FTL
+/* range of the usb write command in progress, its data comes in
+   sequential chunks */
+static struct {
+   uint32_t addr;          /* next chunk expected */
+   uint32_t end;
+}write_run;
+#endif
+
+uint8_t scsi_inquiry[MSC_SUPPORT_MAX_LUN][SCSI_INQUIRY_DATA_LENGTH] = {
+    /* lun = 0 */
+    {
+#ifdef MSC_CDROM
+        0x05,
+        0x08,
+        0x02,
+        0x02,
+#else   // mass strorage
+        0x00, /* peripheral device type (direct-access device) */
+        0x80, /* removable media bit */
+        0x00, /* ansi version, ecma version, iso version */
+        0x01, /* respond data format */
+#endif
+        SCSI_INQUIRY_DATA_LENGTH - 5, /* additional length */
+        0x00, 0x00, 0x00, /* reserved */
+        'B', 'I', 'T', 'H', 'I', 'U', 'M', ' ', /* vendor information "AT32" */
+        'D', 'i', 's', 'k', '0', ' ', ' ', ' ',' ', ' ', ' ', ' ', ' ', ' ', ' ',  ' ', /* Product identification "Disk" */
+        '2', '.', '0', '0' /* product revision level */
+    },
+#if MSC_SUPPORT_MAX_LUN > 1
+    /* lun = 1 */
+    {
+        0x00, /* peripheral device type (direct-access device) */
+        0x80, /* removable media bit */
+        0x00, /* ansi version, ecma version, iso version */
+        0x01, /* respond data format */
+        SCSI_INQUIRY_DATA_LENGTH - 5, /* additional length */
+        0x00, 0x00, 0x00, /* reserved */
+        'B', 'I', 'T', 'H', 'I', 'U', 'M', ' ', /* vendor information */
+        'D', 'i', 's', 'k', '1', ' ', ' ', ' ',' ', ' ', ' ', ' ', ' ', ' ', ' ',  ' ', /* Product identification "Disk" */
+        '2', '.', '0', '0' /* product revision level */
+    },
+#endif
+#if MSC_SUPPORT_MAX_LUN > 2
+    /* lun = 2 */
+    {
+        0x00, /* peripheral device type (direct-access device) */
+        0x80, /* removable media bit */
+        0x00, /* ansi version, ecma version, iso version */
+        0x01, /* respond data format */
+        SCSI_INQUIRY_DATA_LENGTH - 5, /* additional length */
+        0x00, 0x00, 0x00, /* reserved */
+        'B', 'I', 'T', 'H', 'I', 'U', 'M', ' ', /* vendor information */
+        'D', 'i', 's', 'k', '2', ' ', ' ', ' ',' ', ' ', ' ', ' ', ' ', ' ', ' ',  ' ', /* Product identification "Disk" */
+        '2', '.', '0', '0' /* product revision level */
+    },
+#endif
+#if MSC_SUPPORT_MAX_LUN > 3
+    /* lun = 3 */
+    {
+        0x00, /* peripheral device type (direct-access device) */
+        0x80, /* removable media bit */
+        0x00, /* ansi version, ecma version, iso version */
+        0x01, /* respond data format */
+        SCSI_INQUIRY_DATA_LENGTH - 5, /* additional length */
+        0x00, 0x00, 0x00, /* reserved */
+        'B', 'I', 'T', 'H', 'I', 'U', 'M', ' ', /* vendor information */
+        'D', 'i', 's', 'k', '3', ' ', ' ', ' ',' ', ' ', ' ', ' ', ' ', ' ', ' ',  ' ', /* Product identification "Disk" */
+        '2', '.', '0', '0' /* product revision level */
+    },
+#endif
+};
+/**
+ * @brief  get disk basic information
+ * @param  lun: logical unit number
+ * @retval inquiry string
+ */
+uint8_t *get_inquiry (uint8_t lun)
+{
+   if (lun < MSC_SUPPORT_MAX_LUN)
+      return (uint8_t *) scsi_inquiry[lun];
+   else
+      return NULL;
+}
+#if DISKIO_WRITE_CACHE
+/**
+ * @brief  Writes cached sector to flash if dirty
+ * @retval flash operation result
+ */
+static flashspi_res_t diskio_cache_flush (void)
+{
+   flashspi_res_t res;
+
+   if (!cache.dirty)
+   {
+      return FLASHSPI_OK;
+   }
+
+   PRINT_DISKIO("flush sector 0x%x\n", cache.addr);
+   res = flashspi_write (cache.buf, cache.addr, flashspi_get_sector_size ());
+   if (res == FLASHSPI_OK)
+   {
+      cache.dirty = 0;
+   }
+   return res;
+}
+
+/**
+ * @brief  Writes data through the sector cache. Whole sectors not
+ *         in cache are written directly, partial sectors are merged
+ *         in cache until another sector is written.
+ * @param  buf: data to be written
+ * @param  addr: flash address
+ * @param  len: number of bytes
+ * @param  end: end of the write run data belongs to, see flashspi_write_run
+ * @retval flash operation result
+ */
+static flashspi_res_t diskio_cache_write (const uint8_t *buf, uint32_t addr,
+                                          uint32_t len, uint32_t end)
+{
+   flashspi_res_t res;
+   uint32_t sectorsize = flashspi_get_sector_size ();
+   uint32_t base, offset, chunk;
+
+   if (sectorsize == 0 || sectorsize > DISKIO_CACHE_SIZE)
+   {
+      return flashspi_write_run (buf, addr, len, end);
+   }
+
+   while (len)
+   {
+      offset = addr % sectorsize;
+      base   = addr - offset;
+      chunk  = sectorsize - offset;
+      if (chunk > len)
+      {
+         chunk = len;
+      }
+
+      if (cache.valid && cache.addr == base)
+      {
+         memcpy (cache.buf + offset, buf, chunk);
+         cache.dirty = 1;
+         cache.tick  = GetTick ();
+      }
+      else if (chunk == sectorsize)
+      {
+         /* whole sectors up to the cached one at once */
+         chunk = len - len % sectorsize;
+         if (cache.valid && cache.addr > addr && cache.addr < addr + chunk)
+         {
+            chunk = cache.addr - addr;
+         }
+         res = flashspi_write_run (buf, addr, chunk, end);
+         if (res != FLASHSPI_OK)
+         {
+            return res;
+         }
+      }
+      else
+      {
+         res = diskio_cache_flush ();
+         if (res != FLASHSPI_OK)
+         {
+            return res;
+         }
+
+         cache.valid = 0;
+         res = flashspi_read (cache.buf, base, sectorsize);
+         if (res != FLASHSPI_OK)
+         {
+            return res;
+         }
+
+         memcpy (cache.buf + offset, buf, chunk);
+         cache.addr  = base;
+         cache.valid = 1;
+         cache.dirty = 1;
+         cache.tick  = GetTick ();
+      }
+
+      buf  += chunk;
+      addr += chunk;
+      len  -= chunk;
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Reads flash data, range overlapping cached sector is
+ *         taken from cache
+ * @param  buf: buffer that receives data
+ * @param  addr: flash address
+ * @param  len: number of bytes
+ * @retval flash operation result
+ */
+static flashspi_res_t diskio_cache_read (uint8_t *buf, uint32_t addr, uint32_t len)
+{
+   flashspi_res_t res;
+   uint32_t start, end;
+
+   res = flashspi_read (buf, addr, len);
+
+   if (res != FLASHSPI_OK || !cache.valid)
+   {
+      return res;
+   }
+
+   start = (addr > cache.addr) ? addr : cache.addr;
+   end   = cache.addr + flashspi_get_sector_size ();
+   if (end > addr + len)
+   {
+      end = addr + len;
+   }
+
+   if (start < end)
+   {
+      memcpy (buf + (start - addr), cache.buf + (start - cache.addr), end - start);
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Maps a read on the cached sector, data is used in place
+ * @param  addr: flash address
+ * @param  len: [in] number of bytes, [out] bytes available from addr
+ * @retval pointer to cached data, NULL if addr is not cached
+ */
+static uint8_t *diskio_cache_direct (uint32_t addr, uint32_t *len)
+{
+   uint32_t end = cache.addr + flashspi_get_sector_size ();
+
+   if (!cache.valid || addr < cache.addr || addr >= end)
+   {
+      return NULL;
+   }
+
+   if (*len > end - addr)
+   {
+      *len = end - addr;
+   }
+
+   return cache.buf + (addr - cache.addr);
+}
+
+/**
+ * @brief  Drops cached sector if fully discarded
+ * @param  addr: flash address
+ * @param  len: number of bytes
+ */
+static void diskio_cache_discard (uint32_t addr, uint32_t len)
+{
+   if (cache.valid && cache.addr >= addr &&
+       cache.addr + flashspi_get_sector_size () <= addr + len)
+   {
+      cache.valid = 0;
+      cache.dirty = 0;
+   }
+}
+#elif DISKIO_FTL
+#define diskio_cache_write(buf, addr, len, end) ftl_write (buf, addr, len)
+#define diskio_cache_read  ftl_read
+#define diskio_cache_flush() FLASHSPI_OK
+#define diskio_cache_discard(addr, len)
+#else
+#define diskio_cache_write flashspi_write_run
+#define diskio_cache_read  flashspi_read
+#define diskio_cache_flush() FLASHSPI_OK
+#define diskio_cache_discard(addr, len)
+#endif
+
+#if DISKIO_PRE_ERASE
+/**
+ * @brief  Queues sectors fully covered by range for background erase,
+ *         erases them at once if queue is full
+ * @param  addr: flash address
+ * @param  len: number of bytes
+ * @retval flash operation result
+ */
+static flashspi_res_t diskio_erase_queue (uint32_t addr, uint32_t len)
+{
+   uint32_t sectorsize = flashspi_get_sector_size ();
+   uint32_t start, end;
+   uint8_t i, slot = DISKIO_ERASE_RANGES;
+
+   if (sectorsize == 0)
+   {
+      return FLASHSPI_ERROR;
+   }
+
+   start = addr + sectorsize - 1;
+   start -= start % sectorsize;
+   end = addr + len;
+   end -= end % sectorsize;
+   if (start >= end)
+   {
+      return FLASHSPI_OK;
+   }
+
+   erase_queue.tick = GetTick ();
+
+   for (i = 0; i < DISKIO_ERASE_RANGES; i++)
+   {
+      /* extend a range touching the new one */
+      if (erase_queue.end[i] != erase_queue.start[i] &&
+          start <= erase_queue.end[i] && end >= erase_queue.start[i])
+      {
+         if (start < erase_queue.start[i])
+            erase_queue.start[i] = start;
+         if (end > erase_queue.end[i])
+            erase_queue.end[i] = end;
+         return FLASHSPI_OK;
+      }
+
+      if (erase_queue.end[i] == erase_queue.start[i])
+      {
+         slot = i;
+      }
+   }
+
+   if (slot == DISKIO_ERASE_RANGES)
+   {
+      return flashspi_erase_range (start, end - start);
+   }
+
+   erase_queue.start[slot] = start;
+   erase_queue.end[slot]   = end;
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Removes sectors touched by a write from erase queue
+ * @param  addr: flash address
+ * @param  len: number of bytes
+ */
+static void diskio_erase_cancel (uint32_t addr, uint32_t len)
+{
+   uint32_t sectorsize = flashspi_get_sector_size ();
+   uint32_t start, end;
+   uint8_t i, j;
+
+   if (sectorsize == 0)
+   {
+      return;
+   }
+
+   start = addr - addr % sectorsize;
+   end   = addr + len + sectorsize - 1;
+   end  -= end % sectorsize;
+
+   erase_queue.tick = GetTick ();
+
+   for (i = 0; i < DISKIO_ERASE_RANGES; i++)
+   {
+      if (start >= erase_queue.end[i] || end <= erase_queue.start[i])
+      {
+         continue;
+      }
+
+      if (start > erase_queue.start[i] && end < erase_queue.end[i])
+      {
+         /* split, tail goes to a free slot or is left unerased */
+         for (j = 0; j < DISKIO_ERASE_RANGES; j++)
+         {
+            if (erase_queue.end[j] == erase_queue.start[j])
+            {
+               erase_queue.start[j] = end;
+               erase_queue.end[j]   = erase_queue.end[i];
+               break;
+            }
+         }
+         erase_queue.end[i] = start;
+      }
+      else if (start > erase_queue.start[i])
+      {
+         erase_queue.end[i] = start;
+      }
+      else if (end < erase_queue.end[i])
+      {
+         erase_queue.start[i] = end;
+      }
+      else
+      {
+         erase_queue.start[i] = erase_queue.end[i];
+      }
+   }
+}
+
+/**
+ * @brief  Erases next part of erase queue after DISKIO_ERASE_IDLE_MS
+ *         without writes, at most DISKIO_ERASE_STEP per call
+ */
+static void diskio_erase_step (void)
+{
+   uint32_t chunk;
+   uint8_t i;
+
+   if ((GetTick () - erase_queue.tick) < DISKIO_ERASE_IDLE_MS)
+   {
+      return;
+   }
+
+   for (i = 0; i < DISKIO_ERASE_RANGES; i++)
+   {
+      if (erase_queue.end[i] == erase_queue.start[i])
+      {
+         continue;
+      }
+
+      /* up to next step boundary, so block erase can be used */
+      chunk = DISKIO_ERASE_STEP - erase_queue.start[i] % DISKIO_ERASE_STEP;
+      if (chunk > erase_queue.end[i] - erase_queue.start[i])
+      {
+         chunk = erase_queue.end[i] - erase_queue.start[i];
+      }
+
+      //PRINT_DISKIO("pre-erase 0x%x, %u bytes\n", erase_queue.start[i], chunk);
+      flashspi_erase_range (erase_queue.start[i], chunk);
+      erase_queue.start[i] += chunk;
+      return;
+   }
+}
+#else
+#define diskio_erase_queue flashspi_erase_range
+#define diskio_erase_cancel(addr, len)
+#endif
+
+#if DISKIO_FTL
+#define diskio_spi_size    ftl_get_size
+#else
+#define diskio_spi_size    flashspi_get_size
+#endif
+
+#ifdef ENABLE_DISK_SPIFLASH
+#if !DISKIO_FTL
+/**
+ * @brief  spi flash write begin, range of a write command is kept so
+ *         that flash blocks it covers can be erased at once when their
+ *         first chunk shows new data. Flash is not accessed here.
+ * @param  addr: logical address
+ * @param  len: length of write
+ * @retval none
+ */
+static void diskio_spi_write_begin (uint64_t addr, uint64_t len)
+{
+   write_run.addr = (uint32_t)addr;
+   write_run.end  = (addr + len > diskio_spi_size ()) ? 0 : (uint32_t)(addr + len);
+}
+
+/**
+ * @brief  End of the write run a chunk belongs to, chunks out of
+ *         sequence end the run
+ * @param  addr: chunk address
+ * @param  len: chunk length
+ * @retval run end, addr + len if chunk is not part of a run
+ */
+static uint32_t diskio_spi_run_end (uint32_t addr, uint32_t len)
+{
+   if (addr != write_run.addr || addr + len > write_run.end)
+   {
+      write_run.end = 0;
+      return addr + len;
+   }
+   write_run.addr = addr + len;
+   return write_run.end;
+}
+#else
+#define diskio_spi_write_begin NULL
+#define diskio_spi_run_end(addr, len) ((addr) + (len))
+#endif
+/**
+ * @brief  spi flash read, fails with USB_WAIT while a chip erase is
+ *         queued or running instead of waiting minutes for its end,
+ *         so do the other accesses
+ * @param  addr: logical address
+ * @param  buf: pointer to read buffer
+ * @param  len: read length
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_spi_read (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   //PRINT_DISKIO("msc read address 0x%x, size %u\n", addr, len);
+   if (flashspi_chip_erasing ())
+   {
+      return USB_WAIT;
+   }
+   return (usb_sts_type) diskio_cache_read (buf, (uint32_t)addr, len);
+}
+/**
+ * @brief  spi flash write
+ * @param  addr: logical address
+ * @param  buf: pointer to write buffer
+ * @param  len: write length
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_spi_write (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   //PRINT_DISKIO("msc write address 0x%x, size %u\n", addr, len);
+   if (flashspi_chip_erasing ())
+   {
+      return USB_WAIT;
+   }
+   diskio_erase_cancel ((uint32_t)addr, len);
+   return (usb_sts_type) diskio_cache_write (buf, (uint32_t)addr, len,
+                                             diskio_spi_run_end ((uint32_t)addr, len));
+}
+/**
+ * @brief  spi flash capacity
+ * @param  [out] blk_nbr: number of blocks
+ * @param  [out] blk_size: block size
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_spi_capacity (uint64_t *blk_nbr, uint32_t *blk_size)
+{
+   if (flashspi_chip_erasing ())
+   {
+      return USB_WAIT;
+   }
+   *blk_size = FF_MIN_SS;
+   *blk_nbr  = diskio_spi_size () / *blk_size;
+   return (*blk_nbr) ? USB_OK : USB_FAIL;
+}
+#if DISKIO_WRITE_CACHE
+/**
+ * @brief  spi flash direct read, only the cached sector is
+ *         memory resident
+ * @param  addr: logical address
+ * @param  len: [in] read length, [out] mapped length
+ * @retval pointer to data, NULL if not mapped
+ */
+static uint8_t *diskio_spi_direct (uint64_t addr, uint32_t *len)
+{
+   return diskio_cache_direct ((uint32_t)addr, len);
+}
+#else
+#define diskio_spi_direct NULL
+#endif
+/**
+ * @brief  spi flash unmap, data on range is discarded and flash sectors
+ *         fully covered by it are queued for erase so that later writes
+ *         skip the read-erase-rewrite cycle
+ * @param  addr: logical address
+ * @param  len: length of range
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_spi_unmap (uint64_t addr, uint64_t len)
+{
+   //PRINT_DISKIO("msc unmap address 0x%x, size %u\n", addr, len);
+   if (flashspi_chip_erasing ())
+   {
+      return USB_WAIT;
+   }
+   if (addr + len > diskio_spi_size ())
+   {
+      return USB_FAIL;
+   }
+#if DISKIO_FTL
+   return (usb_sts_type) ftl_discard ((uint32_t)addr, (uint32_t)len);
+#else
+   diskio_cache_discard ((uint32_t)addr, (uint32_t)len);
+   return (usb_sts_type) diskio_erase_queue ((uint32_t)addr, (uint32_t)len);
+#endif
+}
+#if !DISKIO_FTL
+static void (*spi_read_done)(usb_sts_type status);
+
+/**
+ * @brief  End of spi flash dma read
+ * @param  res: read result
+ */
+static void diskio_spi_read_end (flashspi_res_t res)
+{
+   spi_read_done ((usb_sts_type) res);
+}
+
+/**
+ * @brief  spi flash read on dma, done is called from interrupt
+ *         context at the end. Reads overlapping the write cache
+ *         are done at once.
+ * @param  addr: logical address
+ * @param  buf: pointer to read buffer
+ * @param  len: read length
+ * @param  done: completion callback
+ */
+static void diskio_spi_read_start (uint64_t addr, uint8_t *buf, uint32_t len,
+                                   void (*done)(usb_sts_type status))
+{
+   if (flashspi_chip_erasing ())
+   {
+      done (USB_WAIT);
+      return;
+   }
+#if DISKIO_WRITE_CACHE
+   if (cache.valid && addr < cache.addr + flashspi_get_sector_size () &&
+       addr + len > cache.addr)
+   {
+      done (diskio_spi_read (addr, buf, len));
+      return;
+   }
+#endif
+   if (len > 0xffff)
+   {
+      done (USB_FAIL);
+      return;
+   }
+   spi_read_done = done;
+   flashspi_read_start (buf, (uint32_t)addr, len, diskio_spi_read_end);
+}
+#else
+#define diskio_spi_read_start  NULL
+#endif
+/**
+ * @brief  spi flash sync, writes cached data to media
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_spi_sync (void)
+{
+   if (flashspi_chip_erasing ())
+   {
+      return USB_WAIT;
+   }
+   return (usb_sts_type) diskio_cache_flush ();
+}
+/**
+ * @brief  spi flash idle, flushes write cache after
+ *         DISKIO_CACHE_IDLE_MS without writes, erases queued
+ *         sectors or runs ftl background work
+ */
+static void diskio_spi_idle (void)
+{
+   if (flashspi_chip_erasing ())
+   {
+      return;
+   }
+#if DISKIO_FTL
+   ftl_idle ();
+#else
+#if DISKIO_WRITE_CACHE
+   if (cache.dirty && (GetTick () - cache.tick) >= DISKIO_CACHE_IDLE_MS)
+   {
+      diskio_cache_flush ();
+      return;
+   }
+#endif
+#if DISKIO_PRE_ERASE
+   diskio_erase_step ();
+#endif
+#endif
+}
+#if !DISKIO_FTL
+/**
+ * @brief  Drops write cache and queued erases without carrying them
+ *         out, flash contents they refer to are gone after chip erase
+ */
+static void diskio_spi_drop (void)
+{
+#if DISKIO_WRITE_CACHE
+   cache.valid = 0;
+   cache.dirty = 0;
+#endif
+#if DISKIO_PRE_ERASE
+   memset (&erase_queue, 0, sizeof (erase_queue));
+#endif
+   write_run.end = 0;
+}
+#endif
+
+static const msc_disk_ops_type spi_flash_ops = {
+   .read        = diskio_spi_read,
+   .write       = diskio_spi_write,
+   .capacity    = diskio_spi_capacity,
+   .unmap       = diskio_spi_unmap,
+   .sync        = diskio_spi_sync,
+   .idle        = diskio_spi_idle,
+   .direct      = diskio_spi_direct,
+   .write_begin = diskio_spi_write_begin,
+   .read_start  = diskio_spi_read_start,
+   .write_cache = DISKIO_WRITE_CACHE,
+};
+#endif /* ENABLE_DISK_SPIFLASH */
+
+#ifdef ENABLE_DISK_SDCARD
+/**
+ * @brief  Reads sd card blocks, length must be multiple of block size
+ * @param  addr: card address
+ * @param  buf: buffer that receives data
+ * @param  len: number of bytes
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_sd_read (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   uint32_t block_size = sd_card_info_get ()->block_size;
+   uint32_t chunk;
+
+   if (block_size == 0 || (addr % block_size) || (len % block_size))
+   {
+      return USB_FAIL;
+   }
+
+   while (len)
+   {
+      chunk = (len > DISKIO_SD_MAX_BLOCKS * block_size) ? DISKIO_SD_MAX_BLOCKS * block_size : len;
+
+      if (sd_read_disk (buf, (uint32_t)(addr / block_size),
+                        (uint8_t)(chunk / block_size)) != SD_OK)
+      {
+         return USB_FAIL;
+      }
+      addr += chunk;
+      buf  += chunk;
+      len  -= chunk;
+   }
+
+   return USB_OK;
+}
+
+/**
+ * @brief  Writes sd card blocks, length must be multiple of block size
+ * @param  addr: card address
+ * @param  buf: data to be written
+ * @param  len: number of bytes
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_sd_write (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   uint32_t block_size = sd_card_info_get ()->block_size;
+   uint32_t chunk;
+
+   if (block_size == 0 || (addr % block_size) || (len % block_size))
+   {
+      return USB_FAIL;
+   }
+
+   while (len)
+   {
+      chunk = (len > DISKIO_SD_MAX_BLOCKS * block_size) ? DISKIO_SD_MAX_BLOCKS * block_size : len;
+
+      if (sd_write_disk (buf, (uint32_t)(addr / block_size),
+                         (uint8_t)(chunk / block_size)) != SD_OK)
+      {
+         return USB_FAIL;
+      }
+      addr += chunk;
+      buf  += chunk;
+      len  -= chunk;
+   }
+
+   return USB_OK;
+}
+
+static void (*sd_read_done)(usb_sts_type status);
+
+/**
+ * @brief  End of sd card dma read, called from sdio interrupt
+ * @param  status: transfer status
+ */
+static void diskio_sd_read_end (sdio_error_t status)
+{
+   sd_read_done ((status == SD_OK) ? USB_OK : USB_FAIL);
+}
+
+/**
+ * @brief  sd card read on dma, done is called from interrupt
+ *         context at the end. Unaligned buffers are read at once.
+ * @param  addr: card address
+ * @param  buf: pointer to read buffer
+ * @param  len: read length
+ * @param  done: completion callback
+ */
+static void diskio_sd_read_start (uint64_t addr, uint8_t *buf, uint32_t len,
+                                  void (*done)(usb_sts_type status))
+{
+   uint32_t block_size = sd_card_info_get ()->block_size;
+
+   if (block_size == 0 || (addr % block_size) || (len % block_size))
+   {
+      done (USB_FAIL);
+      return;
+   }
+
+   if (len > DISKIO_SD_MAX_BLOCKS * block_size)
+   {
+      done (diskio_sd_read (addr, buf, len));
+      return;
+   }
+
+   sd_read_done = done;
+
+   if (sd_read_disk_async (buf, (uint32_t)(addr / block_size),
+                           (uint8_t)(len / block_size), diskio_sd_read_end) != SD_OK)
+   {
+      done (diskio_sd_read (addr, buf, len));
+   }
+}
+
+static void (*sd_write_done)(usb_sts_type status);
+
+/**
+ * @brief  End of sd card dma write, called from sdio interrupt
+ * @param  status: transfer status
+ */
+static void diskio_sd_write_end (sdio_error_t status)
+{
+   sd_write_done ((status == SD_OK) ? USB_OK : USB_FAIL);
+}
+
+/**
+ * @brief  sd card write on dma, done is called from interrupt
+ *         context at the end. Unaligned buffers are written at once.
+ * @param  addr: card address
+ * @param  buf: data to be written, kept until done
+ * @param  len: write length
+ * @param  done: completion callback
+ */
+static void diskio_sd_write_start (uint64_t addr, uint8_t *buf, uint32_t len,
+                                   void (*done)(usb_sts_type status))
+{
+   uint32_t block_size = sd_card_info_get ()->block_size;
+   sdio_error_t status;
+
+   if (block_size == 0 || (addr % block_size) || (len % block_size))
+   {
+      done (USB_FAIL);
+      return;
+   }
+
+   if (len > DISKIO_SD_MAX_BLOCKS * block_size)
+   {
+      done (diskio_sd_write (addr, buf, len));
+      return;
+   }
+
+   sd_write_done = done;
+
+   status = sd_write_disk_async (buf, (uint32_t)(addr / block_size),
+                                 (uint8_t)(len / block_size), diskio_sd_write_end);
+   if (status == SD_INVALID_PARAMETER)
+   {
+      /* not on dma */
+      done (diskio_sd_write (addr, buf, len));
+   }
+   else if (status != SD_OK)
+   {
+      /* programming of previous chunk failed, not to be retried */
+      done (USB_FAIL);
+   }
+}
+
 /**
- * @brief  get disk basic information
- * @param  lun: logical unit number
- * @retval inquiry string
+ * @brief  sd card sync, waits for the card to program data of the
+ *         last dma write
+ * @retval status of usb_sts_type, USB_FAIL on programming error
  */
-uint8_t *get_inquiry (uint8_t lun)
+static usb_sts_type diskio_sd_sync (void)
 {
-   if (lun < MSC_SUPPORT_MAX_LUN)
-      return (uint8_t *) scsi_inquiry[lun];
-   else
-      return NULL;
+   return (sd_wait_ready () == SD_OK) ? USB_OK : USB_FAIL;
 }
+
 /**
- * @brief  Initialize flash
- * @retval 0: on success
+ * @brief  sd card capacity, fails if card was not initialized
+ * @param  [out] blk_nbr: number of blocks
+ * @param  [out] blk_size: block size
+ * @retval status of usb_sts_type
  */
-usb_sts_type msc_disk_init (uint8_t lun)
+static usb_sts_type diskio_sd_capacity (uint64_t *blk_nbr, uint32_t *blk_size)
 {
-   switch (lun)
+   card_info_t *sd_card_info = sd_card_info_get ();
+
+   if (sd_card_info->block_size == 0 || sd_card_info->capacity == 0)
    {
-      case SPI_FLASH_LUN:
-         return flashspi_init ();
+      return USB_FAIL;
+   }
+   *blk_size = sd_card_info->block_size;
+   *blk_nbr  = sd_card_info->capacity / sd_card_info->block_size;
+   return USB_OK;
+}
 
-      case SD_CARD_LUN:
-//         return sd_init ();
+static const msc_disk_ops_type sd_card_ops = {
+   .read        = diskio_sd_read,
+   .write       = diskio_sd_write,
+   .capacity    = diskio_sd_capacity,
+   .sync        = diskio_sd_sync,
+   .read_start  = diskio_sd_read_start,
+   .write_start = diskio_sd_write_start,
+   .write_end   = diskio_sd_sync,
+};
+#endif /* ENABLE_DISK_SDCARD */
 
-      case INTERNAL_FLASH_LUN:
-      default:
-         break;
+#ifdef ENABLE_DISK_INTFLASH
+/**
+ * @brief  internal flash read, contents are memory mapped
+ * @param  addr: logical address
+ * @param  buf: pointer to read buffer
+ * @param  len: read length
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_int_read (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   if (addr + len > intflash_get_size ())
+   {
+      return USB_FAIL;
    }
+   memcpy (buf, intflash_get_ptr ((uint32_t)addr), len);
+   return USB_OK;
+}
+/**
+ * @brief  internal flash write
+ * @param  addr: logical address
+ * @param  buf: pointer to write buffer
+ * @param  len: write length
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_int_write (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   return (intflash_write (buf, (uint32_t)addr, len) == FLASH_OPERATE_DONE) ? USB_OK : USB_FAIL;
+}
+/**
+ * @brief  internal flash capacity
+ * @param  [out] blk_nbr: number of blocks
+ * @param  [out] blk_size: block size
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_int_capacity (uint64_t *blk_nbr, uint32_t *blk_size)
+{
+   *blk_size = FF_MIN_SS;
+   *blk_nbr  = intflash_get_size () / *blk_size;
+   return (*blk_nbr) ? USB_OK : USB_FAIL;
+}
+/**
+ * @brief  internal flash unmap, erases pages fully covered by range
+ * @param  addr: logical address
+ * @param  len: length of range
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_int_unmap (uint64_t addr, uint64_t len)
+{
+   if (addr + len > intflash_get_size ())
+   {
+      return USB_FAIL;
+   }
+   return (intflash_erase_range ((uint32_t)addr, (uint32_t)len) == FLASH_OPERATE_DONE) ? USB_OK : USB_FAIL;
+}
+/**
+ * @brief  internal flash direct read, whole region is memory mapped
+ * @param  addr: logical address
+ * @param  len: [in] read length, [out] mapped length
+ * @retval pointer to data, NULL if out of range
+ */
+static uint8_t *diskio_int_direct (uint64_t addr, uint32_t *len)
+{
+   uint32_t size = intflash_get_size ();
 
-   return USB_ERROR;
+   if (addr >= size)
+   {
+      return NULL;
+   }
+   if (*len > size - addr)
+   {
+      *len = size - (uint32_t)addr;
+   }
+   return intflash_get_ptr ((uint32_t)addr);
 }
+
+static const msc_disk_ops_type int_flash_ops = {
+   .read        = diskio_int_read,
+   .write       = diskio_int_write,
+   .capacity    = diskio_int_capacity,
+   .unmap       = diskio_int_unmap,
+   .direct      = diskio_int_direct,
+};
+#endif
+
+#ifdef ENABLE_DISK_RAMDISK
+#if defined(ENABLE_DISK_SPIFLASH) && SPI_FLASH_LUN == RAMDISK_LUN
+#error "RAMDISK_LUN collides with SPI_FLASH_LUN"
+#endif
 /**
- * @brief  disk read
- * @param  lun: logical units number
+ * RAM disk, volatile lun meant for measuring usb pipeline throughput
+ * without storage latency. Unless RAMDISK_SIZE is given, it takes all sram
+ * between end of bss plus heap reserve and the stack reserve, as laid out
+ * by the linker script.
+ */
+#ifdef RAMDISK_SIZE
+static uint8_t ramdisk_mem[RAMDISK_SIZE] __attribute__((aligned(4)));
+#else
+extern uint8_t _ebss[], _estack[], _Min_Heap_Size[], _Min_Stack_Size[];
+#endif
+static uint8_t *ramdisk_base;
+static uint32_t ramdisk_size;
+
+/**
+ * @brief  ram disk init, locates disk memory
+ * @retval status of usb_sts_type
+ */
+static usb_sts_type diskio_ram_init (void)
+{
+#ifdef RAMDISK_SIZE
+   ramdisk_base = ramdisk_mem;
+   ramdisk_size = sizeof (ramdisk_mem);
+#else
+   uint32_t start = (uint32_t)_ebss + (uint32_t)_Min_Heap_Size;
+   uint32_t end = (uint32_t)_estack - (uint32_t)_Min_Stack_Size;
+
+   start = (start + FF_MIN_SS - 1) & ~(FF_MIN_SS - 1);
+   ramdisk_base = (uint8_t *)start;
+   ramdisk_size = (end > start) ? (end - start) & ~(FF_MIN_SS - 1) : 0;
+#endif
+   PRINT_DISKIO ("ramdisk %lu bytes at %p\n", ramdisk_size, ramdisk_base);
+   return ramdisk_size ? USB_OK : USB_FAIL;
+}
+/**
+ * @brief  ram disk read
  * @param  addr: logical address
- * @param  read_buf: pointer to read buffer
+ * @param  buf: pointer to read buffer
  * @param  len: read length
  * @retval status of usb_sts_type
  */
-usb_sts_type msc_disk_read (uint8_t lun, uint32_t addr, uint8_t *read_buf,
-                            uint32_t len)
+static usb_sts_type diskio_ram_read (uint64_t addr, uint8_t *buf, uint32_t len)
 {
-   usb_sts_type res = USB_NOT_SUPPORT;
-   //PRINT_DISKIO("msc read address 0x%x, size %u\n", addr, len);
-   switch (lun)
+   if (addr + len > ramdisk_size)
    {
-      case SPI_FLASH_LUN:
-         res = (usb_sts_type) flashspi_read (read_buf, addr, len);
-         break;
-      default:
-         break;
+      return USB_FAIL;
    }
-   return res;
+   memcpy (buf, ramdisk_base + addr, len);
+   return USB_OK;
 }
 /**
- * @brief  disk write
- * @param  lun: logical units number
+ * @brief  ram disk write
  * @param  addr: logical address
  * @param  buf: pointer to write buffer
  * @param  len: write length
  * @retval status of usb_sts_type
  */
-usb_sts_type msc_disk_write (uint8_t lun, uint32_t addr, uint8_t *buf,
-                             uint32_t len)
+static usb_sts_type diskio_ram_write (uint64_t addr, uint8_t *buf, uint32_t len)
 {
-   usb_sts_type res = USB_NOT_SUPPORT;
-   //PRINT_DISKIO("msc write address 0x%x, size %u\n", addr, len);
-   switch (lun)
+   if (addr + len > ramdisk_size)
    {
-      case SPI_FLASH_LUN:
-         res = (usb_sts_type) flashspi_write (buf, addr, len);
-         break;
-      default:
-         break;
+      return USB_FAIL;
    }
-   return res;
+   memcpy (ramdisk_base + addr, buf, len);
+   return USB_OK;
 }
 /**
- * @brief  disk capacity
- * @param  [in] lun: logical units number
+ * @brief  ram disk capacity
  * @param  [out] blk_nbr: number of blocks
  * @param  [out] blk_size: block size
  * @retval status of usb_sts_type
  */
-usb_sts_type msc_disk_capacity (uint8_t lun, uint32_t *blk_nbr,
-                                uint32_t *blk_size)
+static usb_sts_type diskio_ram_capacity (uint64_t *blk_nbr, uint32_t *blk_size)
+{
+   *blk_size = FF_MIN_SS;
+   *blk_nbr  = ramdisk_size / *blk_size;
+   return (*blk_nbr) ? USB_OK : USB_FAIL;
+}
+/**
+ * @brief  ram disk direct read, whole disk is memory mapped
+ * @param  addr: logical address
+ * @param  len: [in] read length, [out] mapped length
+ * @retval pointer to data, NULL if out of range
+ */
+static uint8_t *diskio_ram_direct (uint64_t addr, uint32_t *len)
+{
+   if (addr >= ramdisk_size)
+   {
+      return NULL;
+   }
+   if (*len > ramdisk_size - addr)
+   {
+      *len = ramdisk_size - (uint32_t)addr;
+   }
+   return ramdisk_base + addr;
+}
+
+static const msc_disk_ops_type ram_disk_ops = {
+   .read        = diskio_ram_read,
+   .write       = diskio_ram_write,
+   .capacity    = diskio_ram_capacity,
+   .direct      = diskio_ram_direct,
+};
+#endif
+
+/**
+ * @brief  Initialize flash
+ * @retval 0: on success
+ */
+usb_sts_type msc_disk_init (uint8_t lun)
 {
    switch (lun)
    {
+#ifdef ENABLE_DISK_SPIFLASH
       case SPI_FLASH_LUN:
-         *blk_size = FF_MIN_SS;
-         *blk_nbr  = flashspi_get_size () / *blk_size;
+         /* host reads arriving during idle work suspend flash erases */
+         flashspi_set_suspend_hook (bot_scsi_read_pending, bot_scsi_read_serve);
+#if DISKIO_FTL
+         if (flashspi_init () != FLASHSPI_OK)
+         {
+            return USB_FAIL;
+         }
+         return (usb_sts_type) ftl_mount ();
+#else
+         diskio_spi_drop ();
+         return flashspi_init ();
+#endif
+#endif
+#ifdef ENABLE_DISK_SDCARD
+      case SD_CARD_LUN:
+         return (sd_init () == SD_OK) ? USB_OK : USB_FAIL;
+#endif
+#ifdef ENABLE_DISK_INTFLASH
+      case INTERNAL_FLASH_LUN:
+         intflash_init ();
          return USB_OK;
+#endif
+#ifdef ENABLE_DISK_RAMDISK
+      case RAMDISK_LUN:
+         return diskio_ram_init ();
+#endif
+      default:
+         break;
+   }
+
+   return USB_ERROR;
+}
+/**
+ * @brief  Get block device operations of a lun
+ * @param  lun: logical units number
+ * @retval pointer to operations, NULL if lun has no backend
+ */
+const msc_disk_ops_type *msc_disk_get_ops (uint8_t lun)
+{
+   switch (lun)
+   {
+#ifdef ENABLE_DISK_SPIFLASH
+      case SPI_FLASH_LUN:
+         return &spi_flash_ops;
+#endif
+#ifdef ENABLE_DISK_SDCARD
+      case SD_CARD_LUN:
+         return &sd_card_ops;
+#endif
+#ifdef ENABLE_DISK_INTFLASH
+      case INTERNAL_FLASH_LUN:
+         return &int_flash_ops;
+#endif
+#ifdef ENABLE_DISK_RAMDISK
+      case RAMDISK_LUN:
+         return &ram_disk_ops;
+#endif
       default:
          break;
    }
-   return USB_NOT_SUPPORT;
+   return NULL;
 }
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
@@ -153,7 +1262,22 @@ usb_sts_type msc_disk_capacity (uint8_t lun, uint32_t *blk_nbr,
 DSTATUS disk_status (BYTE pdrv)
 {
    DSTATUS status = STA_NOINIT;
-   return (pdrv == SPI_FLASH_LUN) ? status &= ~STA_NOINIT : status;
+#ifdef ENABLE_DISK_SDCARD
+   if(pdrv == SD_CARD_LUN){
+      return (sd_card_info_get ()->capacity != 0) ? 0 : status;
+   }
+#endif
+#ifdef ENABLE_DISK_SPIFLASH
+   if(pdrv == SPI_FLASH_LUN){
+      return status & ~STA_NOINIT;
+   }
+#endif
+#ifdef ENABLE_DISK_RAMDISK
+   if(pdrv == RAMDISK_LUN){
+      return ramdisk_size ? status & ~STA_NOINIT : status;
+   }
+#endif
+   return status;
 }
 /*-----------------------------------------------------------------------*/
 /* Inidialize a Drive                                                    */
@@ -161,12 +1285,34 @@ DSTATUS disk_status (BYTE pdrv)
 DSTATUS disk_initialize (BYTE pdrv)
 {
    DSTATUS status = STA_NOINIT;
+#ifdef ENABLE_DISK_SDCARD
+   /* card may be in use by usb already, initialized once */
+   if(pdrv == SD_CARD_LUN){
+      if(sd_card_info_get ()->capacity != 0 || sd_init () == SD_OK){
+         status &= ~STA_NOINIT;
+      }
+   }
+#endif
+#ifdef ENABLE_DISK_SPIFLASH
    if(pdrv == SPI_FLASH_LUN){
-      if(flashspi_init () == FLASHSPI_OK)
+      if(flashspi_init () == FLASHSPI_OK
+#if DISKIO_FTL
+         && ftl_mount () == FLASHSPI_OK
+#endif
+      )
       {
          status &= ~STA_NOINIT;
       }
    }
+#endif
+#ifdef ENABLE_DISK_RAMDISK
+   /* contents are kept if already in use by usb */
+   if(pdrv == RAMDISK_LUN){
+      if(ramdisk_size != 0 || diskio_ram_init () == USB_OK){
+         status &= ~STA_NOINIT;
+      }
+   }
+#endif
    return status;
 }
 /*-----------------------------------------------------------------------*/
@@ -182,9 +1328,23 @@ DRESULT disk_read (BYTE pdrv,  /* Physical drive number to identify the drive */
    //PRINT_DISKIO("read sector 0x%x, count %u\n", sector, count);
    switch (pdrv)
    {
+#ifdef ENABLE_DISK_SPIFLASH
       case SPI_FLASH_LUN:
-         status = (DRESULT) flashspi_read (buff, sector * FF_MIN_SS, count * FF_MIN_SS);
+         status = (DRESULT) diskio_cache_read (buff, sector * FF_MIN_SS, count * FF_MIN_SS);
+         break;
+#endif
+#ifdef ENABLE_DISK_RAMDISK
+      case RAMDISK_LUN:
+         status = (diskio_ram_read ((uint64_t) sector * FF_MIN_SS, buff,
+                     count * FF_MIN_SS) == USB_OK) ? RES_OK : RES_ERROR;
+         break;
+#endif
+#ifdef ENABLE_DISK_SDCARD
+      case SD_CARD_LUN:
+         status = (diskio_sd_read ((uint64_t) sector * sd_card_info_get ()->block_size, buff,
+                     count * sd_card_info_get ()->block_size) == USB_OK) ? RES_OK : RES_ERROR;
          break;
+#endif
       default:
          status = RES_PARERR;
    }
@@ -208,9 +1368,25 @@ DRESULT disk_write (BYTE pdrv, /* Physical drive number to identify the drive */
    }
    switch (pdrv)
    {
+#ifdef ENABLE_DISK_SPIFLASH
       case SPI_FLASH_LUN:
-         status = (DRESULT) flashspi_write (buff, sector * FF_MIN_SS, count * FF_MIN_SS);
+         diskio_erase_cancel (sector * FF_MIN_SS, count * FF_MIN_SS);
+         status = (DRESULT) diskio_cache_write (buff, sector * FF_MIN_SS, count * FF_MIN_SS,
+                                                (sector + count) * FF_MIN_SS);
+         break;
+#endif
+#ifdef ENABLE_DISK_RAMDISK
+      case RAMDISK_LUN:
+         status = (diskio_ram_write ((uint64_t) sector * FF_MIN_SS, (BYTE *) buff,
+                     count * FF_MIN_SS) == USB_OK) ? RES_OK : RES_ERROR;
+         break;
+#endif
+#ifdef ENABLE_DISK_SDCARD
+      case SD_CARD_LUN:
+         status = (diskio_sd_write ((uint64_t) sector * sd_card_info_get ()->block_size, (BYTE *) buff,
+                     count * sd_card_info_get ()->block_size) == USB_OK) ? RES_OK : RES_ERROR;
          break;
+#endif
       default:
          status = RES_PARERR;
    }
@@ -230,24 +1406,85 @@ DRESULT disk_ioctl (BYTE pdrv, /* Physical drive number (0..) */
       return RES_NOTRDY;
    switch (pdrv)
    {
+#ifdef ENABLE_DISK_SPIFLASH
       case SPI_FLASH_LUN:
          switch (cmd)
          {
             case CTRL_SYNC:
-               status = RES_OK;
+               status = (diskio_cache_flush () == FLASHSPI_OK) ? RES_OK : RES_ERROR;
                break;
             case GET_SECTOR_SIZE:
                *(DWORD *) buff = FF_MIN_SS;
                status          = RES_OK;
                break;
             case GET_SECTOR_COUNT:
-               *(DWORD *) buff = flashspi_get_size () / FF_MIN_SS;
+               *(DWORD *) buff = diskio_spi_size () / FF_MIN_SS;
                status          = RES_OK;
                break;
             case GET_BLOCK_SIZE:
                // flashspi_get_sector_size(), can cause bluescreen
                // on windows after f_mkfs
-               *(DWORD *) buff = flashspi_get_size ();
+               *(DWORD *) buff = diskio_spi_size ();
+               status          = RES_OK;
+               break;
+#if FF_USE_TRIM
+            case CTRL_TRIM:
+               /* inclusive sector range */
+               status = (diskio_spi_unmap (((LBA_t *) buff)[0] * FF_MIN_SS,
+                           (((LBA_t *) buff)[1] - ((LBA_t *) buff)[0] + 1) * FF_MIN_SS) == USB_OK) ?
+                           RES_OK : RES_ERROR;
+               break;
+#endif
+            default:
+               status = RES_PARERR;
+               break;
+         }
+         break;
+#endif
+#ifdef ENABLE_DISK_RAMDISK
+      case RAMDISK_LUN:
+         switch (cmd)
+         {
+            case CTRL_SYNC:
+               status = RES_OK;
+               break;
+            case GET_SECTOR_SIZE:
+               *(WORD *) buff = FF_MIN_SS;
+               status         = RES_OK;
+               break;
+            case GET_SECTOR_COUNT:
+               *(LBA_t *) buff = ramdisk_size / FF_MIN_SS;
+               status          = RES_OK;
+               break;
+            case GET_BLOCK_SIZE:
+               *(DWORD *) buff = 1;
+               status          = RES_OK;
+               break;
+            default:
+               status = RES_PARERR;
+               break;
+         }
+         break;
+#endif
+#ifdef ENABLE_DISK_SDCARD
+      case SD_CARD_LUN:
+         switch (cmd)
+         {
+            case CTRL_SYNC:
+               /* writes return once card has programmed them */
+               status = RES_OK;
+               break;
+            case GET_SECTOR_SIZE:
+               *(WORD *) buff = sd_card_info_get ()->block_size;
+               status         = RES_OK;
+               break;
+            case GET_SECTOR_COUNT:
+               *(LBA_t *) buff = sd_card_info_get ()->capacity / sd_card_info_get ()->block_size;
+               status          = RES_OK;
+               break;
+            case GET_BLOCK_SIZE:
+               /* erase block unknown */
+               *(DWORD *) buff = 1;
                status          = RES_OK;
                break;
             default:
@@ -255,6 +1492,7 @@ DRESULT disk_ioctl (BYTE pdrv, /* Physical drive number (0..) */
                break;
          }
          break;
+#endif
       default:
          break;
    }
@@ -10,11 +10,22 @@
  */
 // =============================================================================
 #include <stddef.h>
+#include <string.h>
 #include "flashspi.h"
 #include "board.h"
 
 #define FLASH_DEVICES_COUNT sizeof (flashspi_devices) / sizeof (flashspi_t *)
 #define MAX_SECTOR_SIZE     0x2000 /* 8kB */
+#define SUSPEND_MS          2      /* Suspend latency limit, tSUS is ~30us */
+#define RESUME_MS           2      /* Erase time between resume and suspend */
+#define OP_TIMEOUT_MS       100000 /* Queued operation step timeout when device has none */
+#define FLASHSPI_HDR_MAX    6      /* Instruction, 4 address bytes and dummy byte */
+#define CAL_CLOCK           1000000 /* Clock reference data is read at (Hz) */
+#define CAL_LEN             256    /* Bytes of sfdp tables or flash compared */
+#define CAL_READS           4      /* Reads compared at each clock */
+
+#define FLASHSPI_DATA_SAME  0x01   /* new data equals flash contents */
+#define FLASHSPI_DATA_PROG  0x02   /* new data only clears bits, no erase needed */
 
 #define PRINT_FLASHSPI_DBG 0
 
@@ -25,35 +36,91 @@
 #endif
 
 static uint32_t flashspi_read_id (void);
+static uint32_t flashspi_cal_read (uint8_t *pbuffer, uint8_t sfdp);
+static uint32_t flashspi_calibrate (uint32_t limit);
 static void flashspi_sector_erase (uint32_t sectoraddr);
+static void flashspi_block_erase (uint8_t cmd, uint32_t addr, uint32_t timeout);
+static void flashspi_erase_cmd (uint8_t cmd, uint32_t addr);
+static uint32_t flashspi_erase_unit (uint32_t start, uint32_t end, uint8_t *cmd, uint32_t *timeout);
+static uint8_t flashspi_is_blank (uint32_t addr, uint32_t size);
+static flashspi_res_t flashspi_wait (uint32_t timeout);
+static flashspi_res_t flashspi_wait_erase (uint32_t timeout);
+static void flashspi_send_cmd (uint8_t cmd);
+static uint8_t flashspi_header (uint8_t *hdr, uint8_t cmd, uint32_t addr);
+static uint8_t flashspi_read_header (uint8_t *hdr, uint32_t readaddr);
+static void flashspi_read_end (uint32_t count);
+static flashspi_res_t flashspi_erase_covered (uint32_t addr, uint32_t len, uint32_t minsize);
 static void flashspi_write_page (const uint8_t *pbuffer, uint32_t writeaddr, uint16_t numbytetowrite);
+static void flashspi_page_program (const uint8_t *pbuffer, uint32_t writeaddr, uint16_t numbytetowrite);
 static void flashspi_write_sector (const uint8_t *pbuffer, uint32_t writeaddr, uint16_t numbytetowrite);
+static uint32_t flashspi_write_block (const uint8_t *pbuffer, uint32_t writeaddr, uint32_t len, uint32_t runend);
+static uint8_t flashspi_compare (const uint8_t *stored, const uint8_t *data, uint32_t len, uint8_t flags);
+static void flashspi_write_changed (const uint8_t *stored, const uint8_t *pbuffer, uint32_t writeaddr, uint32_t len);
+static void flashspi_op_step (void);
+static void flashspi_op_issue (uint32_t timeout);
+static void flashspi_op_wait (void);
+static void flashspi_op_done (flashspi_res_t res);
 
 extern const flashspi_t gd25lq16;
 extern const flashspi_t w25q64;
 extern const flashspi_t w25q128;
+extern const flashspi_t w25q256;
+extern const flashspi_t w25q512;
 extern const flashspi_t w25x32;
 extern const flashspi_t at25sf321b;
 
 static const flashspi_t *spiflash;
+static flashspi_t sfdp_device;
+/* Known devices, parameters read from sfdp take precedence
+ * over the ones listed, so entries mostly supply name, init
+ * and clock limits. Parts without sfdp use them as is */
 static const flashspi_t *flashspi_devices[] = {
     &gd25lq16,
     &w25q64,
     &w25q128,
+    &w25q256,
+    &w25q512,
     &w25x32,
     &at25sf321b
 };
 
 static uint8_t gtmpbuff[MAX_SECTOR_SIZE];
+static uint32_t spiclock;
+static uint8_t fast_read;
+static uint8_t (*suspend_pending)(void);
+static void (*suspend_serve)(void);
+
+/* Operation queue, head is the operation in progress */
+static flashspi_op_t *op_head;
+static flashspi_op_t *op_tail;
+static uint8_t op_busy;             /* step issued, device busy */
+static uint32_t op_time;            /* step start tick */
+static uint32_t op_timeout;         /* step maximum time */
+static uint32_t op_poll;            /* tick of last status read */
+
+/* Read in progress on dma */
+static uint32_t read_len;
+static void (*read_done)(flashspi_res_t res);
 
 /**
  * @brief Calls SOC low level spi initialization and select flash
- *        according read id.
+ *        according read id. Geometry and timings are read from
+ *        sfdp when the device has it, otherwise device table is used.
  * @param  None
  * @retval None
  */
 flashspi_res_t flashspi_init (void)
 {
+   const flashspi_t *quirks = NULL;
+
+   if(spiflash){
+      /* end queued operations on current device */
+      flashspi_flush ();
+   }
+
+   /* bus is reset, dma read in progress must end first */
+   while(spiflash_busy ());
+
    spiflash_init ();
 
    uint32_t device_id = flashspi_read_id ();
@@ -64,12 +131,27 @@ flashspi_res_t flashspi_init (void)
    {
       if (flashspi_devices[i]->mid == device_id)
       {
-         spiflash = flashspi_devices[i];
+         quirks = flashspi_devices[i];
          break;
       }
    }
 
+   if(flashspi_sfdp_probe (&sfdp_device, quirks, device_id) == FLASHSPI_OK){
+      spiflash = &sfdp_device;
+   }else{
+      spiflash = quirks;
+   }
+
    if(spiflash){
+      if(spiflash->addr4 == FLASHSPI_ADDR4_EN4B){
+         /* all address instructions take 4 bytes from here */
+         flashspi_write_enable ();
+         spiflash_cs (CS_LOW);
+         spiflash_sendbyte (FLASHSPI_CMD_EN4B);
+         spiflash_cs (CS_HIGH);
+      }
+      /* run bus as fast as device, board and wiring allow */
+      spiclock = flashspi_calibrate (spiflash->fc ? spiflash->fc : spiflash->fr);
       return spiflash->init();
    }
 
@@ -119,27 +201,53 @@ flashspi_res_t flashspi_wait_ready(uint32_t timeout)
 flashspi_res_t flashspi_read (uint8_t *pbuffer, uint32_t readaddr,
                      uint16_t numbytetoread)
 {
-   flashspi_res_t res = FLASHSPI_OK;
+   uint8_t hdr[FLASHSPI_HDR_MAX];
+   uint8_t hlen;
    //PRINT_FLASHSPI("read %u bytes from addr 0x%x\n", numbytetoread, readaddr);
-   /*!< select the flash: chip select low */
-   spiflash_cs (CS_LOW);
+   /* queued operations may go on, only current step must end */
+   flashspi_op_wait ();
 
-   /*!< send "read from memory " instruction */
-   spiflash_sendbyte (FLASHSPI_CMD_READ);
-   /*!< send readaddr high nibble address byte to read from */
-   spiflash_sendbyte ((readaddr & 0xff0000) >> 16);
-   /*!< send readaddr medium nibble address byte to read from */
-   spiflash_sendbyte ((readaddr & 0xff00) >> 8);
-   /*!< send readaddr low nibble address byte to read from */
-   spiflash_sendbyte (readaddr & 0xff);
+   hlen = flashspi_read_header (hdr, readaddr);
 
-   res = spiflash_read(pbuffer, numbytetoread) == numbytetoread ?
-                        FLASHSPI_OK : FLASHSPI_ERROR;
+   return spiflash_command (hdr, hlen, NULL, pbuffer, numbytetoread) == numbytetoread ?
+                            FLASHSPI_OK : FLASHSPI_ERROR;
+}
 
-   /*!< deselect the flash: chip select high */
-   spiflash_cs (CS_HIGH);
+/**
+ * @brief  Starts a read of a block of data, data is transferred by
+ *         dma and done is called from interrupt context at the end.
+ *         Bus is kept until then, other calls wait for it.
+ * @param  pBuffer: pointer to the buffer that receives the data,
+ *         kept until done.
+ * @param  ReadAddr: FLASH's internal address to read from.
+ * @param  NumByteToRead: number of bytes to read from the FLASH.
+ * @param  done: completion callback, with read result
+ * @retval None
+ */
+void flashspi_read_start (uint8_t *pbuffer, uint32_t readaddr,
+                          uint16_t numbytetoread, void (*done)(flashspi_res_t res))
+{
+   uint8_t hdr[FLASHSPI_HDR_MAX];
+   uint8_t hlen;
 
-   return res;
+   flashspi_op_wait ();
+
+   hlen = flashspi_read_header (hdr, readaddr);
+
+   read_len  = numbytetoread;
+   read_done = done;
+   /* chip select is released by driver */
+   spiflash_command_async (hdr, hlen, NULL, pbuffer, numbytetoread, flashspi_read_end);
+}
+
+/**
+ * @brief  End of dma read started by flashspi_read_start
+ * @param  count: number of bytes read
+ * @retval None
+ */
+static void flashspi_read_end (uint32_t count)
+{
+   read_done (count == read_len ? FLASHSPI_OK : FLASHSPI_ERROR);
 }
 
 /**
@@ -152,16 +260,39 @@ flashspi_res_t flashspi_read (uint8_t *pbuffer, uint32_t readaddr,
  * @retval None
  */
 flashspi_res_t flashspi_write (const uint8_t *pbuffer, uint32_t writeaddr,
-                      uint16_t numbytetowrite)
+                      uint32_t numbytetowrite)
+{
+   return flashspi_write_run (pbuffer, writeaddr, numbytetowrite,
+                              writeaddr + numbytetowrite);
+}
+
+/**
+ * @brief  Writes part of a longer sequential write, e.g. a chunk of a
+ *         usb write command. Data up to runend follows in later calls,
+ *         so an erase block the run covers may be erased at once
+ *         when the sectors in hand all need an erase.
+ * @param  pBuffer: pointer to the buffer  containing the data to be written
+ *         to the FLASH.
+ * @param  WriteAddr: FLASH's internal address to write to.
+ * @param  NumByteToWrite: number of bytes to write to the FLASH.
+ * @param  runend: end address of the whole run, writeaddr + numbytetowrite
+ *         at least
+ * @retval None
+ */
+flashspi_res_t flashspi_write_run (const uint8_t *pbuffer, uint32_t writeaddr,
+                                   uint32_t numbytetowrite, uint32_t runend)
 {
    uint32_t cnt = 0;
    uint32_t sectornum, sectoroffset, sectorremain;
+   uint8_t flags;
    //PRINT_FLASHSPI("write %d bytes to addr 0x%x\n", numbytetowrite, writeaddr);
 
    if(spiflash->sectorsize > sizeof(gtmpbuff)){
       return FLASHSPI_ERROR_NOMEM;
    }
 
+   flashspi_flush ();
+
    sectornum    = writeaddr / spiflash->sectorsize;
    sectoroffset = writeaddr % spiflash->sectorsize;
    sectorremain = spiflash->sectorsize - sectoroffset;
@@ -173,18 +304,48 @@ flashspi_res_t flashspi_write (const uint8_t *pbuffer, uint32_t writeaddr,
 
    while (1)
    {
-      /*read all sector data*/
-      flashspi_read (gtmpbuff, sectornum * spiflash->sectorsize,
-                      spiflash->sectorsize);
-
-      /*check data is 0xff ?*/
-      for (cnt = 0; cnt < sectorremain; cnt++)
+      if (sectoroffset == 0 &&
+          (cnt = flashspi_write_block (pbuffer, writeaddr, numbytetowrite, runend)) != 0)
       {
-         if (gtmpbuff[sectoroffset + cnt] != 0xff)
-            break;
+         /* erase block covered by run, erased and data in hand written */
+         sectorremain = cnt;
+         flags = FLASHSPI_DATA_SAME;
+      }
+      else if (sectorremain == spiflash->sectorsize)
+      {
+         /* whole sector is replaced, old data is only checked and
+            reading stops as soon as it is known to be of no use */
+         flags = FLASHSPI_DATA_SAME | FLASHSPI_DATA_PROG;
+         for (cnt = 0; cnt < sectorremain && flags; cnt += spiflash->pagesize)
+         {
+            flashspi_read (gtmpbuff + cnt, writeaddr + cnt, spiflash->pagesize);
+            flags = flashspi_compare (gtmpbuff + cnt, pbuffer + cnt, spiflash->pagesize, flags);
+         }
+      }
+      else
+      {
+         /*read all sector data*/
+         flashspi_read (gtmpbuff, sectornum * spiflash->sectorsize,
+                         spiflash->sectorsize);
+         flags = flashspi_compare (gtmpbuff + sectoroffset, pbuffer, sectorremain,
+                                   FLASHSPI_DATA_SAME | FLASHSPI_DATA_PROG);
       }
 
-      if (cnt < sectorremain) /*need sector erase*/
+      if (flags & FLASHSPI_DATA_SAME)
+      {
+         /* nothing to do, data already on flash */
+      }
+      else if (flags & FLASHSPI_DATA_PROG)
+      {
+         /* Bits are only cleared, program changed pages without erase */
+         flashspi_write_changed (gtmpbuff + sectoroffset, pbuffer, writeaddr, sectorremain);
+      }
+      else if (sectorremain == spiflash->sectorsize)
+      {
+         flashspi_sector_erase (writeaddr);
+         flashspi_write_sector (pbuffer, writeaddr, sectorremain);
+      }
+      else /*need sector erase*/
       {
          flashspi_sector_erase (sectornum * spiflash->sectorsize);
 
@@ -196,22 +357,17 @@ flashspi_res_t flashspi_write (const uint8_t *pbuffer, uint32_t writeaddr,
          flashspi_write_sector (gtmpbuff, sectornum * spiflash->sectorsize,
                                 spiflash->sectorsize);
       }
-      else
-      {
-         /* Sector is empty, simply write new data */
-         flashspi_write_sector (pbuffer, writeaddr, sectorremain);
-      }
 
       if (sectorremain == numbytetowrite){
          break;
       }
       else
       {
-         sectornum++;
          sectoroffset = 0;
          pbuffer += sectorremain;
          writeaddr += sectorremain;
          numbytetowrite -= sectorremain;
+         sectornum = writeaddr / spiflash->sectorsize;
          if (numbytetowrite > spiflash->sectorsize)
          {
             sectorremain = spiflash->sectorsize;
@@ -238,13 +394,229 @@ flashspi_res_t flashspi_erase(void)
         return FLASHSPI_ERROR;
     }
 
+    flashspi_flush();
+
     flashspi_write_enable();
 
     spiflash_cs (CS_LOW);
     spiflash_sendbyte (FLASHSPI_CMD_CE);
     spiflash_cs (CS_HIGH);
 
-    return spiflash->wait_ready();
+    return flashspi_wait (spiflash->tce);
+}
+
+/**
+ * @brief Erases all sectors fully covered by the given range,
+ *        partially covered sectors at both ends are kept intact.
+ *        Sectors already erased are skipped to save erase cycles.
+ *
+ * @param addr [in] start address of range
+ * @param len  [in] range length in bytes
+ *
+ * @return command result
+ */
+flashspi_res_t flashspi_erase_range(uint32_t addr, uint32_t len)
+{
+   if(!spiflash){
+      return FLASHSPI_ERROR;
+   }
+
+   flashspi_flush ();
+
+   return flashspi_erase_covered (addr, len, spiflash->sectorsize);
+}
+
+/**
+ * @brief Erases 32kB/64kB blocks fully covered by the given range
+ *        with block erase instructions, the rest is kept intact.
+ *        Blocks already erased are skipped.
+ *
+ * @param addr [in] start address of range
+ * @param len  [in] range length in bytes
+ *
+ * @return command result
+ */
+flashspi_res_t flashspi_erase_blocks(uint32_t addr, uint32_t len)
+{
+   if(!spiflash){
+      return FLASHSPI_ERROR;
+   }
+
+   if(!spiflash->be32_cmd && !spiflash->be64_cmd){
+      return FLASHSPI_OK;
+   }
+
+   flashspi_flush ();
+
+   return flashspi_erase_covered (addr, len, spiflash->be32_cmd ?
+                                  FLASHSPI_BE32_SIZE : FLASHSPI_BE64_SIZE);
+}
+
+/**
+ * @brief Erases a single sector, no check is made for
+ *        sector contents
+ *
+ * @param addr [in] any address within sector
+ *
+ * @return command result
+ */
+flashspi_res_t flashspi_erase_sector(uint32_t addr)
+{
+   if(!spiflash || addr >= spiflash->size){
+      return FLASHSPI_ERROR;
+   }
+
+   flashspi_flush ();
+
+   flashspi_sector_erase (addr - addr % spiflash->sectorsize);
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief Programs data without erasing, target range is expected
+ *        to be erased. Bits can only be cleared by programming.
+ *
+ * @param pbuffer [in] data to be programmed
+ * @param writeaddr [in] flash address
+ * @param numbytetowrite [in] number of bytes
+ *
+ * @return command result
+ */
+flashspi_res_t flashspi_program(const uint8_t *pbuffer, uint32_t writeaddr,
+                                uint16_t numbytetowrite)
+{
+   if(!spiflash || writeaddr + numbytetowrite > spiflash->size){
+      return FLASHSPI_ERROR;
+   }
+
+   if(numbytetowrite){
+      flashspi_flush ();
+      flashspi_write_sector (pbuffer, writeaddr, numbytetowrite);
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief Queues a program or erase operation, it is carried out
+ *        by flashspi_task and op->done is called on completion.
+ *        op->res reads FLASHSPI_BUSY until then. Operation and
+ *        data must be kept until completion. Reads may be done
+ *        meanwhile, data on queued ranges is undefined. Other
+ *        program or erase calls wait for queue to end.
+ *        Not to be used from interrupts.
+ *
+ * @param op [in] operation, type, buf, addr, len and done set
+ *
+ * @return FLASHSPI_OK if queued, error otherwise, done not called
+ */
+flashspi_res_t flashspi_submit(flashspi_op_t *op)
+{
+   if(!spiflash || op->res == FLASHSPI_BUSY){
+      return FLASHSPI_ERROR;
+   }
+
+   if(op->type == FLASHSPI_OP_CHIP_ERASE){
+      /* single step */
+      op->addr = 0;
+      op->len  = 1;
+   }else if(op->type > FLASHSPI_OP_CHIP_ERASE || op->addr > spiflash->size ||
+            op->len > spiflash->size - op->addr){
+      return FLASHSPI_ERROR;
+   }
+
+   op->pos  = 0;
+   op->next = NULL;
+   op->res  = FLASHSPI_BUSY;
+
+   if(op_head){
+      op_tail->next = op;
+   }else{
+      op_head = op;
+   }
+   op_tail = op;
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief Carries out queued operations, to be called periodically
+ *        from main loop. Issues next program or erase step when
+ *        device is ready, busy is checked with a single status
+ *        read per system tick.
+ *
+ * @param None
+ * @retval None
+ */
+void flashspi_task(void)
+{
+   if(!op_head){
+      return;
+   }
+
+   if(op_busy){
+      if(GetTick() == op_poll){
+         return;
+      }
+
+      op_poll = GetTick();
+
+      if(flashspi_read_status() & FLASHSPI_SR_BSY){
+         if(op_poll - op_time >= op_timeout){
+            flashspi_op_done (FLASHSPI_ERROR_TIMEOUT);
+         }
+         return;
+      }
+
+      op_busy = 0;
+   }
+
+   flashspi_op_step ();
+}
+
+/**
+ * @brief Waits for all queued operations to end
+ *
+ * @param None
+ * @retval None
+ */
+void flashspi_flush(void)
+{
+   while(op_head){
+      flashspi_task();
+   }
+}
+
+/**
+ * @brief Checks for queued operations or a dma read in progress
+ *
+ * @param None
+ * @retval 1 if busy, 0 otherwise
+ */
+uint8_t flashspi_busy(void)
+{
+   return op_head != NULL || spiflash_busy ();
+}
+
+/**
+ * @brief Checks for a chip erase queued or in progress, reads and
+ *        writes would wait for its end, which may take minutes
+ *
+ * @param None
+ * @retval 1 if erasing, 0 otherwise
+ */
+uint8_t flashspi_chip_erasing(void)
+{
+   flashspi_op_t *op;
+
+   for(op = op_head; op; op = op->next){
+      if(op->type == FLASHSPI_OP_CHIP_ERASE){
+         return 1;
+      }
+   }
+
+   return 0;
 }
 
 /**
@@ -268,6 +640,93 @@ static uint32_t flashspi_read_id (void)
    return flash_id;
 }
 
+/**
+ * @brief  Reads calibration data, sfdp tables if the device has them
+ *         or start of flash otherwise
+ * @param  pbuffer: destination buffer of CAL_LEN bytes
+ * @param  sfdp: read sfdp tables
+ * @retval number of bytes read, 0 on failure
+ */
+static uint32_t flashspi_cal_read (uint8_t *pbuffer, uint8_t sfdp)
+{
+   if (sfdp)
+      return flashspi_sfdp_tables (pbuffer, CAL_LEN);
+
+   return flashspi_read (pbuffer, 0, CAL_LEN) == FLASHSPI_OK ? CAL_LEN : 0;
+}
+
+/**
+ * @brief  Finds fastest spi clock data is reliably read at. Reference
+ *         data, jedec id and sfdp tables, is read at a low clock and
+ *         read back at each clock from limit down. Start of flash is
+ *         used when the device has no sfdp, and clock is not raised if
+ *         that is blank, as stuck data lines would read the same.
+ *         Fast read is used above read instruction limit. If any clock
+ *         failed, the one below the fastest passing is kept as safety
+ *         margin.
+ * @param  limit: device clock limit (Hz)
+ * @retval clock set
+ */
+static uint32_t flashspi_calibrate (uint32_t limit)
+{
+   uint8_t *ref = gtmpbuff, *cmp = gtmpbuff + CAL_LEN;
+   uint32_t id, clock, refclock, next, len, i;
+   uint8_t n, sfdp, failed = 0;
+
+   refclock  = spiflash_set_clock (CAL_CLOCK);
+   fast_read = 0;
+   id = flashspi_read_id_jedec ();
+
+   len  = flashspi_cal_read (ref, 1);
+   sfdp = len != 0;
+
+   if (!sfdp)
+      len = flashspi_cal_read (ref, 0);
+
+   for (i = 1; i < len && ref[i] == ref[0]; i++);
+
+   if (len == 0 || (i == len && (ref[0] == 0xFF || ref[0] == 0x00)))
+   {
+      PRINT_FLASHSPI("no calibration data, clock kept at %u Hz\n", refclock);
+      return refclock;
+   }
+
+   clock = spiflash_set_clock (limit);
+
+   while (clock > refclock)
+   {
+      fast_read = clock > spiflash->fr;
+
+      for (n = 0; n < CAL_READS; n++)
+      {
+         if (flashspi_read_id_jedec () != id ||
+             flashspi_cal_read (cmp, sfdp) != len ||
+             memcmp (ref, cmp, len))
+            break;
+      }
+
+      /* next slower division */
+      next = spiflash_set_clock (clock - 1);
+
+      if (n == CAL_READS)
+      {
+         /* keep one step below if a faster clock failed */
+         if (failed)
+            clock = next;
+         break;
+      }
+
+      PRINT_FLASHSPI("read failed at %u Hz\n", clock);
+      failed = 1;
+      clock  = next;
+   }
+
+   clock     = spiflash_set_clock (clock);
+   fast_read = clock > spiflash->fr;
+
+   return clock;
+}
+
 /**
  * @brief  Reads JEDEC manufacturer and device
  *         information
@@ -355,6 +814,16 @@ const char* flashspi_get_name (void)
    return (spiflash) ? spiflash->name : "";
 }
 
+/**
+ * @brief  Get spi bus clock set for current device.
+ * @param  None
+ * @retval clock in Hz, 0 if no device
+ */
+uint32_t flashspi_get_clock (void)
+{
+   return (spiflash) ? spiclock : 0;
+}
+
 /**
  * @brief  Writes block of data to the FLASH. In this function, the number of
  *         WRITE cycles are reduced, using Page WRITE sequence.
@@ -414,27 +883,34 @@ static void flashspi_write_page (const uint8_t *pbuffer, uint32_t writeaddr,
                                  uint16_t numbytetowrite)
 {
    //PRINT_FLASHSPI("page write 0x%x %u bytes\n", writeaddr, numbytetowrite);
+   flashspi_page_program (pbuffer, writeaddr, numbytetowrite);
+
+   /*!< wait the end of flash writing */
+   flashspi_wait (spiflash->tpp);
+}
+
+/**
+ * @brief  Issues a page program instruction, end of programming
+ *         is not waited.
+ * @param  pBuffer: pointer to the buffer containing the data to be written
+ * @param  WriteAddr: FLASH's internal address to write to.
+ * @param  NumByteToWrite: number of bytes, up to page end
+ * @retval None
+ */
+static void flashspi_page_program (const uint8_t *pbuffer, uint32_t writeaddr,
+                                   uint16_t numbytetowrite)
+{
+   uint8_t hdr[FLASHSPI_HDR_MAX];
+   uint8_t hlen;
+
    /*!< enable the write access to the flash */
    flashspi_write_enable ();
 
-   /*!< select the flash: chip select low */
-   spiflash_cs (CS_LOW);
-   /*!< send "write to memory " instruction */
-   spiflash_sendbyte (FLASHSPI_CMD_PP);
-   /*!< send writeaddr high nibble address byte to write to */
-   spiflash_sendbyte ((writeaddr & 0xff0000) >> 16);
-   /*!< send writeaddr medium nibble address byte to write to */
-   spiflash_sendbyte ((writeaddr & 0xff00) >> 8);
-   /*!< send writeaddr low nibble address byte to write to */
-   spiflash_sendbyte (writeaddr & 0xff);
-
-   spiflash_write(pbuffer, numbytetowrite);
-
-   /*!< deselect the flash: chip select high */
-   spiflash_cs (CS_HIGH);
+   /*!< "write to memory " instruction and writeaddr, then data */
+   hlen = flashspi_header (hdr, spiflash->addr4 == FLASHSPI_ADDR4_CMD ?
+                           FLASHSPI_CMD_PP4 : FLASHSPI_CMD_PP, writeaddr);
 
-   /*!< wait the end of flash writing */
-   spiflash->wait_ready ();
+   spiflash_command (hdr, hlen, pbuffer, NULL, numbytetowrite);
 }
 
 /**
@@ -444,14 +920,8 @@ static void flashspi_write_page (const uint8_t *pbuffer, uint32_t writeaddr,
  */
 void flashspi_write_enable (void)
 {
-   /*!< Select the FLASH: Chip Select low */
-   spiflash_cs (CS_LOW);
-
    /*!< Send "Write Enable" instruction */
-   spiflash_sendbyte (FLASHSPI_CMD_WREN);
-
-   /*!< Deselect the FLASH: Chip Select high */
-   spiflash_cs (CS_HIGH);
+   flashspi_send_cmd (FLASHSPI_CMD_WREN);
 }
 
 /**
@@ -462,23 +932,547 @@ void flashspi_write_enable (void)
 static void flashspi_sector_erase (uint32_t addr)
 {
    //PRINT_FLASHSPI("erase sector 0x%x\n", addr);
+   flashspi_block_erase (spiflash->se_cmd ? spiflash->se_cmd : FLASHSPI_CMD_SE,
+                         addr, spiflash->tse);
+}
+
+/**
+ * @brief  Issues an erase instruction and waits for its end.
+ * @param  cmd: erase instruction
+ * @param  addr: address of the sector or block to erase.
+ * @param  timeout: maximum erase time, 0 for device default
+ * @retval None
+ */
+static void flashspi_block_erase (uint8_t cmd, uint32_t addr, uint32_t timeout)
+{
+   flashspi_erase_cmd (cmd, addr);
+
+   /*!< wait the end of flash erase */
+   flashspi_wait_erase (timeout);
+}
+
+/**
+ * @brief  Issues an erase instruction, end of erase is not waited.
+ * @param  cmd: erase instruction
+ * @param  addr: address of the sector or block to erase.
+ * @retval None
+ */
+static void flashspi_erase_cmd (uint8_t cmd, uint32_t addr)
+{
+   uint8_t hdr[FLASHSPI_HDR_MAX];
+   uint8_t hlen;
+
    /*!< send write enable instruction */
    flashspi_write_enable ();
 
-   /*!< sector erase */
-   /*!< select the flash: chip select low */
-   spiflash_cs (CS_LOW);
-   /*!< send sector erase instruction */
-   spiflash_sendbyte (FLASHSPI_CMD_SE);
-   /*!< send sectoraddr high nibble address byte */
-   spiflash_sendbyte ((addr & 0xff0000) >> 16);
-   /*!< send sectoraddr medium nibble address byte */
-   spiflash_sendbyte ((addr & 0xff00) >> 8);
-   /*!< send sectoraddr low nibble address byte */
-   spiflash_sendbyte (addr & 0xff);
-   /*!< deselect the flash: chip select high */
-   spiflash_cs (CS_HIGH);
+   /*!< send erase instruction and addr */
+   hlen = flashspi_header (hdr, cmd, addr);
+   spiflash_command (hdr, hlen, NULL, NULL, 0);
+}
 
-   /*!< wait the end of flash writing */
-   spiflash->wait_ready();
+/**
+ * @brief  Sets functions used to serve reads during erases. pending
+ *         tells a read is waiting, the erase is then suspended while
+ *         serve reads. Data on the sector or block being erased must
+ *         not be read by serve, it is undefined.
+ * @param  pending: returns non zero when a read is waiting, NULL to disable
+ * @param  serve: serves waiting read
+ * @retval None
+ */
+void flashspi_set_suspend_hook (uint8_t (*pending)(void), void (*serve)(void))
+{
+   suspend_pending = pending;
+   suspend_serve   = serve;
+}
+
+/**
+ * @brief  Waits for end of an erase, when reads are waiting the erase
+ *         is suspended while they are served and resumed after.
+ * @param  timeout: maximum erase time, 0 for device default
+ * @retval FLASHSPI_OK on success, FLASHSPI_ERROR_TIMEOUT otherwise
+ */
+static flashspi_res_t flashspi_wait_erase (uint32_t timeout)
+{
+   uint32_t time, resumed, suspended;
+
+   if (!timeout || !spiflash->sus_cmd || !suspend_pending)
+   {
+      return flashspi_wait (timeout);
+   }
+
+   time    = GetTick ();
+   resumed = time;
+
+   while (flashspi_read_status () & FLASHSPI_SR_BSY)
+   {
+      if (GetTick () - time >= timeout)
+      {
+         return FLASHSPI_ERROR_TIMEOUT;
+      }
+
+      /* let erase progress between suspends, it may never end otherwise */
+      if (GetTick () - resumed < RESUME_MS || !suspend_pending ())
+      {
+         continue;
+      }
+
+      suspended = GetTick ();
+      flashspi_send_cmd (spiflash->sus_cmd);
+      /* ignored if erase has just ended, busy clears either way */
+      if (flashspi_wait_ready (SUSPEND_MS) == FLASHSPI_OK)
+      {
+         suspend_serve ();
+      }
+      flashspi_send_cmd (spiflash->res_cmd);
+
+      resumed = GetTick ();
+      /* suspended time does not count for erase time */
+      time += resumed - suspended;
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Sends a single byte instruction.
+ * @param  cmd: instruction
+ * @retval None
+ */
+static void flashspi_send_cmd (uint8_t cmd)
+{
+   spiflash_command (&cmd, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief  Builds instruction header, address is 4 bytes
+ *         long unless device uses 3-byte addressing.
+ * @param  hdr: [out] header, FLASHSPI_HDR_MAX bytes
+ * @param  cmd: instruction
+ * @param  addr: address
+ * @retval header length
+ */
+static uint8_t flashspi_header (uint8_t *hdr, uint8_t cmd, uint32_t addr)
+{
+   uint8_t n = 0;
+
+   hdr[n++] = cmd;
+   if (spiflash->addr4 != FLASHSPI_ADDR3)
+   {
+      hdr[n++] = addr >> 24;
+   }
+   hdr[n++] = addr >> 16;
+   hdr[n++] = addr >> 8;
+   hdr[n++] = addr;
+
+   return n;
+}
+
+/**
+ * @brief  Builds read instruction header for readaddr, data follows
+ * @param  hdr: [out] header, FLASHSPI_HDR_MAX bytes
+ * @param  readaddr: address
+ * @retval header length
+ */
+static uint8_t flashspi_read_header (uint8_t *hdr, uint32_t readaddr)
+{
+   uint8_t n;
+
+   if (spiflash->addr4 == FLASHSPI_ADDR4_CMD)
+   {
+      n = flashspi_header (hdr, fast_read ? FLASHSPI_CMD_FAST_READ4 : FLASHSPI_CMD_READ4, readaddr);
+   }
+   else
+   {
+      n = flashspi_header (hdr, fast_read ? FLASHSPI_CMD_FAST_READ : FLASHSPI_CMD_READ, readaddr);
+   }
+   /*!< fast read has one dummy byte before data */
+   if (fast_read)
+   {
+      hdr[n++] = FLASH_DUMMY_BYTE;
+   }
+
+   return n;
+}
+
+/**
+ * @brief  Waits for end of program or erase.
+ * @param  timeout: maximum operation time, 0 for device default
+ * @retval FLASHSPI_OK on success, FLASHSPI_ERROR_TIMEOUT otherwise
+ */
+static flashspi_res_t flashspi_wait (uint32_t timeout)
+{
+   if (timeout)
+   {
+      return flashspi_wait_ready (timeout);
+   }
+
+   return spiflash->wait_ready ();
+}
+
+/**
+ * @brief  Writes an erase block covered by a write run with a single
+ *         block erase, when comparing with flash contents shows that
+ *         erasing its sectors one by one would take longer. Sectors
+ *         holding the same data or where bits are only cleared need
+ *         no erase. When only the start of the block is in hand, it is
+ *         erased if all sectors in hand need an erase, the rest of the
+ *         run is taken to be new data as well.
+ * @param  pbuffer: data to be written
+ * @param  writeaddr: sector aligned flash address
+ * @param  len: number of bytes in hand from writeaddr
+ * @param  runend: end address of the whole run
+ * @retval number of bytes written, 0 if block is left to sector writes
+ */
+static uint32_t flashspi_write_block (const uint8_t *pbuffer, uint32_t writeaddr,
+                                      uint32_t len, uint32_t runend)
+{
+   uint32_t size, have, timeout, sector, cnt, erase = 0;
+   uint8_t cmd, flags, worth = 0;
+
+   size = flashspi_erase_unit (writeaddr, runend - runend % spiflash->sectorsize,
+                               &cmd, &timeout);
+   have = len - len % spiflash->sectorsize;
+   if (size <= spiflash->sectorsize || have == 0)
+   {
+      return 0;
+   }
+   if (have > size)
+   {
+      have = size;
+   }
+
+   for (sector = 0; sector < have && !worth; sector += spiflash->sectorsize)
+   {
+      flags = FLASHSPI_DATA_SAME | FLASHSPI_DATA_PROG;
+      for (cnt = 0; cnt < spiflash->sectorsize && flags; cnt += spiflash->pagesize)
+      {
+         flashspi_read (gtmpbuff, writeaddr + sector + cnt, spiflash->pagesize);
+         flags = flashspi_compare (gtmpbuff, pbuffer + sector + cnt, spiflash->pagesize, flags);
+      }
+
+      if (have < size)
+      {
+         /* rest of block not in hand, give up on first sector
+            that needs no erase */
+         if (flags)
+         {
+            return 0;
+         }
+         worth = (sector + spiflash->sectorsize == have);
+         continue;
+      }
+
+      erase += (flags == 0);
+
+      /* without erase times, more than half of the sectors */
+      worth = (spiflash->tse && timeout) ? erase * spiflash->tse >= timeout :
+                                           erase * 2 > size / spiflash->sectorsize;
+   }
+
+   if (!worth)
+   {
+      return 0;
+   }
+
+   //PRINT_FLASHSPI("erase block 0x%x, %u of %u bytes in hand\n", writeaddr, have, size);
+   flashspi_block_erase (cmd, writeaddr, timeout);
+   for (sector = 0; sector < have; sector += spiflash->sectorsize)
+   {
+      flashspi_write_sector (pbuffer + sector, writeaddr + sector, spiflash->sectorsize);
+   }
+
+   return have;
+}
+
+/**
+ * @brief  Erases the part of a range made of whole erase units, each
+ *         aligned run is erased with the largest instruction that fits.
+ *         Units already blank are skipped.
+ * @param  addr: start address of range
+ * @param  len: range length in bytes
+ * @param  minsize: smallest erase unit used, sector or block size
+ * @retval command result
+ */
+static flashspi_res_t flashspi_erase_covered (uint32_t addr, uint32_t len,
+                                              uint32_t minsize)
+{
+   uint32_t start, end, size, timeout;
+   uint8_t cmd;
+
+   if(spiflash->pagesize > sizeof(gtmpbuff)){
+      return FLASHSPI_ERROR_NOMEM;
+   }
+
+   if(addr >= spiflash->size){
+      return FLASHSPI_OK;
+   }
+
+   if(len > spiflash->size - addr){
+      len = spiflash->size - addr;
+   }
+
+   /* round start up and end down to sector boundary */
+   start = addr + spiflash->sectorsize - 1;
+   start -= start % spiflash->sectorsize;
+   end = addr + len;
+   end -= end % spiflash->sectorsize;
+
+   while (start < end)
+   {
+      size = flashspi_erase_unit (start, end, &cmd, &timeout);
+
+      if (size >= minsize && !flashspi_is_blank (start, size))
+      {
+         //PRINT_FLASHSPI("erase 0x%x, %u bytes\n", start, size);
+         flashspi_block_erase (cmd, start, timeout);
+      }
+
+      start += size;
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Selects largest erase instruction for an aligned run
+ * @param  start: sector aligned start address
+ * @param  end: sector aligned end address
+ * @param  cmd: [out] erase instruction
+ * @param  timeout: [out] maximum erase time, 0 for device default
+ * @retval size erased by instruction
+ */
+static uint32_t flashspi_erase_unit (uint32_t start, uint32_t end,
+                                     uint8_t *cmd, uint32_t *timeout)
+{
+   if (spiflash->be64_cmd && !(start % FLASHSPI_BE64_SIZE) &&
+       end - start >= FLASHSPI_BE64_SIZE)
+   {
+      *cmd     = spiflash->be64_cmd;
+      *timeout = spiflash->tbe64;
+      return FLASHSPI_BE64_SIZE;
+   }
+
+   if (spiflash->be32_cmd && !(start % FLASHSPI_BE32_SIZE) &&
+       end - start >= FLASHSPI_BE32_SIZE)
+   {
+      *cmd     = spiflash->be32_cmd;
+      *timeout = spiflash->tbe32;
+      return FLASHSPI_BE32_SIZE;
+   }
+
+   *cmd     = spiflash->se_cmd ? spiflash->se_cmd : FLASHSPI_CMD_SE;
+   *timeout = spiflash->tse;
+   return spiflash->sectorsize;
+}
+
+/**
+ * @brief  Checks if range is erased, reading page by page and
+ *         stopping on first programmed byte
+ * @param  addr: start address
+ * @param  size: number of bytes
+ * @retval 1 if all bytes are 0xff, 0 otherwise or on read error
+ */
+static uint8_t flashspi_is_blank (uint32_t addr, uint32_t size)
+{
+   uint32_t cnt;
+
+   for (cnt = 0; cnt < size; cnt++)
+   {
+      if (!(cnt % spiflash->pagesize) &&
+          flashspi_read (gtmpbuff, addr + cnt, spiflash->pagesize) != FLASHSPI_OK)
+      {
+         return 0;
+      }
+      if (gtmpbuff[cnt % spiflash->pagesize] != 0xff)
+         return 0;
+   }
+
+   return 1;
+}
+
+/**
+ * @brief  Issues next step of operation in progress, page program
+ *         or erase instruction, completes operation if none is left.
+ * @retval None
+ */
+static void flashspi_op_step (void)
+{
+   flashspi_op_t *op = op_head;
+   uint32_t start, end, size, timeout;
+   uint8_t cmd;
+
+   switch (op->type)
+   {
+      case FLASHSPI_OP_PROGRAM:
+         if (op->pos < op->len)
+         {
+            size = spiflash->pagesize - ((op->addr + op->pos) % spiflash->pagesize);
+            if (size > op->len - op->pos)
+            {
+               size = op->len - op->pos;
+            }
+            flashspi_page_program (op->buf + op->pos, op->addr + op->pos, size);
+            op->pos += size;
+            flashspi_op_issue (spiflash->tpp);
+            return;
+         }
+         break;
+
+      case FLASHSPI_OP_ERASE:
+         /* sectors fully covered, same as flashspi_erase_range */
+         end = op->addr + op->len;
+         end -= end % spiflash->sectorsize;
+         start = op->addr + op->pos + spiflash->sectorsize - 1;
+         start -= start % spiflash->sectorsize;
+
+         while (start < end)
+         {
+            size = flashspi_erase_unit (start, end, &cmd, &timeout);
+            op->pos = start + size - op->addr;
+
+            if (!flashspi_is_blank (start, size))
+            {
+               flashspi_erase_cmd (cmd, start);
+               flashspi_op_issue (timeout);
+               return;
+            }
+
+            start += size;
+         }
+         break;
+
+      case FLASHSPI_OP_CHIP_ERASE:
+         if (!op->pos)
+         {
+            flashspi_write_enable ();
+            flashspi_send_cmd (FLASHSPI_CMD_CE);
+            op->pos = op->len;
+            flashspi_op_issue (spiflash->tce);
+            return;
+         }
+         break;
+   }
+
+   flashspi_op_done (FLASHSPI_OK);
+}
+
+/**
+ * @brief  Marks device busy with a step of operation in progress
+ * @param  timeout: maximum step time, 0 for device default
+ * @retval None
+ */
+static void flashspi_op_issue (uint32_t timeout)
+{
+   if (!timeout)
+   {
+      timeout = spiflash->tce ? spiflash->tce : OP_TIMEOUT_MS;
+   }
+
+   op_busy    = 1;
+   op_timeout = timeout;
+   op_time    = GetTick ();
+   op_poll    = op_time;
+}
+
+/**
+ * @brief  Waits for end of current step of operation in progress,
+ *         further steps are left to flashspi_task.
+ * @retval None
+ */
+static void flashspi_op_wait (void)
+{
+   uint32_t elapsed;
+
+   if (!op_busy)
+   {
+      return;
+   }
+
+   elapsed = GetTick () - op_time;
+
+   if (flashspi_wait_ready (elapsed < op_timeout ? op_timeout - elapsed : 0) != FLASHSPI_OK)
+   {
+      flashspi_op_done (FLASHSPI_ERROR_TIMEOUT);
+      return;
+   }
+
+   op_busy = 0;
+}
+
+/**
+ * @brief  Completes operation in progress and calls its callback,
+ *         next one on queue is started by flashspi_task.
+ * @param  res: operation result
+ * @retval None
+ */
+static void flashspi_op_done (flashspi_res_t res)
+{
+   flashspi_op_t *op = op_head;
+
+   op_head = op->next;
+   op_busy = 0;
+   op->res = res;
+
+   if (op->done)
+   {
+      op->done (op);
+   }
+}
+
+/**
+ * @brief  Compares flash data against new data
+ * @param  stored: flash contents
+ * @param  data: data to be written
+ * @param  len: number of bytes
+ * @param  flags: conditions still to be checked, FLASHSPI_DATA_xxx
+ * @retval conditions that hold for whole range
+ */
+static uint8_t flashspi_compare (const uint8_t *stored, const uint8_t *data,
+                                 uint32_t len, uint8_t flags)
+{
+   for (uint32_t cnt = 0; cnt < len && flags; cnt++)
+   {
+      if (stored[cnt] != data[cnt])
+         flags &= ~FLASHSPI_DATA_SAME;
+      if ((stored[cnt] & data[cnt]) != data[cnt])
+         flags &= ~FLASHSPI_DATA_PROG;
+   }
+   return flags;
+}
+
+/**
+ * @brief  Programs only changed bytes of each page, flash
+ *         range must not need erase for new data
+ * @param  stored: flash contents
+ * @param  pbuffer: data to be written
+ * @param  writeaddr: flash address
+ * @param  len: number of bytes
+ * @retval None
+ */
+static void flashspi_write_changed (const uint8_t *stored, const uint8_t *pbuffer,
+                                    uint32_t writeaddr, uint32_t len)
+{
+   uint32_t chunk, first, last;
+
+   while (len)
+   {
+      chunk = spiflash->pagesize - (writeaddr % spiflash->pagesize);
+      if (chunk > len)
+      {
+         chunk = len;
+      }
+
+      for (first = 0; first < chunk && stored[first] == pbuffer[first]; first++);
+
+      if (first < chunk)
+      {
+         for (last = chunk; stored[last - 1] == pbuffer[last - 1]; last--);
+         flashspi_write_page (pbuffer + first, writeaddr + first, last - first);
+      }
+
+      stored    += chunk;
+      pbuffer   += chunk;
+      writeaddr += chunk;
+      len       -= chunk;
+   }
 }
@@ -37,6 +37,11 @@
 #define GD25LQ16_SR_EX_WEL      (1<<1)  // <! Write enable latch >
 #define GD25LQ16_SR_EX_WIP      (1<<0)  // <! Write in progress >
 #define GIGADEVICE_tCE          30000
+#define GIGADEVICE_tSE          500     // Maximum sector erase time (ms)
+#define GIGADEVICE_tBE32        1500    // Maximum 32kB block erase time (ms)
+#define GIGADEVICE_tBE64        2000    // Maximum 64kB block erase time (ms)
+#define GD25LQ16_fR             80000000 // Maximum read clock (Hz)
+#define GD25LQ16_fC             104000000 // Maximum fast read clock (Hz)
 #ifdef GD25LQ16_SR_VOLATILE
 static void gd25lq16_cmd_vsrwren (void)
 {
@@ -96,6 +101,15 @@ const flashspi_t gd25lq16 =
     .size = GD25LQ16_SIZE,
     .pagesize = GD25LQ16_PAGE_SIZE,
     .sectorsize = GD25LQ16_SECTOR_SIZE,
+    .be32_cmd = FLASHSPI_CMD_BE32,
+    .be64_cmd = FLASHSPI_CMD_BE64,
+    .sus_cmd = FLASHSPI_CMD_SUSPEND,
+    .res_cmd = FLASHSPI_CMD_RESUME,
+    .tse = GIGADEVICE_tSE,
+    .tbe32 = GIGADEVICE_tBE32,
+    .tbe64 = GIGADEVICE_tBE64,
+    .fr = GD25LQ16_fR,
+    .fc = GD25LQ16_fC,
     .init = gd25lq16_init,
     .wait_ready = gigadevice_wait_ready
 };
\ No newline at end of file
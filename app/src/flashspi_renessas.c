@@ -44,6 +44,11 @@
 
 
 #define RENESSAS_tCE            30000UL  //Maximum chip erase time (30s)
+#define RENESSAS_tSE            400      //Maximum sector erase time (ms)
+#define RENESSAS_tBE32          1300     //Maximum 32kB block erase time (ms)
+#define RENESSAS_tBE64          3000     //Maximum 64kB block erase time (ms)
+#define AT25SF321B_fR           50000000 //Maximum read clock (Hz)
+#define AT25SF321B_fC           108000000 //Maximum fast read clock (Hz)
 
 static uint8_t renessas_rdsr_ex(uint8_t status)
 {
@@ -92,6 +97,15 @@ const flashspi_t at25sf321b =
     .size = 0x00400000, /*4m byte*/
     .pagesize = 256,
     .sectorsize = 0x1000,
+    .be32_cmd = FLASHSPI_CMD_BE32,
+    .be64_cmd = FLASHSPI_CMD_BE64,
+    .sus_cmd = FLASHSPI_CMD_SUSPEND,
+    .res_cmd = FLASHSPI_CMD_RESUME,
+    .tse = RENESSAS_tSE,
+    .tbe32 = RENESSAS_tBE32,
+    .tbe64 = RENESSAS_tBE64,
+    .fr = AT25SF321B_fR,
+    .fc = AT25SF321B_fC,
     .init = at25sf321b_init,
     .wait_ready = renessas_wait_ready
 };
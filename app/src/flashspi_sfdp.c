@@ -0,0 +1,348 @@
+// =============================================================================
+/*!
+ * @file       flashspi_sfdp.c
+ *
+ * This file contains serial flash discoverable parameters (JESD216) support
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stdio.h>
+#include "flashspi.h"
+#include "board.h"
+
+#define SFDP_SIGNATURE          0x50444653  // "SFDP"
+#define SFDP_BFPT_ID            0x00        // Basic flash parameter table id LSB
+#define SFDP_4BAIT_ID           0xFF84      // 4-byte address instruction table id
+#define SFDP_4BAIT_RW           0x43        // 4-byte read, fast read and page program
+#define SFDP_4BAIT_ERASE        9           // First 4-byte erase type bit
+#define SFDP_MAX_HEADERS        8           // Parameter headers searched
+#define SFDP_BFPT_MIN_DWORDS    9           // JESD216 table
+#define SFDP_BFPT_MAX_DWORDS    16          // JESD216B table, later dwords unused
+#define SFDP_ERASE_TYPES        4
+#define SFDP_NO_TYPE            0xff
+
+#define SFDP_fR                 33000000    // Read clock assumed for unknown devices (Hz)
+#define SFDP_fC                 50000000    // Fast read clock assumed for unknown devices (Hz)
+#define SFDP_tCE                100000UL    // Chip erase timeout when not in table (ms)
+
+/* time units of typical erase and program times */
+static const uint16_t sfdp_erase_unit[] = {1, 16, 128, 1000};       // ms
+static const uint32_t sfdp_chip_unit[]  = {16, 256, 4000, 64000};   // ms
+static const uint8_t  sfdp_prog_unit[]  = {8, 64};                  // us
+
+static flashspi_res_t sfdp_init (void)
+{
+   return FLASHSPI_OK;
+}
+
+static flashspi_res_t sfdp_wait_ready (void)
+{
+   return flashspi_wait_ready (SFDP_tCE);
+}
+
+/* Template for devices not on device table */
+static const flashspi_t sfdp_generic =
+{
+    .name = "SFDP",
+    .fr = SFDP_fR,
+    .fc = SFDP_fC,
+    .init = sfdp_init,
+    .wait_ready = sfdp_wait_ready
+};
+
+/**
+ * @brief  Reads sfdp data
+ * @param  addr: sfdp address
+ * @param  pbuffer: destination buffer
+ * @param  len: number of bytes to read
+ * @retval None
+ */
+static void sfdp_read (uint32_t addr, uint8_t *pbuffer, uint32_t len)
+{
+   uint8_t hdr[5] = {FLASHSPI_CMD_RDSFDP, addr >> 16, addr >> 8, addr, FLASH_DUMMY_BYTE};
+
+   spiflash_command (hdr, sizeof (hdr), NULL, pbuffer, len);
+}
+
+/**
+ * @brief  Reads sfdp header and basic flash parameter table, data that
+ *         is known and not blank on any device with sfdp
+ * @param  pbuffer: destination buffer, at least 16 bytes
+ * @param  len: buffer size
+ * @retval number of bytes read, 0 if device has no sfdp
+ */
+uint32_t flashspi_sfdp_tables (uint8_t *pbuffer, uint32_t len)
+{
+   uint32_t ptr, n;
+
+   sfdp_read (0, pbuffer, 16);
+
+   if ((pbuffer[0] | pbuffer[1] << 8 | pbuffer[2] << 16 | (uint32_t)pbuffer[3] << 24) != SFDP_SIGNATURE ||
+        pbuffer[8] != SFDP_BFPT_ID || pbuffer[11] < SFDP_BFPT_MIN_DWORDS)
+   {
+      return 0;
+   }
+
+   ptr = pbuffer[12] | pbuffer[13] << 8 | pbuffer[14] << 16;
+   n = pbuffer[11] * 4;
+
+   if (n > len - 16)
+      n = len - 16;
+
+   sfdp_read (ptr, pbuffer + 16, n);
+
+   return 16 + n;
+}
+
+/**
+ * @brief  Reads the two dwords of the 4-byte address instruction table
+ * @param  nph: number of parameter headers
+ * @param  ait: [out] table dwords
+ * @retval 1 if table was found, 0 otherwise
+ */
+static uint8_t sfdp_read_4bait (uint8_t nph, uint32_t *ait)
+{
+   uint8_t data[8];
+   uint8_t i;
+
+   if (nph > SFDP_MAX_HEADERS)
+   {
+      nph = SFDP_MAX_HEADERS;
+   }
+
+   /* first header is the bfpt */
+   for (i = 1; i < nph; i++)
+   {
+      sfdp_read (8 + i * 8, data, 8);
+
+      if ((data[0] | data[7] << 8) == SFDP_4BAIT_ID && data[3] >= 2)
+      {
+         sfdp_read (data[4] | data[5] << 8 | data[6] << 16, data, 8);
+         ait[0] = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+         ait[1] = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * @brief  Maximum time from typical time and multiplier
+ * @retval time limited to 16 bit
+ */
+static uint16_t sfdp_max_time (uint32_t typical, uint32_t mult)
+{
+   typical *= mult;
+   return (typical > 0xffff) ? 0xffff : typical;
+}
+
+/**
+ * @brief  Fills a device descriptor from the basic flash parameter table.
+ *         Fields not described by sfdp, name, init and clock limits,
+ *         come from the device table entry when given.
+ *
+ * @param  dev [out] device descriptor
+ * @param  quirks [in] device table entry for read id, may be NULL
+ * @param  mid [in] manufacturer/device id
+ *
+ * @retval FLASHSPI_OK on success, FLASHSPI_ERROR_ID if no valid sfdp
+ */
+flashspi_res_t flashspi_sfdp_probe (flashspi_t *dev, const flashspi_t *quirks, uint32_t mid)
+{
+   uint8_t data[SFDP_BFPT_MAX_DWORDS * 4];
+   uint32_t bfpt[SFDP_BFPT_MAX_DWORDS];
+   uint32_t ndwords, ptr, mult, t, size;
+   uint32_t ait[2];
+   uint8_t i, n, cmd, nph;
+   uint8_t se_type, be32_type, be64_type;
+   flashspi_t d;
+
+   /* sfdp header and first parameter header, always the bfpt */
+   sfdp_read (0, data, 16);
+
+   if ((data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24) != SFDP_SIGNATURE ||
+        data[8] != SFDP_BFPT_ID || data[11] < SFDP_BFPT_MIN_DWORDS)
+   {
+      return FLASHSPI_ERROR_ID;
+   }
+
+   nph = data[6] + 1;
+   ndwords = (data[11] > SFDP_BFPT_MAX_DWORDS) ? SFDP_BFPT_MAX_DWORDS : data[11];
+   ptr = data[12] | data[13] << 8 | data[14] << 16;
+
+   sfdp_read (ptr, data, ndwords * 4);
+
+   for (i = 0; i < ndwords; i++)
+   {
+      bfpt[i] = data[i * 4] | data[i * 4 + 1] << 8 | data[i * 4 + 2] << 16 |
+                (uint32_t)data[i * 4 + 3] << 24;
+   }
+
+   d = quirks ? *quirks : sfdp_generic;
+   d.mid = mid;
+
+   /* density in bits, N + 1 or 2^N */
+   if (bfpt[1] & 0x80000000)
+   {
+      t = bfpt[1] & 0x7fffffff;
+      if (t < 3 || t > 34)
+         return FLASHSPI_ERROR_ID;
+      d.size = 1UL << (t - 3);
+   }
+   else
+   {
+      d.size = (bfpt[1] + 1) >> 3;
+   }
+
+   /* page size was added on JESD216A */
+   d.pagesize = 256;
+   if (ndwords >= 11)
+   {
+      d.pagesize = 1UL << ((bfpt[10] >> 4) & 0xf);
+   }
+
+   /* erase types, smallest one is used as sector and
+    * 32kB/64kB ones as blocks, times are on JESD216A */
+   mult = (ndwords >= 10) ? 2 * ((bfpt[9] & 0xf) + 1) : 0;
+   d.sectorsize = 0;
+   d.se_cmd = d.be32_cmd = d.be64_cmd = 0;
+   d.tse = d.tbe32 = d.tbe64 = 0;
+   se_type = be32_type = be64_type = SFDP_NO_TYPE;
+
+   for (i = 0; i < SFDP_ERASE_TYPES; i++)
+   {
+      n   = bfpt[7 + i / 2] >> (16 * (i % 2));
+      cmd = bfpt[7 + i / 2] >> (16 * (i % 2) + 8);
+
+      if (!n || n > 16)
+         continue;
+
+      size = 1UL << n;
+      t = 0;
+      if (mult)
+      {
+         t = (bfpt[9] >> (4 + 7 * i)) & 0x7f;
+         t = sfdp_max_time (((t & 0x1f) + 1) * sfdp_erase_unit[t >> 5], mult);
+      }
+
+      if (!d.sectorsize || size < d.sectorsize)
+      {
+         d.sectorsize = size;
+         d.se_cmd     = cmd;
+         d.tse        = t;
+         se_type      = i;
+      }
+
+      if (size == FLASHSPI_BE32_SIZE)
+      {
+         d.be32_cmd = cmd;
+         d.tbe32    = t;
+         be32_type  = i;
+      }
+      else if (size == FLASHSPI_BE64_SIZE)
+      {
+         d.be64_cmd = cmd;
+         d.tbe64    = t;
+         be64_type  = i;
+      }
+   }
+
+   if (!d.sectorsize)
+   {
+      return FLASHSPI_ERROR_ID;
+   }
+
+   /* smallest erase is not a sector, leave it for block erase */
+   if (d.sectorsize == FLASHSPI_BE32_SIZE)
+   {
+      d.be32_cmd = 0;
+      be32_type  = SFDP_NO_TYPE;
+   }
+   if (d.sectorsize == FLASHSPI_BE64_SIZE)
+   {
+      d.be64_cmd = 0;
+      be64_type  = SFDP_NO_TYPE;
+   }
+
+   /* erase suspend instructions, JESD216A */
+   if (ndwords >= 13)
+   {
+      d.sus_cmd = 0;
+      d.res_cmd = 0;
+      if (!(bfpt[11] & 0x80000000))
+      {
+         d.sus_cmd = bfpt[12] >> 24;
+         d.res_cmd = bfpt[12] >> 16;
+      }
+   }
+
+   /* program and chip erase times */
+   d.tpp = 0;
+   d.tce = 0;
+   if (ndwords >= 11)
+   {
+      t = (bfpt[10] >> 8) & 0x3f;
+      t = ((t & 0x1f) + 1) * sfdp_prog_unit[t >> 5] * 2 * ((bfpt[10] & 0xf) + 1);
+      /* round up and allow for tick granularity */
+      d.tpp = (t + 999) / 1000 + 1;
+
+      t = (bfpt[10] >> 24) & 0x7f;
+      d.tce = ((t & 0x1f) + 1) * sfdp_chip_unit[t >> 5] * mult;
+   }
+
+   /* address bytes, 3, 3 or 4, 4 only */
+   switch ((bfpt[0] >> 17) & 3)
+   {
+      case 0:
+         d.addr4 = FLASHSPI_ADDR3;
+         break;
+
+      case 1:
+         d.addr4 = FLASHSPI_ADDR3;
+         if (d.size <= FLASHSPI_ADDR3_SIZE)
+            break;
+
+         /* prefer 4-byte instructions, they leave the device state
+          * untouched, when erases used have them too */
+         if (sfdp_read_4bait (nph, ait) &&
+             (ait[0] & SFDP_4BAIT_RW) == SFDP_4BAIT_RW &&
+             (ait[0] & (1UL << (SFDP_4BAIT_ERASE + se_type))))
+         {
+            d.addr4  = FLASHSPI_ADDR4_CMD;
+            d.se_cmd = ait[1] >> (8 * se_type);
+            d.be32_cmd = (be32_type != SFDP_NO_TYPE &&
+                          (ait[0] & (1UL << (SFDP_4BAIT_ERASE + be32_type)))) ?
+                          ait[1] >> (8 * be32_type) : 0;
+            d.be64_cmd = (be64_type != SFDP_NO_TYPE &&
+                          (ait[0] & (1UL << (SFDP_4BAIT_ERASE + be64_type)))) ?
+                          ait[1] >> (8 * be64_type) : 0;
+         }
+         /* enter 4-byte mode with B7, with or without write enable */
+         else if (ndwords >= 16 && (bfpt[15] >> 24) & 0x03)
+         {
+            d.addr4 = FLASHSPI_ADDR4_EN4B;
+         }
+         break;
+
+      case 2:
+         d.addr4 = FLASHSPI_ADDR4;
+         break;
+
+      default:
+         return FLASHSPI_ERROR_ID;
+   }
+
+   /* use the range reached with 3-byte address */
+   if (d.addr4 == FLASHSPI_ADDR3 && d.size > FLASHSPI_ADDR3_SIZE)
+   {
+      d.size = FLASHSPI_ADDR3_SIZE;
+   }
+
+   *dev = d;
+
+   return FLASHSPI_OK;
+}
@@ -15,12 +15,23 @@
 #define W25Q64_M_ID             0xEF16
 #define W25Q64_DEV_ID           0xEF4017  // Single
 #define W25Q128_M_ID            0xEF17
+#define W25Q256_M_ID            0xEF18
+#define W25Q512_M_ID            0xEF19
 #define W25X32_M_ID             0xEF15
 #define W25X32_DEV_ID           0xEF3016   // Manufacturer and device id
 #define W25X32_PAGE_SIZE        256
 #define W25X32_SECTOR_SIZE      0x1000     /* 4kB */
 #define W25X32_SIZE             0x00400000 /* 4MB */
 #define WINBOND_tCE             100000UL    // 100s
+#define WINBOND_tSE             400         // Maximum sector erase time (ms)
+#define WINBOND_tBE32           1600        // Maximum 32kB block erase time (ms)
+#define WINBOND_tBE64           2000        // Maximum 64kB block erase time (ms)
+#define W25X32_tSE              300
+#define W25X32_tBE              1000
+#define W25X32_fR               33000000    // Maximum read clock (Hz)
+#define W25X32_fC               75000000    // Maximum fast read clock (Hz)
+#define W25Q_fR                 50000000
+#define W25Q_fC                 104000000
 #define W25X32_CMD_WRSR         0x01
 #define W25X32_CMD_WRITE_DIS    0x04
 #define W25X32_CMD_READ_FAST    0x0B
@@ -49,6 +60,11 @@ const flashspi_t w25x32 =
     .size = W25X32_SIZE,
     .pagesize = W25X32_PAGE_SIZE,
     .sectorsize = W25X32_SECTOR_SIZE,
+    .be64_cmd = W25X32_CMD_BLOCK_ERASE,
+    .tse = W25X32_tSE,
+    .tbe64 = W25X32_tBE,
+    .fr = W25X32_fR,
+    .fc = W25X32_fC,
     .init = w25x32_init,
     .wait_ready = winbond_wait_ready
 };
@@ -59,6 +75,15 @@ const flashspi_t w25q64 =
     .size = 0x00800000, /*8m byte*/
     .pagesize = 256,
     .sectorsize = 0x1000,
+    .be32_cmd = FLASHSPI_CMD_BE32,
+    .be64_cmd = FLASHSPI_CMD_BE64,
+    .sus_cmd = FLASHSPI_CMD_SUSPEND,
+    .res_cmd = FLASHSPI_CMD_RESUME,
+    .tse = WINBOND_tSE,
+    .tbe32 = WINBOND_tBE32,
+    .tbe64 = WINBOND_tBE64,
+    .fr = W25Q_fR,
+    .fc = W25Q_fC,
     .init = w25q_init,
     .wait_ready = winbond_wait_ready
 };
@@ -69,6 +94,55 @@ const flashspi_t w25q128 =
     .size = 0x01000000, /*16m byte*/
     .pagesize = 256,
     .sectorsize = 0x1000,
+    .be32_cmd = FLASHSPI_CMD_BE32,
+    .be64_cmd = FLASHSPI_CMD_BE64,
+    .sus_cmd = FLASHSPI_CMD_SUSPEND,
+    .res_cmd = FLASHSPI_CMD_RESUME,
+    .tse = WINBOND_tSE,
+    .tbe32 = WINBOND_tBE32,
+    .tbe64 = WINBOND_tBE64,
+    .fr = W25Q_fR,
+    .fc = W25Q_fC,
+    .init = w25q_init,
+    .wait_ready = winbond_wait_ready
+};
+const flashspi_t w25q256 =
+{
+    .name = "W25Q256",
+    .mid = W25Q256_M_ID,
+    .size = 0x02000000, /*32m byte*/
+    .pagesize = 256,
+    .sectorsize = 0x1000,
+    .be32_cmd = FLASHSPI_CMD_BE32,
+    .be64_cmd = FLASHSPI_CMD_BE64,
+    .sus_cmd = FLASHSPI_CMD_SUSPEND,
+    .res_cmd = FLASHSPI_CMD_RESUME,
+    .addr4 = FLASHSPI_ADDR4_EN4B,
+    .tse = WINBOND_tSE,
+    .tbe32 = WINBOND_tBE32,
+    .tbe64 = WINBOND_tBE64,
+    .fr = W25Q_fR,
+    .fc = W25Q_fC,
+    .init = w25q_init,
+    .wait_ready = winbond_wait_ready
+};
+const flashspi_t w25q512 =
+{
+    .name = "W25Q512",
+    .mid = W25Q512_M_ID,
+    .size = 0x04000000, /*64m byte*/
+    .pagesize = 256,
+    .sectorsize = 0x1000,
+    .be32_cmd = FLASHSPI_CMD_BE32,
+    .be64_cmd = FLASHSPI_CMD_BE64,
+    .sus_cmd = FLASHSPI_CMD_SUSPEND,
+    .res_cmd = FLASHSPI_CMD_RESUME,
+    .addr4 = FLASHSPI_ADDR4_EN4B,
+    .tse = WINBOND_tSE,
+    .tbe32 = WINBOND_tBE32,
+    .tbe64 = WINBOND_tBE64,
+    .fr = W25Q_fR,
+    .fc = W25Q_fC,
     .init = w25q_init,
     .wait_ready = winbond_wait_ready
 };
@@ -0,0 +1,733 @@
+// =============================================================================
+/*!
+ * @file       ftl.c
+ *
+ * This file contains a log structured flash translation layer for spi flash.
+ *
+ * Logical sectors are written out of place into pre-erased blocks, so a
+ * sector write is a plain page program instead of a read-erase-rewrite of
+ * the whole flash sector. Each flash sector (block) holds a header on its
+ * first logical sector followed by data slots:
+ *
+ *   | magic | erase count | sequence | lba of slot 1..n | slot 1 | ... | slot n |
+ *
+ * Fields are programmed as blocks are used, data before the lba that owns
+ * it, so that an interrupted write never maps garbage. The map is rebuilt
+ * from headers on mount, newest copy is the one on the block with higher
+ * sequence or on a later slot of the same block.
+ *
+ * Stale slots are reclaimed by moving the valid ones of a victim block and
+ * erasing it, on demand before writes and in background while idle. New
+ * blocks are taken by lowest erase count and cold blocks are moved when
+ * erase counts spread over FTL_WL_THRESHOLD.
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stddef.h>
+#include <string.h>
+#include "ftl.h"
+#include "board.h"
+
+#define FTL_MAGIC               0x4C544642  /* "BFTL" */
+#define FTL_MAX_BLOCKS          (FTL_MAX_SIZE / FTL_MIN_BLOCK_SIZE)
+#define FTL_MAP_ENTRIES         (FTL_MAX_BLOCKS * (FTL_MIN_BLOCK_SIZE / FTL_SECTOR_SIZE - 1))
+#define FTL_UNMAPPED            0xFFFF
+#define FTL_NONE                0xFFFF
+#define FTL_SLOT_SHIFT          4
+
+#define FTL_PHYS(blk, slot)     (uint16_t)(((blk) << FTL_SLOT_SHIFT) | (slot))
+#define FTL_PHYS_BLK(phys)      ((phys) >> FTL_SLOT_SHIFT)
+#define FTL_PHYS_SLOT(phys)     ((phys) & ((1 << FTL_SLOT_SHIFT) - 1))
+
+#if FTL_SPARE_BLOCKS < 3
+#error "ftl needs at least 3 spare blocks"
+#endif
+
+#define PRINT_FTL_DBG 0
+
+#if PRINT_FTL_DBG && ENABLE_DBG_LOG
+   #define PRINT_FTL(fmt, ...) dbg_log("[FTL] "fmt, ##__VA_ARGS__)
+#else
+   #define PRINT_FTL(...)
+#endif
+
+enum {
+   FTL_BLK_UNFMT = 0,      /* contents unknown, must be erased before use */
+   FTL_BLK_FREE,           /* erased with header, not yet written */
+   FTL_BLK_OPEN,           /* currently receiving writes */
+   FTL_BLK_USED            /* written, candidate for gc */
+};
+
+typedef struct {
+   uint32_t magic;
+   uint32_t erase_cnt;
+   uint32_t seq;
+   uint16_t lba[FTL_MAX_SLOTS];
+}ftl_hdr_t;
+
+typedef struct {
+   uint32_t blksize;
+   uint32_t seq;           /* sequence of next opened block */
+   uint32_t tick;          /* time of last access */
+   uint16_t nblk;
+   uint16_t nlba;
+   uint16_t nfree;         /* blocks free or unformatted */
+   uint16_t open;
+   uint8_t slots;          /* data slots per block */
+   uint8_t next;           /* next slot of open block */
+   uint8_t mounted;
+}ftl_t;
+
+static ftl_t ftl;
+static uint16_t ftl_map[FTL_MAP_ENTRIES];
+static uint8_t ftl_state[FTL_MAX_BLOCKS];
+static uint8_t ftl_valid[FTL_MAX_BLOCKS];
+static uint32_t ftl_erase_cnt[FTL_MAX_BLOCKS];
+static uint8_t ftl_buf[FTL_SECTOR_SIZE];
+
+/**
+ * @brief  Changes block state keeping free blocks count
+ * @param  blk: block number
+ * @param  state: new state
+ */
+static void ftl_set_state (uint16_t blk, uint8_t state)
+{
+   ftl.nfree += (state <= FTL_BLK_FREE);
+   ftl.nfree -= (ftl_state[blk] <= FTL_BLK_FREE);
+   ftl_state[blk] = state;
+}
+
+/**
+ * @brief  Flash address of a slot
+ * @param  blk: block number
+ * @param  slot: slot number, 0 is header
+ * @retval flash address
+ */
+static uint32_t ftl_addr (uint16_t blk, uint8_t slot)
+{
+   return blk * ftl.blksize + slot * FTL_SECTOR_SIZE;
+}
+
+/**
+ * @brief  Erases a block and writes its header, block becomes free
+ * @param  blk: block number
+ * @retval flash operation result
+ */
+static flashspi_res_t ftl_format (uint16_t blk)
+{
+   flashspi_res_t res;
+   ftl_hdr_t hdr;
+
+   //PRINT_FTL("format block %u, erase count %u\n", blk, ftl_erase_cnt[blk]);
+   ftl_set_state (blk, FTL_BLK_UNFMT);
+   ftl_valid[blk] = 0;
+
+   res = flashspi_erase_sector (ftl_addr (blk, 0));
+   if (res != FLASHSPI_OK)
+   {
+      return res;
+   }
+
+   ftl_erase_cnt[blk]++;
+   hdr.magic     = FTL_MAGIC;
+   hdr.erase_cnt = ftl_erase_cnt[blk];
+
+   res = flashspi_program ((const uint8_t *)&hdr, ftl_addr (blk, 0),
+                           offsetof (ftl_hdr_t, seq));
+   if (res == FLASHSPI_OK)
+   {
+      ftl_set_state (blk, FTL_BLK_FREE);
+   }
+   return res;
+}
+
+/**
+ * @brief  Takes least worn free block for writing, formatting it
+ *         if needed
+ * @retval flash operation result
+ */
+static flashspi_res_t ftl_open_block (void)
+{
+   flashspi_res_t res;
+   uint16_t blk, best = FTL_NONE;
+   uint32_t seq;
+
+   for (blk = 0; blk < ftl.nblk; blk++)
+   {
+      if (ftl_state[blk] > FTL_BLK_FREE)
+      {
+         continue;
+      }
+      /* prefer already erased blocks */
+      if (best == FTL_NONE || ftl_state[blk] > ftl_state[best] ||
+          (ftl_state[blk] == ftl_state[best] && ftl_erase_cnt[blk] < ftl_erase_cnt[best]))
+      {
+         best = blk;
+      }
+   }
+
+   if (best == FTL_NONE)
+   {
+      return FLASHSPI_ERROR_NOMEM;
+   }
+
+   if (ftl_state[best] == FTL_BLK_UNFMT)
+   {
+      res = ftl_format (best);
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+   }
+
+   seq = ftl.seq++;
+   res = flashspi_program ((const uint8_t *)&seq,
+                           ftl_addr (best, 0) + offsetof (ftl_hdr_t, seq), sizeof (seq));
+   if (res != FLASHSPI_OK)
+   {
+      return res;
+   }
+
+   if (ftl.open != FTL_NONE)
+   {
+      ftl_set_state (ftl.open, FTL_BLK_USED);
+   }
+   ftl_set_state (best, FTL_BLK_OPEN);
+   ftl.open = best;
+   ftl.next = 1;
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Drops current copy of a logical sector
+ * @param  lba: logical sector
+ */
+static void ftl_unmap (uint16_t lba)
+{
+   uint16_t phys = ftl_map[lba];
+
+   if (phys != FTL_UNMAPPED)
+   {
+      ftl_valid[FTL_PHYS_BLK (phys)]--;
+      ftl_map[lba] = FTL_UNMAPPED;
+   }
+}
+
+/**
+ * @brief  Writes a logical sector on next slot of open block
+ * @param  lba: logical sector
+ * @param  pbuffer: sector data
+ * @retval flash operation result
+ */
+static flashspi_res_t ftl_put (uint16_t lba, const uint8_t *pbuffer)
+{
+   flashspi_res_t res;
+   uint16_t blk;
+   uint8_t slot;
+
+   if (ftl.open == FTL_NONE || ftl.next > ftl.slots)
+   {
+      res = ftl_open_block ();
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+   }
+
+   blk  = ftl.open;
+   slot = ftl.next++;
+
+   res = flashspi_program (pbuffer, ftl_addr (blk, slot), FTL_SECTOR_SIZE);
+   if (res != FLASHSPI_OK)
+   {
+      return res;
+   }
+
+   res = flashspi_program ((const uint8_t *)&lba, ftl_addr (blk, 0) +
+                           offsetof (ftl_hdr_t, lba) + (slot - 1) * sizeof (lba), sizeof (lba));
+   if (res != FLASHSPI_OK)
+   {
+      return res;
+   }
+
+   ftl_unmap (lba);
+   ftl_map[lba] = FTL_PHYS (blk, slot);
+   ftl_valid[blk]++;
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Selects gc victim, block with fewest valid slots
+ * @param  maxvalid: maximum number of valid slots on victim
+ * @retval block number, FTL_NONE if none
+ */
+static uint16_t ftl_gc_pick (uint8_t maxvalid)
+{
+   uint16_t blk, best = FTL_NONE;
+
+   for (blk = 0; blk < ftl.nblk; blk++)
+   {
+      if (ftl_state[blk] != FTL_BLK_USED || ftl_valid[blk] > maxvalid)
+      {
+         continue;
+      }
+      if (best == FTL_NONE || ftl_valid[blk] < ftl_valid[best] ||
+          (ftl_valid[blk] == ftl_valid[best] && ftl_erase_cnt[blk] < ftl_erase_cnt[best]))
+      {
+         best = blk;
+      }
+   }
+
+   return best;
+}
+
+/**
+ * @brief  Moves valid slots of a block to open block and erases it
+ * @param  blk: victim block
+ * @retval flash operation result
+ */
+static flashspi_res_t ftl_gc_block (uint16_t blk)
+{
+   flashspi_res_t res;
+   ftl_hdr_t hdr;
+   uint16_t lba;
+   uint8_t slot;
+
+   //PRINT_FTL("gc block %u, %u valid\n", blk, ftl_valid[blk]);
+   res = flashspi_read ((uint8_t *)&hdr, ftl_addr (blk, 0), sizeof (hdr));
+   if (res != FLASHSPI_OK)
+   {
+      return res;
+   }
+
+   for (slot = 1; slot <= ftl.slots && ftl_valid[blk]; slot++)
+   {
+      lba = hdr.lba[slot - 1];
+      if (lba >= ftl.nlba || ftl_map[lba] != FTL_PHYS (blk, slot))
+      {
+         continue;
+      }
+
+      res = flashspi_read (ftl_buf, ftl_addr (blk, slot), FTL_SECTOR_SIZE);
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+
+      res = ftl_put (lba, ftl_buf);
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+   }
+
+   return ftl_format (blk);
+}
+
+/**
+ * @brief  Collects blocks until enough are free for a write. With no
+ *         free block left, as after power loss during gc, only a victim
+ *         that fits on open block can be collected.
+ * @retval flash operation result
+ */
+static flashspi_res_t ftl_reserve (void)
+{
+   flashspi_res_t res;
+   uint16_t blk, n;
+   uint8_t maxvalid;
+
+   for (n = 0; ftl.nfree < FTL_GC_FREE_BLOCKS; n++)
+   {
+      maxvalid = ftl.slots - 1;
+      if (ftl.nfree == 0)
+      {
+         maxvalid = (ftl.open == FTL_NONE) ? 0 : ftl.slots + 1 - ftl.next;
+      }
+
+      blk = ftl_gc_pick (maxvalid);
+      if (blk == FTL_NONE || n == ftl.nblk)
+      {
+         return FLASHSPI_ERROR_NOMEM;
+      }
+
+      res = ftl_gc_block (blk);
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Scans block headers and builds logical to physical map.
+ *         Blocks without header are erased when first needed.
+ * @retval flash operation result
+ */
+flashspi_res_t ftl_mount (void)
+{
+   flashspi_res_t res;
+   ftl_hdr_t hdr;
+   uint32_t size, seq, cnt, sum = 0;
+   uint16_t blk, lba, phys, known = 0, last = FTL_NONE;
+   uint8_t slot, next = 1;
+
+   ftl.mounted = 0;
+   ftl.blksize = flashspi_get_sector_size ();
+   size        = flashspi_get_size ();
+
+   if (ftl.blksize < FTL_MIN_BLOCK_SIZE ||
+       ftl.blksize / FTL_SECTOR_SIZE - 1 > FTL_MAX_SLOTS)
+   {
+      return FLASHSPI_ERROR_NOMEM;
+   }
+
+   if (size > FTL_MAX_SIZE)
+   {
+      size = FTL_MAX_SIZE;
+   }
+
+   ftl.slots = ftl.blksize / FTL_SECTOR_SIZE - 1;
+   ftl.nblk  = size / ftl.blksize;
+
+   if (ftl.nblk <= FTL_SPARE_BLOCKS)
+   {
+      return FLASHSPI_ERROR_NOMEM;
+   }
+
+   ftl.nlba = (ftl.nblk - FTL_SPARE_BLOCKS) * ftl.slots;
+   if (ftl.nlba > FTL_MAP_ENTRIES)
+   {
+      ftl.nlba = FTL_MAP_ENTRIES;
+   }
+
+   memset (ftl_map, 0xff, sizeof (ftl_map));
+   ftl.nfree = 0;
+   ftl.open  = FTL_NONE;
+   ftl.seq   = 0;
+
+   for (blk = 0; blk < ftl.nblk; blk++)
+   {
+      ftl_state[blk] = FTL_BLK_USED;
+      ftl_valid[blk] = 0;
+
+      res = flashspi_read ((uint8_t *)&hdr, ftl_addr (blk, 0), sizeof (hdr));
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+
+      if (hdr.magic != FTL_MAGIC)
+      {
+         ftl_set_state (blk, FTL_BLK_UNFMT);
+         ftl_erase_cnt[blk] = 0;
+         continue;
+      }
+
+      ftl_erase_cnt[blk] = hdr.erase_cnt;
+      sum += hdr.erase_cnt;
+      known++;
+
+      if (hdr.seq == 0xFFFFFFFF)
+      {
+         ftl_set_state (blk, FTL_BLK_FREE);
+         continue;
+      }
+
+      /* opened block without data, sequence may be left half programmed
+         by power loss and must not be taken as newest */
+      for (slot = 0; slot < ftl.slots && hdr.lba[slot] == FTL_UNMAPPED; slot++);
+
+      if (slot == ftl.slots)
+      {
+         ftl_set_state (blk, FTL_BLK_UNFMT);
+         continue;
+      }
+
+      if (hdr.seq >= ftl.seq)
+      {
+         ftl.seq = hdr.seq + 1;
+         last    = blk;
+         next    = 1;
+      }
+
+      for (slot = 1; slot <= ftl.slots; slot++)
+      {
+         lba = hdr.lba[slot - 1];
+         if (lba != FTL_UNMAPPED && last == blk)
+         {
+            next = slot + 1;
+         }
+         if (lba >= ftl.nlba)
+         {
+            continue;
+         }
+
+         phys = ftl_map[lba];
+         if (phys != FTL_UNMAPPED)
+         {
+            if (FTL_PHYS_BLK (phys) != blk)
+            {
+               res = flashspi_read ((uint8_t *)&seq, ftl_addr (FTL_PHYS_BLK (phys), 0) +
+                                    offsetof (ftl_hdr_t, seq), sizeof (seq));
+               if (res != FLASHSPI_OK)
+               {
+                  return res;
+               }
+               if (seq > hdr.seq)
+               {
+                  continue;
+               }
+            }
+            ftl_unmap (lba);
+         }
+
+         ftl_map[lba] = FTL_PHYS (blk, slot);
+         ftl_valid[blk]++;
+      }
+   }
+
+   /* resume newest block, as gc may have taken last free block for it.
+      slots holding data of an interrupted write are skipped */
+   for (; last != FTL_NONE && next <= ftl.slots; next++)
+   {
+      res = flashspi_read (ftl_buf, ftl_addr (last, next), FTL_SECTOR_SIZE);
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+
+      for (cnt = 0; cnt < FTL_SECTOR_SIZE && ftl_buf[cnt] == 0xff; cnt++);
+
+      if (cnt == FTL_SECTOR_SIZE)
+      {
+         ftl_set_state (last, FTL_BLK_OPEN);
+         ftl.open = last;
+         ftl.next = next;
+         break;
+      }
+   }
+
+   /* blocks that lost header on an interrupted erase get average wear */
+   for (blk = 0; blk < ftl.nblk && known; blk++)
+   {
+      if (ftl_state[blk] == FTL_BLK_UNFMT)
+      {
+         ftl_erase_cnt[blk] = sum / known;
+      }
+   }
+
+   PRINT_FTL("%u blocks, %u free, %u sectors\n", ftl.nblk, ftl.nfree, ftl.nlba);
+   ftl.tick    = GetTick ();
+   ftl.mounted = 1;
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Reads logical sectors, unwritten sectors read as erased
+ * @param  pbuffer: buffer that receives data
+ * @param  readaddr: logical address, multiple of FTL_SECTOR_SIZE
+ * @param  numbytetoread: number of bytes, multiple of FTL_SECTOR_SIZE
+ * @retval flash operation result
+ */
+flashspi_res_t ftl_read (uint8_t *pbuffer, uint32_t readaddr, uint32_t numbytetoread)
+{
+   flashspi_res_t res;
+   uint32_t lba, n, cnt;
+   uint16_t phys;
+
+   if (!ftl.mounted || readaddr % FTL_SECTOR_SIZE || numbytetoread % FTL_SECTOR_SIZE ||
+       readaddr + numbytetoread > ftl_get_size ())
+   {
+      return FLASHSPI_ERROR;
+   }
+
+   ftl.tick = GetTick ();
+   lba = readaddr / FTL_SECTOR_SIZE;
+   n   = numbytetoread / FTL_SECTOR_SIZE;
+
+   while (n)
+   {
+      phys = ftl_map[lba];
+      cnt  = 1;
+
+      if (phys == FTL_UNMAPPED)
+      {
+         memset (pbuffer, 0xff, FTL_SECTOR_SIZE);
+      }
+      else
+      {
+         /* merge sectors laid out consecutively on same block */
+         while (cnt < n && ftl_map[lba + cnt] == phys + cnt)
+         {
+            cnt++;
+         }
+
+         res = flashspi_read (pbuffer, ftl_addr (FTL_PHYS_BLK (phys), FTL_PHYS_SLOT (phys)),
+                              cnt * FTL_SECTOR_SIZE);
+         if (res != FLASHSPI_OK)
+         {
+            return res;
+         }
+      }
+
+      pbuffer += cnt * FTL_SECTOR_SIZE;
+      lba     += cnt;
+      n       -= cnt;
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Writes logical sectors out of place
+ * @param  pbuffer: data to be written
+ * @param  writeaddr: logical address, multiple of FTL_SECTOR_SIZE
+ * @param  numbytetowrite: number of bytes, multiple of FTL_SECTOR_SIZE
+ * @retval flash operation result
+ */
+flashspi_res_t ftl_write (const uint8_t *pbuffer, uint32_t writeaddr, uint32_t numbytetowrite)
+{
+   flashspi_res_t res;
+   uint32_t lba, n;
+
+   if (!ftl.mounted || writeaddr % FTL_SECTOR_SIZE || numbytetowrite % FTL_SECTOR_SIZE ||
+       writeaddr + numbytetowrite > ftl_get_size ())
+   {
+      return FLASHSPI_ERROR;
+   }
+
+   ftl.tick = GetTick ();
+   lba = writeaddr / FTL_SECTOR_SIZE;
+   n   = numbytetowrite / FTL_SECTOR_SIZE;
+
+   for (; n; n--, lba++, pbuffer += FTL_SECTOR_SIZE)
+   {
+      res = ftl_reserve ();
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+
+      res = ftl_put (lba, pbuffer);
+      if (res != FLASHSPI_OK)
+      {
+         return res;
+      }
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Discards logical sectors fully covered by range. Discard is
+ *         not recorded on flash, previous data may reappear after mount.
+ * @param  addr: logical address
+ * @param  len: range length in bytes
+ * @retval flash operation result
+ */
+flashspi_res_t ftl_discard (uint32_t addr, uint32_t len)
+{
+   uint32_t lba, end;
+
+   if (!ftl.mounted)
+   {
+      return FLASHSPI_ERROR;
+   }
+
+   if (addr >= ftl_get_size ())
+   {
+      return FLASHSPI_OK;
+   }
+
+   if (len > ftl_get_size () - addr)
+   {
+      len = ftl_get_size () - addr;
+   }
+
+   lba = (addr + FTL_SECTOR_SIZE - 1) / FTL_SECTOR_SIZE;
+   end = (addr + len) / FTL_SECTOR_SIZE;
+
+   for (; lba < end; lba++)
+   {
+      ftl_unmap (lba);
+   }
+
+   return FLASHSPI_OK;
+}
+
+/**
+ * @brief  Get exported size
+ * @retval size in bytes
+ */
+uint32_t ftl_get_size (void)
+{
+   return (ftl.mounted) ? ftl.nlba * FTL_SECTOR_SIZE : 0;
+}
+
+/**
+ * @brief  Background work, does one step per call after FTL_IDLE_MS
+ *         without accesses: erases unformatted blocks, collects blocks
+ *         while free count is low and moves cold data.
+ */
+void ftl_idle (void)
+{
+   uint16_t blk, cold = FTL_NONE;
+   uint32_t maxcnt = 0;
+
+   if (!ftl.mounted || (GetTick () - ftl.tick) < FTL_IDLE_MS)
+   {
+      return;
+   }
+
+   for (blk = 0; blk < ftl.nblk; blk++)
+   {
+      if (ftl_state[blk] == FTL_BLK_UNFMT)
+      {
+         ftl_format (blk);
+         return;
+      }
+   }
+
+   if (ftl.nfree < FTL_BG_FREE_BLOCKS)
+   {
+      /* only blocks where at least half is stale are worth it */
+      blk = ftl_gc_pick (ftl.slots / 2);
+      if (blk != FTL_NONE)
+      {
+         ftl_gc_block (blk);
+         return;
+      }
+   }
+
+   if (ftl.nfree < FTL_GC_FREE_BLOCKS)
+   {
+      return;
+   }
+
+   for (blk = 0; blk < ftl.nblk; blk++)
+   {
+      if (ftl_erase_cnt[blk] > maxcnt)
+      {
+         maxcnt = ftl_erase_cnt[blk];
+      }
+      if (ftl_state[blk] == FTL_BLK_USED &&
+          (cold == FTL_NONE || ftl_erase_cnt[blk] < ftl_erase_cnt[cold]))
+      {
+         cold = blk;
+      }
+   }
+
+   if (cold != FTL_NONE && maxcnt - ftl_erase_cnt[cold] > FTL_WL_THRESHOLD)
+   {
+      //PRINT_FTL("move cold block %u\n", cold);
+      ftl_gc_block (cold);
+   }
+}
@@ -262,6 +262,33 @@ static int resetCmd(int argc, char **argv)
     return CLI_OK;
 }
 
+#ifdef ENABLE_DISK_SPIFLASH
+static flashspi_op_t erase_op;
+static volatile uint8_t erase_done;
+
+static void flashEraseDone(flashspi_op_t *op)
+{
+    /* may be called from within a driver call, disk is
+       reinitialized later from main loop */
+    erase_done = 1;
+}
+
+static void flashEraseTask(void)
+{
+    /* dma read started before erase must end before bus is reset */
+    if(!erase_done || flashspi_busy())
+        return;
+
+    erase_done = 0;
+
+    if(erase_op.res != FLASHSPI_OK)
+        printf("Error %d\n", erase_op.res);
+    else
+        printf("Erase done\n");
+    /* drop disk state kept in ram, e.g. ftl map and write cache */
+    msc_disk_init(SPI_FLASH_LUN);
+}
+
 static int flashCmd(int argc, char **argv)
 {
     flashspi_res_t res;
@@ -290,11 +317,15 @@ static int flashCmd(int argc, char **argv)
         printf("Total size: %u (0x%08X) bytes\n", (unsigned int)fls->size, (unsigned int)fls->size);
         printf("Sector size: %u (0x%04X) bytes\n",  (unsigned int)fls->sectorsize,  (unsigned int)fls->sectorsize);
         printf("Page size: %u (0x%02X) bytes\n",  (unsigned int)fls->pagesize,  (unsigned int)fls->pagesize);
+        printf("Spi clock: %u Hz\n", (unsigned int)flashspi_get_clock());
         return CLI_OK;
     }
 
     if(!strcmp(argv[1], "erase")) {
-        res = flashspi_erase();
+        /* runs from main loop, result is printed when done */
+        erase_op.type = FLASHSPI_OP_CHIP_ERASE;
+        erase_op.done = flashEraseDone;
+        res = flashspi_submit(&erase_op);
         if(res != FLASHSPI_OK)
             printf("Error %d\n", res);
         return CLI_OK;
@@ -311,6 +342,7 @@ static int flashCmd(int argc, char **argv)
 
     return CLI_BAD_PARAM;
 }
+#endif
 
 static int unplugCmd(int argc, char **argv)
 {
@@ -343,7 +375,9 @@ cli_command_t cli_cmds [] = {
     {"mount", mountCmd},
     {"list", listCmd},
     {"cat", catCmd},
+#ifdef ENABLE_DISK_SPIFLASH
     {"flash", flashCmd},
+#endif
     {"sd", sdCardCmd},
 };
 #endif
@@ -428,13 +462,21 @@ int main(void)
 	NVIC_SetPriorityGrouping(NVIC_PRIORITY_GROUP_4);
 
     #ifdef ENABLE_DISK_SDCARD
-    sd_init();
+    msc_disk_init(SD_CARD_LUN);
     #endif
 
     #ifdef ENABLE_DISK_SPIFLASH
     msc_disk_init(SPI_FLASH_LUN);
     #endif
 
+    #ifdef ENABLE_DISK_INTFLASH
+    msc_disk_init(INTERNAL_FLASH_LUN);
+    #endif
+
+    #ifdef ENABLE_DISK_RAMDISK
+    msc_disk_init(RAMDISK_LUN);
+    #endif
+
     #ifdef ENABLE_CLI
     serial_init();
 
@@ -453,6 +495,12 @@ int main(void)
             CLI_HandleLine();
         }
         #endif
-        delay_ms(10);
+        #ifdef ENABLE_DISK_SPIFLASH
+        flashspi_task();
+        #ifdef ENABLE_CLI
+        flashEraseTask();
+        #endif
+        #endif
+        usb_task();
 	}
 }
@@ -25,7 +25,7 @@
 #include "usbd_core.h"
 #include "cdc_msc_class.h"
 #include "cdc_msc_desc.h"
-// #include "msc_bot_scsi.h"
+#include "msc_bot_scsi.h"
 
 /** @addtogroup AT32F415_middlewares_usbd_class
   * @{
@@ -255,7 +255,7 @@ static usb_sts_type msc_class_setup_handler(void *udev, usb_setup_type *setup)
 {
   usb_sts_type status = USB_OK;
   usbd_core_type *pudev = (usbd_core_type *)udev;
-  cdc_msc_struct_type *pmsc = (cdc_msc_struct_type *)pudev->class_handler->pdata;
+  msc_type *pmsc = &((cdc_msc_struct_type *)pudev->class_handler->pdata)->msc;
   switch(setup->bmRequestType & USB_REQ_TYPE_RESERVED)
   {
     /* class request */
@@ -264,7 +264,7 @@ static usb_sts_type msc_class_setup_handler(void *udev, usb_setup_type *setup)
       switch(setup->bRequest)
       {
         case MSC_REQ_GET_MAX_LUN:
-          usbd_ctrl_send(pudev, (uint8_t *)&cdc_msc_struct.max_lun, 1);
+          usbd_ctrl_send(pudev, (uint8_t *)&pmsc->max_lun, 1);
           break;
         case MSC_REQ_BO_RESET:
           bot_scsi_reset(udev);
@@ -443,9 +443,9 @@ static usb_sts_type class_event_handler(void *udev, usbd_event_type event)
     
       break;
     case USBD_SUSPEND_EVENT:
-      
-      /* ...user code... */
-    
+
+      /* write back cached data, host may power down the device */
+      bot_scsi_suspend(udev);
       break;
     case USBD_WAKEUP_EVENT:
       /* ...user code... */
@@ -44,27 +44,17 @@
 #endif
 ALIGNED_HEAD uint8_t page00_inquiry_data[] ALIGNED_TAIL = {
   0x00,
+  MSC_VPD_SUPPORTED_PAGES,
   0x00,
-  0x00,
-  0x00,
-  0x00,
-
+  0x03,
+  MSC_VPD_SUPPORTED_PAGES,
+  MSC_VPD_BLOCK_LIMITS,
+  MSC_VPD_LOGICAL_BLK_PROVISIONING,
 };
 #if defined ( __ICCARM__ ) /* iar compiler */
   #pragma data_alignment=4
 #endif
-ALIGNED_HEAD sense_type sense_data ALIGNED_TAIL =
-{
-  0x70,
-  0x00,
-  SENSE_KEY_ILLEGAL_REQUEST,
-  0x00000000,
-  0x0A,
-  0x00000000,
-  0x20,
-  0x00,
-  0x00000000
-};
+ALIGNED_HEAD sense_type sense_data[MSC_SUPPORT_MAX_LUN] ALIGNED_TAIL;
 
 #if defined ( __ICCARM__ ) /* iar compiler */
   #pragma data_alignment=4
@@ -95,6 +85,75 @@ ALIGNED_HEAD uint8_t mode_sense10_data[8] ALIGNED_TAIL =
   0x00,
   0x00
 };
+
+#if MSC_READ_PIPELINE && MSC_WRITE_BEHIND
+/* device whose disks run idle work, reads started meanwhile
+   may be served from within it by bot_scsi_read_serve() */
+static void *idle_udev = NULL;
+#endif
+
+#if MSC_READ_PIPELINE
+/* asynchronous disk read in progress, ended by bot_scsi_read_pipe_done() */
+static void *read_udev = NULL;
+static uint32_t read_tag;
+static uint32_t read_len;
+static uint8_t read_idx;
+#endif
+
+#if MSC_WRITE_BEHIND
+/* asynchronous disk write in progress, ended by bot_scsi_write_pipe_done() */
+static void *write_udev = NULL;
+static uint32_t write_tag;
+static uint32_t write_len;
+static uint8_t write_idx;
+#endif
+
+/**
+  * @brief  refresh capacity cache of a lun from its block device
+  * @param  pmsc: to the structure of msc_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_disk_capacity(msc_type *pmsc, uint8_t lun)
+{
+  const msc_disk_ops_type *disk = pmsc->disk[lun];
+  if(disk == NULL || disk->capacity == NULL)
+  {
+    return USB_FAIL;
+  }
+  return disk->capacity(&pmsc->blk_nbr[lun], &pmsc->blk_size[lun]);
+}
+
+/**
+  * @brief  flush volatile cache of a lun, disks without cache always succeed
+  * @param  pmsc: to the structure of msc_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_disk_sync(msc_type *pmsc, uint8_t lun)
+{
+  const msc_disk_ops_type *disk = pmsc->disk[lun];
+  if(disk == NULL || disk->sync == NULL)
+  {
+    return USB_OK;
+  }
+  return disk->sync();
+}
+
+/**
+  * @brief  check if lun supports unmap
+  * @param  pmsc: to the structure of msc_type
+  * @param  lun: logical units number
+  * @retval 1 if supported, 0 otherwise
+  */
+static uint8_t bot_scsi_disk_unmap_support(msc_type *pmsc, uint8_t lun)
+{
+#if MSC_SCSI_CMD_UNMAP
+  return (pmsc->disk[lun] != NULL && pmsc->disk[lun]->unmap != NULL) ? 1 : 0;
+#else
+  return 0;
+#endif
+}
 /**
   * @brief  initialize bulk-only transport and scsi
   * @param  udev: to the structure of usbd_core_type
@@ -104,6 +163,7 @@ void bot_scsi_init(void *udev)
 {
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t lun;
   pmsc->msc_state = MSC_STATE_MACHINE_IDLE;
   pmsc->bot_status = MSC_BOT_STATE_IDLE;
   pmsc->max_lun = MSC_SUPPORT_MAX_LUN - 1;
@@ -112,6 +172,30 @@ void bot_scsi_init(void *udev)
   pmsc->csw_struct.dCSWDataResidue = 0;
   pmsc->csw_struct.dCSWSignature = 0;
   pmsc->csw_struct.dCSWTag = CSW_BCSWSTATUS_PASS;
+  pmsc->sync_req = 0;
+  pmsc->read_direct = 0;
+  pmsc->cmd_handler = NULL;
+
+  for(lun = 0; lun < MSC_SUPPORT_MAX_LUN; lun ++)
+  {
+    pmsc->disk[lun] = msc_disk_get_ops(lun);
+
+    sense_data[lun].err_code = 0x70;
+    sense_data[lun].sense_key = SENSE_KEY_ILLEGAL_REQUEST;
+    sense_data[lun].as_length = 0x0A;
+    sense_data[lun].asc = INVALID_COMMAND;
+
+    /* prime capacity cache, refreshed on test unit and read capacity */
+    if(bot_scsi_disk_capacity(pmsc, lun) != USB_OK)
+    {
+      pmsc->blk_nbr[lun] = 0;
+    }
+  }
+
+#if MSC_DATA_PIPE
+  pmsc->pipe.buf[0] = pmsc->data;
+  pmsc->pipe.buf[1] = pmsc->data_pp;
+#endif
 
   usbd_flush_tx_fifo(pudev, USBD_MSC_BULK_IN_EPT&0x7F);
 
@@ -207,7 +291,7 @@ void bot_cbw_decode(void *udev)
   /* check param */
   if((pmsc->cbw_struct.dCBWSignature != CBW_DCBWSIGNATURE) ||
     (usbd_get_recv_len(pudev, USBD_MSC_BULK_OUT_EPT) != CBW_CMD_LENGTH)
-    || (pmsc->cbw_struct.bCBWLUN > MSC_SUPPORT_MAX_LUN) ||
+    || (pmsc->cbw_struct.bCBWLUN > pmsc->max_lun) ||
       (pmsc->cbw_struct.bCBWCBLength < 1) || (pmsc->cbw_struct.bCBWCBLength > 16))
   {
     bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
@@ -222,7 +306,8 @@ void bot_cbw_decode(void *udev)
     }
     else if((pmsc->msc_state != MSC_STATE_MACHINE_DATA_IN) &&
             (pmsc->msc_state != MSC_STATE_MACHINE_DATA_OUT) &&
-            (pmsc->msc_state != MSC_STATE_MACHINE_LAST_DATA))
+            (pmsc->msc_state != MSC_STATE_MACHINE_LAST_DATA) &&
+            (pmsc->msc_state != MSC_STATE_MACHINE_STATUS))
     {
       if(pmsc->data_len == 0)
       {
@@ -282,7 +367,8 @@ void bot_scsi_send_csw(void *udev, uint8_t status)
 
 
 /**
-  * @brief  send scsi sense code
+  * @brief  send scsi sense code, sense is kept for the lun addressed by
+  *         the current command
   * @param  udev: to the structure of usbd_core_type
   * @param  sense_key: sense key
   * @param  asc: asc
@@ -290,8 +376,47 @@ void bot_scsi_send_csw(void *udev, uint8_t status)
   */
 void bot_scsi_sense_code(void *udev, uint8_t sense_key, uint8_t asc)
 {
-  sense_data.sense_key = sense_key;
-  sense_data.asc = asc;
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t lun = pmsc->cbw_struct.bCBWLUN;
+
+  if(lun >= MSC_SUPPORT_MAX_LUN)
+  {
+    lun = 0;
+  }
+
+  sense_data[lun].sense_key = sense_key;
+  sense_data[lun].asc = asc;
+  sense_data[lun].ascq = 0;
+}
+
+/**
+  * @brief  set sense of a failed disk access, disks busy with a long
+  *         operation report not ready so that the host retries later
+  * @param  udev: to the structure of usbd_core_type
+  * @param  status: disk status
+  * @retval none
+  */
+static void bot_scsi_disk_error(void *udev, usb_sts_type status)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t lun = pmsc->cbw_struct.bCBWLUN;
+
+  if(lun >= MSC_SUPPORT_MAX_LUN)
+  {
+    lun = 0;
+  }
+
+  if(status == USB_WAIT)
+  {
+    bot_scsi_sense_code(udev, SENSE_KEY_NOT_READY, LOGICAL_UNIT_NOT_READY);
+    sense_data[lun].ascq = OPERATION_IN_PROGRESS;
+  }
+  else
+  {
+    bot_scsi_sense_code(udev, SENSE_KEY_HARDWARE_ERROR, MEDIUM_NOT_PRESENT);
+  }
 }
 
 
@@ -303,11 +428,12 @@ void bot_scsi_sense_code(void *udev, uint8_t sense_key, uint8_t asc)
   * @param  blk_count: blk number
   * @retval usb_sts_type
   */
-usb_sts_type bot_scsi_check_address(void *udev, uint8_t lun, uint32_t blk_offset, uint32_t blk_count)
+usb_sts_type bot_scsi_check_address(void *udev, uint8_t lun, uint64_t blk_offset, uint32_t blk_count)
 {
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
-  if((blk_offset + blk_count) > pmsc->blk_nbr[lun])
+  if((blk_offset > pmsc->blk_nbr[lun]) ||
+     (blk_count > pmsc->blk_nbr[lun] - blk_offset))
   {
     bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, ADDRESS_OUT_OF_RANGE);
     return USB_FAIL;
@@ -358,10 +484,98 @@ usb_sts_type bot_scsi_test_unit(void *udev, uint8_t lun)
     return USB_FAIL;
   }
 
+  status = bot_scsi_disk_capacity(pmsc, lun);
+  if(status == USB_WAIT)
+  {
+    /* medium kept, busy with a long operation */
+    bot_scsi_disk_error(udev, status);
+    return USB_FAIL;
+  }
+  if(status != USB_OK)
+  {
+    pmsc->blk_nbr[lun] = 0;
+    bot_scsi_sense_code(udev, SENSE_KEY_NOT_READY, MEDIUM_NOT_PRESENT);
+    return USB_FAIL;
+  }
+
   pmsc->data_len = 0;
   return status;
 }
 
+/**
+  * @brief  bulk-only transport scsi command inquiry vital product data
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_inquiry_vpd(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
+  uint8_t *pdata = pmsc->data;
+  uint32_t trans_len;
+  uint32_t alloc_len;
+  uint32_t idx;
+
+  switch(cmd[2])
+  {
+    case MSC_VPD_SUPPORTED_PAGES:
+      trans_len = sizeof(page00_inquiry_data);
+      for(idx = 0; idx < trans_len; idx ++)
+      {
+        pdata[idx] = page00_inquiry_data[idx];
+      }
+      break;
+
+    case MSC_VPD_BLOCK_LIMITS:
+      trans_len = MSC_VPD_BLOCK_LIMITS_LEN;
+      for(idx = 0; idx < trans_len; idx ++)
+      {
+        pdata[idx] = 0;
+      }
+      pdata[1] = MSC_VPD_BLOCK_LIMITS;
+      pdata[3] = MSC_VPD_BLOCK_LIMITS_LEN - 4;
+
+      if(!bot_scsi_disk_unmap_support(pmsc, lun))
+      {
+        break;
+      }
+      pdata[20] = (uint8_t)(MSC_UNMAP_MAX_LBA_COUNT >> 24);
+      pdata[21] = (uint8_t)(MSC_UNMAP_MAX_LBA_COUNT >> 16);
+      pdata[22] = (uint8_t)(MSC_UNMAP_MAX_LBA_COUNT >> 8);
+      pdata[23] = (uint8_t)(MSC_UNMAP_MAX_LBA_COUNT);
+
+      pdata[24] = (uint8_t)(MSC_UNMAP_MAX_DESCRIPTORS >> 24);
+      pdata[25] = (uint8_t)(MSC_UNMAP_MAX_DESCRIPTORS >> 16);
+      pdata[26] = (uint8_t)(MSC_UNMAP_MAX_DESCRIPTORS >> 8);
+      pdata[27] = (uint8_t)(MSC_UNMAP_MAX_DESCRIPTORS);
+      break;
+
+    case MSC_VPD_LOGICAL_BLK_PROVISIONING:
+      trans_len = MSC_VPD_LBP_LEN;
+      for(idx = 0; idx < trans_len; idx ++)
+      {
+        pdata[idx] = 0;
+      }
+      pdata[1] = MSC_VPD_LOGICAL_BLK_PROVISIONING;
+      pdata[3] = MSC_VPD_LBP_LEN - 4;
+      /* lbpu, unmap supported */
+      pdata[5] = bot_scsi_disk_unmap_support(pmsc, lun) ? 0x80 : 0x00;
+      /* thin provisioned */
+      pdata[6] = 0x02;
+      break;
+
+    default:
+      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_FIELED_IN_COMMAND);
+      return USB_FAIL;
+  }
+
+  alloc_len = cmd[3] << 8 | cmd[4];
+  pmsc->data_len = MIN(trans_len, alloc_len);
+  return USB_OK;
+}
+
 /**
   * @brief  bulk-only transport scsi command inquiry
   * @param  udev: to the structure of usbd_core_type
@@ -378,8 +592,7 @@ usb_sts_type bot_scsi_inquiry(void *udev, uint8_t lun)
 
   if(pmsc->cbw_struct.CBWCB[1] & 0x01)
   {
-    pdata = page00_inquiry_data;
-    trans_len = 5;
+    return bot_scsi_inquiry_vpd(udev, lun);
   }
   else
   {
@@ -414,6 +627,12 @@ usb_sts_type bot_scsi_start_stop(void *udev, uint8_t lun)
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
   pmsc->data_len = 0;
+
+  /* eject (loej set, start clear), csw is sent by bot_scsi_task after flush */
+  if((pmsc->cbw_struct.CBWCB[4] & 0x03) == 0x02)
+  {
+    pmsc->msc_state = MSC_STATE_MACHINE_STATUS;
+  }
   return USB_OK;
 }
 
@@ -431,6 +650,42 @@ usb_sts_type bot_scsi_allow_medium_removal(void *udev, uint8_t lun)
   return USB_OK;
 }
 
+/**
+  * @brief  fill mode pages requested by mode sense, only the caching page
+  *         is reported, wce reflects the disk write-back cache
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @param  pdata: page data destination
+  * @retval length of mode pages
+  */
+static uint32_t bot_scsi_mode_pages(void *udev, uint8_t lun, uint8_t *pdata)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t page = pmsc->cbw_struct.CBWCB[2] & 0x3F;
+  uint8_t pc = pmsc->cbw_struct.CBWCB[2] >> 6;
+  uint32_t idx;
+
+  if((page != MSC_MODE_PAGE_CACHING) && (page != MSC_MODE_PAGE_ALL))
+  {
+    return 0;
+  }
+
+  for(idx = 0; idx < MSC_MODE_PAGE_CACHING_LEN; idx ++)
+  {
+    pdata[idx] = 0;
+  }
+  pdata[0] = MSC_MODE_PAGE_CACHING;
+  pdata[1] = MSC_MODE_PAGE_CACHING_LEN - 2;
+
+  /* current and default values, nothing is changeable */
+  if(pc != 0x01 && pmsc->disk[lun] != NULL && pmsc->disk[lun]->write_cache)
+  {
+    pdata[2] = 0x04;
+  }
+  return MSC_MODE_PAGE_CACHING_LEN;
+}
+
 /**
   * @brief  bulk-only transport scsi command mode sense6
   * @param  udev: to the structure of usbd_core_type
@@ -442,12 +697,24 @@ usb_sts_type bot_scsi_mode_sense6(void *udev, uint8_t lun)
   uint8_t data_len = 8;
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
+  uint32_t page_len;
+
   pmsc->data_len = 8;
   while(data_len)
   {
     data_len --;
     pmsc->data[data_len] = mode_sense6_data[data_len];
   };
+
+  page_len = bot_scsi_mode_pages(udev, lun, &pmsc->data[4]);
+  if(page_len)
+  {
+    pmsc->data_len = 4 + page_len;
+    pmsc->data[0] = (uint8_t)(pmsc->data_len - 1);
+  }
+
+  pmsc->data_len = MIN(pmsc->data_len, cmd[4]);
   return USB_OK;
 }
 
@@ -462,12 +729,25 @@ usb_sts_type bot_scsi_mode_sense10(void *udev, uint8_t lun)
   uint8_t data_len = 8;
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
+  uint32_t page_len;
+
   pmsc->data_len = 8;
   while(data_len)
   {
     data_len --;
     pmsc->data[data_len] = mode_sense10_data[data_len];
   };
+
+  page_len = bot_scsi_mode_pages(udev, lun, &pmsc->data[8]);
+  if(page_len)
+  {
+    pmsc->data_len = 8 + page_len;
+    pmsc->data[0] = (uint8_t)((pmsc->data_len - 2) >> 8);
+    pmsc->data[1] = (uint8_t)(pmsc->data_len - 2);
+  }
+
+  pmsc->data_len = MIN(pmsc->data_len, cmd[7] << 8 | cmd[8]);
   return USB_OK;
 }
 
@@ -482,12 +762,28 @@ usb_sts_type bot_scsi_capacity(void *udev, uint8_t lun)
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
   uint8_t *pdata = pmsc->data;
-  msc_disk_capacity(lun, &pmsc->blk_nbr[lun], &pmsc->blk_size[lun]);
+  uint32_t last_lba;
+  if(bot_scsi_disk_capacity(pmsc, lun) != USB_OK)
+  {
+    pmsc->blk_nbr[lun] = 0;
+    bot_scsi_sense_code(udev, SENSE_KEY_NOT_READY, MEDIUM_NOT_PRESENT);
+    return USB_FAIL;
+  }
+
+  /* devices beyond 32-bit lba report 0xFFFFFFFF, host must use capacity16 */
+  if(pmsc->blk_nbr[lun] > 0xFFFFFFFF)
+  {
+    last_lba = 0xFFFFFFFF;
+  }
+  else
+  {
+    last_lba = (uint32_t)(pmsc->blk_nbr[lun] - 1);
+  }
 
-  pdata[0] = (uint8_t)((pmsc->blk_nbr[lun] - 1) >> 24);
-  pdata[1] = (uint8_t)((pmsc->blk_nbr[lun] - 1) >> 16);
-  pdata[2] = (uint8_t)((pmsc->blk_nbr[lun] - 1) >> 8);
-  pdata[3] = (uint8_t)((pmsc->blk_nbr[lun] - 1));
+  pdata[0] = (uint8_t)(last_lba >> 24);
+  pdata[1] = (uint8_t)(last_lba >> 16);
+  pdata[2] = (uint8_t)(last_lba >> 8);
+  pdata[3] = (uint8_t)(last_lba);
 
   pdata[4] = (uint8_t)((pmsc->blk_size[lun]) >> 24);
   pdata[5] = (uint8_t)((pmsc->blk_size[lun]) >> 16);
@@ -498,6 +794,62 @@ usb_sts_type bot_scsi_capacity(void *udev, uint8_t lun)
   return USB_OK;
 }
 
+/**
+  * @brief  bulk-only transport scsi command read capacity16
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+usb_sts_type bot_scsi_capacity16(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
+  uint8_t *pdata = pmsc->data;
+  uint32_t alloc_len;
+  uint64_t last_lba;
+  uint8_t idx;
+
+  if((cmd[1] & 0x1F) != MSC_SAI_READ_CAPACITY_16)
+  {
+    bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_FIELED_IN_COMMAND);
+    return USB_FAIL;
+  }
+
+  if(bot_scsi_disk_capacity(pmsc, lun) != USB_OK)
+  {
+    pmsc->blk_nbr[lun] = 0;
+    bot_scsi_sense_code(udev, SENSE_KEY_NOT_READY, MEDIUM_NOT_PRESENT);
+    return USB_FAIL;
+  }
+  last_lba = pmsc->blk_nbr[lun] - 1;
+
+  for(idx = 0; idx < MSC_CAPACITY16_DATA_LEN; idx ++)
+  {
+    pdata[idx] = 0;
+  }
+
+  for(idx = 0; idx < 8; idx ++)
+  {
+    pdata[idx] = (uint8_t)(last_lba >> (56 - (idx * 8)));
+  }
+
+  pdata[8] = (uint8_t)((pmsc->blk_size[lun]) >> 24);
+  pdata[9] = (uint8_t)((pmsc->blk_size[lun]) >> 16);
+  pdata[10] = (uint8_t)((pmsc->blk_size[lun]) >> 8);
+  pdata[11] = (uint8_t)((pmsc->blk_size[lun]));
+
+  /* lbpme, logical block provisioning (unmap) enabled */
+  if(bot_scsi_disk_unmap_support(pmsc, lun))
+  {
+    pdata[14] = 0x80;
+  }
+
+  alloc_len = cmd[10] << 24 | cmd[11] << 16 | cmd[12] << 8 | cmd[13];
+  pmsc->data_len = MIN(alloc_len, MSC_CAPACITY16_DATA_LEN);
+  return USB_OK;
+}
+
 /**
   * @brief  bulk-only transport scsi command format capacity
   * @param  udev: to the structure of usbd_core_type
@@ -509,18 +861,26 @@ usb_sts_type bot_scsi_format_capacity(void *udev, uint8_t lun)
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
   uint8_t *pdata = pmsc->data;
+  uint32_t blk_nbr;
 
   pdata[0] = 0;
   pdata[1] = 0;
   pdata[2] = 0;
   pdata[3] = 0x08;
 
-  msc_disk_capacity(lun, &pmsc->blk_nbr[lun], &pmsc->blk_size[lun]);
+  if(bot_scsi_disk_capacity(pmsc, lun) != USB_OK)
+  {
+    pmsc->blk_nbr[lun] = 0;
+    bot_scsi_sense_code(udev, SENSE_KEY_NOT_READY, MEDIUM_NOT_PRESENT);
+    return USB_FAIL;
+  }
+  /* MIN() truncates to 16 bit, clamp number of blocks explicitly */
+  blk_nbr = (pmsc->blk_nbr[lun] > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)(pmsc->blk_nbr[lun] - 1);
 
-  pdata[4] = (uint8_t)((pmsc->blk_nbr[lun] - 1) >> 24);
-  pdata[5] = (uint8_t)((pmsc->blk_nbr[lun] - 1) >> 16);
-  pdata[6] = (uint8_t)((pmsc->blk_nbr[lun] - 1) >> 8);
-  pdata[7] = (uint8_t)((pmsc->blk_nbr[lun] - 1));
+  pdata[4] = (uint8_t)(blk_nbr >> 24);
+  pdata[5] = (uint8_t)(blk_nbr >> 16);
+  pdata[6] = (uint8_t)(blk_nbr >> 8);
+  pdata[7] = (uint8_t)(blk_nbr);
 
   pdata[8] = 0x02;
 
@@ -545,7 +905,7 @@ usb_sts_type bot_scsi_request_sense(void *udev, uint8_t lun)
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
   uint8_t *pdata = pmsc->data;
-  uint8_t *sdata = (uint8_t *)&sense_data;
+  uint8_t *sdata = (uint8_t *)&sense_data[lun];
 
   while(trans_len)
   {
@@ -553,6 +913,11 @@ usb_sts_type bot_scsi_request_sense(void *udev, uint8_t lun)
     pdata[trans_len] = sdata[trans_len];
   }
 
+  /* sense is reported once */
+  sense_data[lun].sense_key = SENSE_KEY_NO_SENSE;
+  sense_data[lun].asc = 0;
+  sense_data[lun].ascq = 0;
+
   if(pmsc->cbw_struct.dCBWDataTransferLength < REQ_SENSE_STANDARD_DATA_LEN)
   {
     pmsc->data_len = pmsc->cbw_struct.dCBWDataTransferLength;
@@ -592,106 +957,676 @@ usb_sts_type bot_scsi_verify(void *udev, uint8_t lun)
   return USB_OK;
 }
 
+#if MSC_DATA_PIPE
 /**
-  * @brief  bulk-only transport scsi command read10
+  * @brief  reset data pipe for a new command
   * @param  udev: to the structure of usbd_core_type
   * @param  lun: logical units number
-  * @retval status of usb_sts_type
+  * @retval none
   */
-usb_sts_type bot_scsi_read10(void *udev, uint8_t lun)
+static void bot_scsi_pipe_init(void *udev, uint8_t lun)
 {
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
-  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
-  uint32_t len;
-
-  if(pmsc->msc_state == MSC_STATE_MACHINE_IDLE)
-  {
-    if((pmsc->cbw_struct.bmCBWFlags & 0x80) != 0x80)
-    {
-      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
-      return USB_FAIL;
-    }
-
-    pmsc->blk_addr = cmd[2] << 24 | cmd[3] << 16 | cmd[4] << 8 | cmd[5];
-    pmsc->blk_len = cmd[7] << 8 | cmd[8];
-
-    if(bot_scsi_check_address(udev, lun, pmsc->blk_addr, pmsc->blk_len) != USB_OK)
-    {
-      return USB_FAIL;
-    }
-
-    pmsc->blk_addr *= pmsc->blk_size[lun];
-    pmsc->blk_len *= pmsc->blk_size[lun];
-
-    if(pmsc->cbw_struct.dCBWDataTransferLength != pmsc->blk_len)
-    {
-      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
-      return USB_FAIL;
-    }
-    pmsc->msc_state  = MSC_STATE_MACHINE_DATA_IN;
-  }
-  pmsc->data_len = MSC_MAX_DATA_BUF_LEN;
+  msc_pipe_type *pipe = &pmsc->pipe;
+
+  pipe->len[0] = 0;
+  pipe->len[1] = 0;
+  pipe->fill = 0;
+  pipe->send = 0;
+  pipe->busy = 0;
+  pipe->error = 0;
+  pipe->begin = 0;
+  pipe->ending = 0;
+  pipe->lun = lun;
+  pipe->tag = pmsc->cbw_struct.dCBWTage;
+  pipe->remain = pmsc->blk_len;
+}
+#endif
 
-  len = MIN(pmsc->blk_len, MSC_MAX_DATA_BUF_LEN);
-  if( msc_disk_read(lun, pmsc->blk_addr, pmsc->data, len) != USB_OK)
-  {
-    bot_scsi_sense_code(udev, SENSE_KEY_HARDWARE_ERROR, MEDIUM_NOT_PRESENT);
-    return USB_FAIL;
-  }
-  usbd_ept_send(pudev, USBD_MSC_BULK_IN_EPT, pmsc->data, len);
-  pmsc->blk_addr += len;
-  pmsc->blk_len -= len;
+#if MSC_READ_PIPELINE
+/**
+  * @brief  start bulk-in transfer of a filled pipe buffer
+  * @param  udev: to the structure of usbd_core_type
+  * @param  idx: pipe buffer index
+  * @retval none
+  */
+static void bot_scsi_pipe_send(void *udev, uint8_t idx)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+  uint32_t len = pipe->len[idx];
 
+  pipe->busy = 1;
+  pipe->send = idx;
+  pipe->remain -= len;
   pmsc->csw_struct.dCSWDataResidue -= len;
-  if(pmsc->blk_len == 0)
+
+  if(pipe->remain == 0)
   {
     pmsc->msc_state = MSC_STATE_MACHINE_LAST_DATA;
   }
 
-  return USB_OK;
+  usbd_ept_send(pudev, USBD_MSC_BULK_IN_EPT, pipe->buf[idx], len);
 }
 
-
 /**
-  * @brief  bulk-only transport scsi command write10
+  * @brief  start pipelined read, all chunks are read by bot_scsi_task so
+  *         the disk is never accessed from usb interrupt context
   * @param  udev: to the structure of usbd_core_type
   * @param  lun: logical units number
   * @retval status of usb_sts_type
   */
-usb_sts_type bot_scsi_write10(void *udev, uint8_t lun)
+static usb_sts_type bot_scsi_read_pipe_start(void *udev, uint8_t lun)
 {
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
-  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
-  uint32_t len;
 
-  if(pmsc->msc_state == MSC_STATE_MACHINE_IDLE)
-  {
-    if((pmsc->cbw_struct.bmCBWFlags & 0x80) == 0x80)
-    {
-      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
-      return USB_FAIL;
-    }
+  pmsc->read_direct = 0;
+  bot_scsi_pipe_init(udev, lun);
 
-    pmsc->blk_addr = cmd[2] << 24 | cmd[3] << 16 | cmd[4] << 8 | cmd[5];
-    pmsc->blk_len = cmd[7] << 8 | cmd[8];
+  return USB_OK;
+}
 
-    if(bot_scsi_check_address(udev, lun, pmsc->blk_addr, pmsc->blk_len) != USB_OK)
-    {
-      return USB_FAIL;
+/**
+  * @brief  pipelined read, bulk-in transfer complete
+  * @param  udev: to the structure of usbd_core_type
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_read_pipe_next(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+  uint8_t next = pipe->send ^ 1;
+
+  pipe->len[pipe->send] = 0;
+  pipe->busy = 0;
+
+  if(pipe->error)
+  {
+    bot_scsi_disk_error(udev, (usb_sts_type)pipe->error);
+    return USB_FAIL;
+  }
+
+  /* if next chunk is not ready yet, bot_scsi_task will send it */
+  if(pipe->len[next] != 0)
+  {
+    bot_scsi_pipe_send(udev, next);
+  }
+
+  return USB_OK;
+}
+
+/**
+  * @brief  pipelined read, chunk read from disk, starts its bulk-in
+  *         transfer unless the command has ended meanwhile
+  * @param  udev: to the structure of usbd_core_type
+  * @param  tag: cbw tag of the command the chunk was read for
+  * @param  idx: pipe buffer index
+  * @param  len: chunk length
+  * @param  status: disk read result
+  * @retval none
+  */
+static void bot_scsi_read_pipe_end(void *udev, uint32_t tag, uint8_t idx,
+                                   uint32_t len, usb_sts_type status)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+
+  __disable_irq();
+  /* command may have been aborted or replaced while reading */
+  if(pmsc->msc_state == MSC_STATE_MACHINE_DATA_IN && pipe->tag == tag)
+  {
+    if(status != USB_OK)
+    {
+      if(pipe->busy)
+      {
+        pipe->error = status;
+      }
+      else
+      {
+        bot_scsi_disk_error(udev, status);
+        bot_scsi_send_csw(udev, CSW_BCSWSTATUS_FAILED);
+      }
+    }
+    else
+    {
+      pmsc->blk_addr += len;
+      pmsc->blk_len -= len;
+      pipe->len[idx] = len;
+      pipe->fill = idx ^ 1;
+      if(!pipe->busy)
+      {
+        bot_scsi_pipe_send(udev, idx);
+      }
+    }
+  }
+  __enable_irq();
+}
+
+/**
+  * @brief  pipelined read, asynchronous disk read complete, may be
+  *         called from interrupt context
+  * @param  status: disk read result
+  * @retval none
+  */
+static void bot_scsi_read_pipe_done(usb_sts_type status)
+{
+  usbd_core_type *pudev = (usbd_core_type *)read_udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+
+  bot_scsi_read_pipe_end(read_udev, read_tag, read_idx, read_len, status);
+  pmsc->pipe.reading = 0;
+}
+
+/**
+  * @brief  pipelined read, prefetch next chunk from disk. disks with
+  *         read_start are read asynchronously, the chunk is then
+  *         completed by bot_scsi_read_pipe_done
+  * @param  udev: to the structure of usbd_core_type
+  * @retval none
+  */
+static void bot_scsi_read_pipe_task(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+  const msc_disk_ops_type *disk;
+  uint32_t tag = pipe->tag;
+  uint8_t idx = pipe->fill;
+  usb_sts_type status;
+  uint32_t len;
+
+  if(pmsc->blk_len == 0 || pipe->len[idx] != 0 || pmsc->read_direct || pipe->reading)
+  {
+    return;
+  }
+
+  len = MIN(pmsc->blk_len, MSC_MAX_DATA_BUF_LEN);
+  disk = pmsc->disk[pipe->lun];
+
+  if(disk->read_start != NULL)
+  {
+    read_udev = udev;
+    read_tag = tag;
+    read_len = len;
+    read_idx = idx;
+    pipe->reading = 1;
+    disk->read_start(pmsc->blk_addr, pipe->buf[idx], len, bot_scsi_read_pipe_done);
+    return;
+  }
+
+  status = disk->read(pmsc->blk_addr, pipe->buf[idx], len);
+  bot_scsi_read_pipe_end(udev, tag, idx, len, status);
+}
+#endif
+
+/**
+  * @brief  send next read chunk straight from disk memory, skipping the
+  *         copy to the data buffer
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval USB_OK if chunk is on bulk-in, USB_FAIL if disk has no direct
+  *         mapping for it and the chunk must be read
+  */
+static usb_sts_type bot_scsi_read_direct(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  const msc_disk_ops_type *disk = pmsc->disk[lun];
+  uint8_t *pdata;
+  uint32_t len;
+
+  pmsc->read_direct = 0;
+  if(disk->direct == NULL)
+  {
+    return USB_FAIL;
+  }
+
+  len = (pmsc->blk_len < MSC_DIRECT_MAX_LEN) ? pmsc->blk_len : MSC_DIRECT_MAX_LEN;
+  pdata = disk->direct(pmsc->blk_addr, &len);
+
+  /* whole blocks only, a short packet would end the transfer early */
+  if(len > pmsc->blk_len)
+  {
+    len = pmsc->blk_len;
+  }
+  len -= len % pmsc->blk_size[lun];
+  if(pdata == NULL || len == 0)
+  {
+    return USB_FAIL;
+  }
+
+  pmsc->read_direct = 1;
+  pmsc->blk_addr += len;
+  pmsc->blk_len -= len;
+  pmsc->csw_struct.dCSWDataResidue -= len;
+  if(pmsc->blk_len == 0)
+  {
+    pmsc->msc_state = MSC_STATE_MACHINE_LAST_DATA;
+  }
+
+  usbd_ept_send(pudev, USBD_MSC_BULK_IN_EPT, pdata, (uint16_t)len);
+  return USB_OK;
+}
+
+/**
+  * @brief  decode lba and transfer length of read/write 10, 12 and 16
+  *         commands, on success blk_addr and blk_len are set in bytes
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_rw_decode(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
+  uint64_t blk_addr;
+  uint32_t blk_len;
+
+  switch(cmd[0])
+  {
+    case MSC_CMD_READ_12:
+    case MSC_CMD_WRITE_12:
+      blk_addr = (uint32_t)(cmd[2] << 24 | cmd[3] << 16 | cmd[4] << 8 | cmd[5]);
+      blk_len = cmd[6] << 24 | cmd[7] << 16 | cmd[8] << 8 | cmd[9];
+      break;
+
+    case MSC_CMD_READ_16:
+    case MSC_CMD_WRITE_16:
+      blk_addr = (uint64_t)(cmd[2] << 24 | cmd[3] << 16 | cmd[4] << 8 | cmd[5]) << 32 |
+                 (uint32_t)(cmd[6] << 24 | cmd[7] << 16 | cmd[8] << 8 | cmd[9]);
+      blk_len = cmd[10] << 24 | cmd[11] << 16 | cmd[12] << 8 | cmd[13];
+      break;
+
+    default:
+      blk_addr = (uint32_t)(cmd[2] << 24 | cmd[3] << 16 | cmd[4] << 8 | cmd[5]);
+      blk_len = cmd[7] << 8 | cmd[8];
+      break;
+  }
+
+  if(bot_scsi_check_address(udev, lun, blk_addr, blk_len) != USB_OK)
+  {
+    return USB_FAIL;
+  }
+
+  /* compare in 64 bit, 32-bit transfer length times block size may overflow */
+  if(pmsc->cbw_struct.dCBWDataTransferLength != (uint64_t)blk_len * pmsc->blk_size[lun])
+  {
+    bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
+    return USB_FAIL;
+  }
+
+  pmsc->blk_addr = blk_addr * pmsc->blk_size[lun];
+  pmsc->blk_len = pmsc->cbw_struct.dCBWDataTransferLength;
+  return USB_OK;
+}
+
+/**
+  * @brief  bulk-only transport scsi command read 10/12/16
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+usb_sts_type bot_scsi_read(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+#if !MSC_READ_PIPELINE
+  usb_sts_type status;
+  uint32_t len;
+#endif
+
+  if(pmsc->msc_state == MSC_STATE_MACHINE_IDLE)
+  {
+    if((pmsc->cbw_struct.bmCBWFlags & 0x80) != 0x80)
+    {
+      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
+      return USB_FAIL;
+    }
+
+    if(bot_scsi_rw_decode(udev, lun) != USB_OK)
+    {
+      return USB_FAIL;
+    }
+#if MSC_READ_PIPELINE
+    if(pmsc->blk_len == 0)
+    {
+      /* no data stage, csw is sent by cbw decode */
+      pmsc->msc_state = MSC_STATE_MACHINE_IDLE;
+      pmsc->data_len = 0;
+      return USB_OK;
+    }
+#endif
+    pmsc->msc_state  = MSC_STATE_MACHINE_DATA_IN;
+    pmsc->data_len = MSC_MAX_DATA_BUF_LEN;
+#if MSC_READ_PIPELINE
+    bot_scsi_read_pipe_start(udev, lun);
+#endif
+    if(bot_scsi_read_direct(udev, lun) == USB_OK)
+    {
+      return USB_OK;
+    }
+#if MSC_READ_PIPELINE
+    return USB_OK;
+  }
+
+  if(pmsc->read_direct)
+  {
+    /* map next chunk, otherwise the pipe takes over the rest of the transfer */
+    if(bot_scsi_read_direct(udev, lun) != USB_OK)
+    {
+      bot_scsi_read_pipe_start(udev, lun);
+    }
+    return USB_OK;
+  }
+  return bot_scsi_read_pipe_next(udev);
+#else
+  }
+  else if(pmsc->read_direct && bot_scsi_read_direct(udev, lun) == USB_OK)
+  {
+    return USB_OK;
+  }
+
+  len = MIN(pmsc->blk_len, MSC_MAX_DATA_BUF_LEN);
+  status = pmsc->disk[lun]->read(pmsc->blk_addr, pmsc->data, len);
+  if(status != USB_OK)
+  {
+    bot_scsi_disk_error(udev, status);
+    return USB_FAIL;
+  }
+  usbd_ept_send(pudev, USBD_MSC_BULK_IN_EPT, pmsc->data, len);
+  pmsc->blk_addr += len;
+  pmsc->blk_len -= len;
+
+  pmsc->csw_struct.dCSWDataResidue -= len;
+  if(pmsc->blk_len == 0)
+  {
+    pmsc->msc_state = MSC_STATE_MACHINE_LAST_DATA;
+  }
+
+  return USB_OK;
+#endif
+}
+
+
+#if MSC_WRITE_BEHIND
+/**
+  * @brief  arm bulk-out transfer on a free pipe buffer
+  * @param  udev: to the structure of usbd_core_type
+  * @param  idx: pipe buffer index
+  * @retval none
+  */
+static void bot_scsi_pipe_recv(void *udev, uint8_t idx)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+
+  pipe->busy = 1;
+  pipe->fill = idx;
+
+  usbd_ept_recv(pudev, USBD_MSC_BULK_OUT_EPT, pipe->buf[idx],
+                MIN(pipe->remain, MSC_MAX_DATA_BUF_LEN));
+}
+
+/**
+  * @brief  start write-behind, data is received on one buffer while
+  *         the other is committed to disk by bot_scsi_task
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_write_pipe_start(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+
+  if(pmsc->blk_len == 0)
+  {
+    /* no data stage, csw is sent by cbw decode */
+    pmsc->msc_state = MSC_STATE_MACHINE_IDLE;
+    pmsc->data_len = 0;
+    return USB_OK;
+  }
+
+  bot_scsi_pipe_init(udev, lun);
+  pmsc->pipe.begin = 1;
+  bot_scsi_pipe_recv(udev, 0);
+  return USB_OK;
+}
+
+/**
+  * @brief  write-behind, bulk-out transfer complete
+  * @param  udev: to the structure of usbd_core_type
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_write_pipe_next(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+  uint8_t idx = pipe->fill;
+  uint32_t len = MIN(pipe->remain, MSC_MAX_DATA_BUF_LEN);
+
+  pipe->busy = 0;
+
+  if(pipe->error)
+  {
+    bot_scsi_disk_error(udev, (usb_sts_type)pipe->error);
+    return USB_FAIL;
+  }
+
+  pipe->len[idx] = len;
+  pipe->remain -= len;
+
+  /* if other buffer is still being committed, bot_scsi_task will arm it */
+  if(pipe->remain != 0 && pipe->len[idx ^ 1] == 0)
+  {
+    bot_scsi_pipe_recv(udev, idx ^ 1);
+  }
+
+  return USB_OK;
+}
+
+/**
+  * @brief  write-behind, chunk committed to disk
+  * @param  udev: to the structure of usbd_core_type
+  * @param  tag: cbw tag of the command the chunk belongs to
+  * @param  idx: pipe buffer index
+  * @param  len: chunk length
+  * @param  status: disk write result
+  * @retval none
+  */
+static void bot_scsi_write_pipe_end(void *udev, uint32_t tag, uint8_t idx,
+                                    uint32_t len, usb_sts_type status)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+
+  __disable_irq();
+  /* command may have been aborted or replaced while writing */
+  if(pmsc->msc_state == MSC_STATE_MACHINE_DATA_OUT && pipe->tag == tag)
+  {
+    if(status != USB_OK)
+    {
+      if(pipe->busy)
+      {
+        pipe->error = status;
+      }
+      else
+      {
+        bot_scsi_disk_error(udev, status);
+        bot_scsi_send_csw(udev, CSW_BCSWSTATUS_FAILED);
+      }
+    }
+    else
+    {
+      pmsc->blk_addr += len;
+      pmsc->blk_len -= len;
+      pmsc->csw_struct.dCSWDataResidue -= len;
+      pipe->len[idx] = 0;
+      pipe->send = idx ^ 1;
+
+      if(pmsc->blk_len == 0 && pipe->writing &&
+         pmsc->disk[pipe->lun]->write_end != NULL)
+      {
+        /* data may not be on media yet, csw is sent by bot_scsi_task */
+        pipe->ending = 1;
+      }
+      else if(pmsc->blk_len == 0)
+      {
+        bot_scsi_send_csw(udev, CSW_BCSWSTATUS_PASS);
+      }
+      else if(!pipe->busy && pipe->remain != 0)
+      {
+        bot_scsi_pipe_recv(udev, idx);
+      }
+    }
+  }
+  __enable_irq();
+}
+
+/**
+  * @brief  write-behind, asynchronous disk write complete, may be
+  *         called from interrupt context
+  * @param  status: disk write result
+  * @retval none
+  */
+static void bot_scsi_write_pipe_done(usb_sts_type status)
+{
+  usbd_core_type *pudev = (usbd_core_type *)write_udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+
+  bot_scsi_write_pipe_end(write_udev, write_tag, write_idx, write_len, status);
+  pmsc->pipe.writing = 0;
+}
+
+/**
+  * @brief  write-behind, commit received chunk to disk. disks with
+  *         write_start are written asynchronously, the chunk is then
+  *         completed by bot_scsi_write_pipe_done
+  * @param  udev: to the structure of usbd_core_type
+  * @retval none
+  */
+static void bot_scsi_write_pipe_task(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  msc_pipe_type *pipe = &pmsc->pipe;
+  const msc_disk_ops_type *disk;
+  uint32_t tag = pipe->tag;
+  uint8_t idx = pipe->send;
+  uint32_t len = pipe->len[idx];
+  usb_sts_type status;
+
+  if(pipe->writing)
+  {
+    return;
+  }
+
+  disk = pmsc->disk[pipe->lun];
+
+  if(pipe->ending)
+  {
+    pipe->ending = 0;
+    status = disk->write_end();
+
+    __disable_irq();
+    if(pmsc->msc_state == MSC_STATE_MACHINE_DATA_OUT && pipe->tag == tag)
+    {
+      if(status != USB_OK)
+      {
+        bot_scsi_disk_error(udev, status);
+        bot_scsi_send_csw(udev, CSW_BCSWSTATUS_FAILED);
+      }
+      else
+      {
+        bot_scsi_send_csw(udev, CSW_BCSWSTATUS_PASS);
+      }
+    }
+    __enable_irq();
+    return;
+  }
+
+  if(len == 0)
+  {
+    return;
+  }
+
+  if(pipe->begin)
+  {
+    /* let the disk see the whole range, e.g. to plan flash erases */
+    pipe->begin = 0;
+    if(disk->write_begin != NULL)
+    {
+      disk->write_begin(pmsc->blk_addr, pmsc->blk_len);
     }
+  }
+
+  if(disk->write_start != NULL)
+  {
+    write_udev = udev;
+    write_tag = tag;
+    write_len = len;
+    write_idx = idx;
+    pipe->writing = 1;
+    disk->write_start(pmsc->blk_addr, pipe->buf[idx], len, bot_scsi_write_pipe_done);
+    return;
+  }
+
+  status = disk->write(pmsc->blk_addr, pipe->buf[idx], len);
+  bot_scsi_write_pipe_end(udev, tag, idx, len, status);
+}
+#endif
 
-    pmsc->blk_addr *= pmsc->blk_size[lun];
-    pmsc->blk_len *= pmsc->blk_size[lun];
+/**
+  * @brief  bulk-only transport scsi command write 10/12/16
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+usb_sts_type bot_scsi_write(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+#if !MSC_WRITE_BEHIND
+  usb_sts_type status;
+  uint32_t len;
+#endif
 
-    if(pmsc->cbw_struct.dCBWDataTransferLength != pmsc->blk_len)
+  if(pmsc->msc_state == MSC_STATE_MACHINE_IDLE)
+  {
+    if((pmsc->cbw_struct.bmCBWFlags & 0x80) == 0x80)
     {
       bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
       return USB_FAIL;
     }
 
+    if(bot_scsi_rw_decode(udev, lun) != USB_OK)
+    {
+      return USB_FAIL;
+    }
+
     pmsc->msc_state  = MSC_STATE_MACHINE_DATA_OUT;
+#if MSC_WRITE_BEHIND
+    return bot_scsi_write_pipe_start(udev, lun);
+  }
+  else
+  {
+    return bot_scsi_write_pipe_next(udev);
+  }
+#else
+    if(pmsc->blk_len != 0 && pmsc->disk[lun]->write_begin != NULL)
+    {
+      pmsc->disk[lun]->write_begin(pmsc->blk_addr, pmsc->blk_len);
+    }
+
     len = MIN(pmsc->blk_len, MSC_MAX_DATA_BUF_LEN);
     usbd_ept_recv(pudev, USBD_MSC_BULK_OUT_EPT, (uint8_t *)pmsc->data, len);
 
@@ -699,9 +1634,10 @@ usb_sts_type bot_scsi_write10(void *udev, uint8_t lun)
   else
   {
     len = MIN(pmsc->blk_len, MSC_MAX_DATA_BUF_LEN);
-    if(msc_disk_write(lun, pmsc->blk_addr, pmsc->data, len) != USB_OK)
+    status = pmsc->disk[lun]->write(pmsc->blk_addr, pmsc->data, len);
+    if(status != USB_OK)
     {
-      bot_scsi_sense_code(udev, SENSE_KEY_HARDWARE_ERROR, MEDIUM_NOT_PRESENT);
+      bot_scsi_disk_error(udev, status);
       return USB_FAIL;
     }
 
@@ -721,6 +1657,228 @@ usb_sts_type bot_scsi_write10(void *udev, uint8_t lun)
     }
   }
   return USB_OK;
+#endif
+}
+
+#if MSC_SCSI_CMD_UNMAP
+/**
+  * @brief  bulk-only transport scsi command unmap, receives the parameter
+  *         list, descriptors are processed by bot_scsi_task
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+usb_sts_type bot_scsi_unmap(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t *cmd = pmsc->cbw_struct.CBWCB;
+  uint32_t param_len;
+
+  if(pmsc->msc_state == MSC_STATE_MACHINE_IDLE)
+  {
+    if(((pmsc->cbw_struct.bmCBWFlags & 0x80) == 0x80) ||
+       !bot_scsi_disk_unmap_support(pmsc, lun))
+    {
+      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
+      return USB_FAIL;
+    }
+
+    param_len = cmd[7] << 8 | cmd[8];
+
+    if(param_len == 0 && pmsc->cbw_struct.dCBWDataTransferLength == 0)
+    {
+      pmsc->data_len = 0;
+      return USB_OK;
+    }
+
+    if((param_len < MSC_UNMAP_HEADER_LEN) || (param_len > MSC_MAX_DATA_BUF_LEN) ||
+       (param_len != pmsc->cbw_struct.dCBWDataTransferLength))
+    {
+      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, PARAMETER_LIST_LENGTH_ERROR);
+      return USB_FAIL;
+    }
+
+    pmsc->blk_len = param_len;
+    pmsc->msc_state = MSC_STATE_MACHINE_DATA_OUT;
+    usbd_ept_recv(pudev, USBD_MSC_BULK_OUT_EPT, pmsc->data, param_len);
+    return USB_OK;
+  }
+
+  /* parameter list received, flash erase is left to bot_scsi_task */
+  pmsc->csw_struct.dCSWDataResidue -= pmsc->blk_len;
+  pmsc->blk_len = 0;
+  return USB_OK;
+}
+
+/**
+  * @brief  decode an unmap block descriptor
+  * @param  pdata: descriptor
+  * @param  blk_addr: first logical block
+  * @retval number of logical blocks
+  */
+static uint32_t bot_scsi_unmap_descriptor(const uint8_t *pdata, uint64_t *blk_addr)
+{
+  *blk_addr = (uint64_t)(pdata[0] << 24 | pdata[1] << 16 | pdata[2] << 8 | pdata[3]) << 32 |
+              (uint32_t)(pdata[4] << 24 | pdata[5] << 16 | pdata[6] << 8 | pdata[7]);
+  return pdata[8] << 24 | pdata[9] << 16 | pdata[10] << 8 | pdata[11];
+}
+
+/**
+  * @brief  discard all block descriptors of a received unmap parameter list,
+  *         the whole list is checked before any block is discarded
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+static usb_sts_type bot_scsi_unmap_process(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint8_t *pdata = pmsc->data;
+  uint32_t end, idx, blk_count;
+  uint64_t blk_addr;
+  usb_sts_type status;
+
+  /* partial descriptors at end of list are ignored */
+  end = MSC_UNMAP_HEADER_LEN + (pdata[2] << 8 | pdata[3]);
+  if(end > pmsc->cbw_struct.dCBWDataTransferLength)
+  {
+    end = pmsc->cbw_struct.dCBWDataTransferLength;
+  }
+
+  for(idx = MSC_UNMAP_HEADER_LEN; idx + MSC_UNMAP_DESCRIPTOR_LEN <= end; idx += MSC_UNMAP_DESCRIPTOR_LEN)
+  {
+    blk_count = bot_scsi_unmap_descriptor(&pdata[idx], &blk_addr);
+
+    /* maximum unmap lba count is advertised on block limits vpd */
+    if(blk_count > MSC_UNMAP_MAX_LBA_COUNT)
+    {
+      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_FIELD_IN_PARAMETER_LIST);
+      return USB_FAIL;
+    }
+
+    if(blk_count != 0 && bot_scsi_check_address(udev, lun, blk_addr, blk_count) != USB_OK)
+    {
+      return USB_FAIL;
+    }
+  }
+
+  for(idx = MSC_UNMAP_HEADER_LEN; idx + MSC_UNMAP_DESCRIPTOR_LEN <= end; idx += MSC_UNMAP_DESCRIPTOR_LEN)
+  {
+    blk_count = bot_scsi_unmap_descriptor(&pdata[idx], &blk_addr);
+
+    if(blk_count == 0)
+    {
+      continue;
+    }
+
+    status = pmsc->disk[lun]->unmap(blk_addr * pmsc->blk_size[lun],
+                            (uint64_t)blk_count * pmsc->blk_size[lun]);
+    if(status == USB_NOT_SUPPORT)
+    {
+      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
+      return USB_FAIL;
+    }
+    if(status != USB_OK)
+    {
+      bot_scsi_disk_error(udev, status);
+      return USB_FAIL;
+    }
+  }
+  return USB_OK;
+}
+
+/**
+  * @brief  unmap, erase discarded sectors outside of usb interrupt context
+  * @param  udev: to the structure of usbd_core_type
+  * @retval none
+  */
+static void bot_scsi_unmap_task(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint32_t tag = pmsc->cbw_struct.dCBWTage;
+  usb_sts_type status;
+
+  if(pmsc->blk_len != 0)
+  {
+    /* parameter list not yet received */
+    return;
+  }
+
+  status = bot_scsi_unmap_process(udev, pmsc->cbw_struct.bCBWLUN);
+
+  __disable_irq();
+  /* command may have been aborted or replaced while erasing */
+  if(pmsc->msc_state == MSC_STATE_MACHINE_DATA_OUT && pmsc->cbw_struct.dCBWTage == tag)
+  {
+    bot_scsi_send_csw(udev, (status == USB_OK) ? CSW_BCSWSTATUS_PASS : CSW_BCSWSTATUS_FAILED);
+  }
+  __enable_irq();
+}
+#endif
+
+/**
+  * @brief  bulk-only transport scsi command synchronize cache 10/16,
+  *         csw is sent by bot_scsi_task once disk cache is flushed
+  * @param  udev: to the structure of usbd_core_type
+  * @param  lun: logical units number
+  * @retval status of usb_sts_type
+  */
+usb_sts_type bot_scsi_sync_cache(void *udev, uint8_t lun)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+
+  if(pmsc->cbw_struct.dCBWDataTransferLength != 0)
+  {
+    bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
+    return USB_FAIL;
+  }
+
+  pmsc->data_len = 0;
+  pmsc->msc_state = MSC_STATE_MACHINE_STATUS;
+  return USB_OK;
+}
+
+/**
+  * @brief  flush disk cache for a command waiting on status
+  * @param  udev: to the structure of usbd_core_type
+  * @retval none
+  */
+static void bot_scsi_status_task(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint32_t tag = pmsc->cbw_struct.dCBWTage;
+  usb_sts_type status;
+
+  status = bot_scsi_disk_sync(pmsc, pmsc->cbw_struct.bCBWLUN);
+  if(status != USB_OK)
+  {
+    bot_scsi_sense_code(udev, SENSE_KEY_MEDIUM_ERROR, WRITE_FAULT);
+  }
+
+  __disable_irq();
+  if(pmsc->msc_state == MSC_STATE_MACHINE_STATUS && pmsc->cbw_struct.dCBWTage == tag)
+  {
+    bot_scsi_send_csw(udev, (status == USB_OK) ? CSW_BCSWSTATUS_PASS : CSW_BCSWSTATUS_FAILED);
+  }
+  __enable_irq();
+}
+
+/**
+  * @brief  usb suspend, request disk caches to be flushed
+  * @param  udev: to the structure of usbd_core_type
+  * @retval none
+  */
+void bot_scsi_suspend(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+
+  pmsc->sync_req = 1;
 }
 
 /**
@@ -745,71 +1903,184 @@ void bot_scsi_clear_feature(void *udev, uint8_t ept_num)
 }
 
 /**
-  * @brief  bulk-only transport scsi command process
+  * @brief  bulk-only transport background task, must be called from
+  *         main loop. Reads ahead the next chunk of a pipelined read,
+  *         commits write-behind data, processes unmap and cache flushes
+  *         outside of usb interrupt context.
   * @param  udev: to the structure of usbd_core_type
-  * @retval status of usb_sts_type
+  * @retval none
   */
-usb_sts_type bot_scsi_cmd_process(void *udev)
+void bot_scsi_task(void *udev)
 {
-  usb_sts_type status = USB_FAIL;
   usbd_core_type *pudev = (usbd_core_type *)udev;
   msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
-  switch(pmsc->cbw_struct.CBWCB[0])
+  uint8_t lun;
+
+  switch(pmsc->msc_state)
   {
-    case MSC_CMD_INQUIRY:
-      status = bot_scsi_inquiry(udev, pmsc->cbw_struct.bCBWLUN);
+#if MSC_READ_PIPELINE
+    case MSC_STATE_MACHINE_DATA_IN:
+      bot_scsi_read_pipe_task(udev);
       break;
-
-    case MSC_CMD_START_STOP:
-      status = bot_scsi_start_stop(udev, pmsc->cbw_struct.bCBWLUN);
+#endif
+    case MSC_STATE_MACHINE_DATA_OUT:
+#if MSC_SCSI_CMD_UNMAP
+      if(pmsc->cmd_handler == bot_scsi_unmap)
+      {
+        bot_scsi_unmap_task(udev);
+        break;
+      }
+#endif
+#if MSC_WRITE_BEHIND
+      bot_scsi_write_pipe_task(udev);
+#endif
       break;
 
-    case MSC_CMD_MODE_SENSE6:
-      status = bot_scsi_mode_sense6(udev, pmsc->cbw_struct.bCBWLUN);
+    case MSC_STATE_MACHINE_STATUS:
+      bot_scsi_status_task(udev);
       break;
 
-    case MSC_CMD_MODE_SENSE10:
-      status = bot_scsi_mode_sense10(udev, pmsc->cbw_struct.bCBWLUN);
+    case MSC_STATE_MACHINE_IDLE:
+      if(pmsc->sync_req)
+      {
+        pmsc->sync_req = 0;
+        for(lun = 0; lun <= pmsc->max_lun; lun ++)
+        {
+          bot_scsi_disk_sync(pmsc, lun);
+        }
+      }
+#if MSC_READ_PIPELINE && MSC_WRITE_BEHIND
+      /* disk is only accessed from here, safe to flush while idle */
+      else
+      {
+        for(lun = 0; lun <= pmsc->max_lun; lun ++)
+        {
+          if(pmsc->disk[lun] != NULL && pmsc->disk[lun]->idle != NULL)
+          {
+            idle_udev = udev;
+            pmsc->disk[lun]->idle();
+            idle_udev = NULL;
+          }
+        }
+      }
+#endif
       break;
 
-    case MSC_CMD_ALLOW_MEDIUM_REMOVAL:
-      status = bot_scsi_allow_medium_removal(udev, pmsc->cbw_struct.bCBWLUN);
+    default:
       break;
+  }
+}
 
-    case MSC_CMD_READ_10:
-      status = bot_scsi_read10(udev, pmsc->cbw_struct.bCBWLUN);
-      break;
+/**
+  * @brief  check for a read waiting on disk data while disks run their
+  *         idle work, so that long operations can be paused
+  * @param  none
+  * @retval 1 if next read chunk waits for disk data, 0 otherwise
+  */
+uint8_t bot_scsi_read_pending(void)
+{
+#if MSC_READ_PIPELINE && MSC_WRITE_BEHIND
+  usbd_core_type *pudev = (usbd_core_type *)idle_udev;
+  msc_type *pmsc;
 
-    case MSC_CMD_READ_CAPACITY:
-      status = bot_scsi_capacity(udev, pmsc->cbw_struct.bCBWLUN);
-      break;
+  if(pudev == NULL)
+  {
+    return 0;
+  }
 
-    case MSC_CMD_REQUEST_SENSE:
-      status = bot_scsi_request_sense(udev, pmsc->cbw_struct.bCBWLUN);
-      break;
+  pmsc = (msc_type *)pudev->class_handler->pdata;
+  return pmsc->msc_state == MSC_STATE_MACHINE_DATA_IN && pmsc->blk_len != 0 &&
+         !pmsc->read_direct && !pmsc->pipe.reading &&
+         pmsc->pipe.len[pmsc->pipe.fill] == 0;
+#else
+  return 0;
+#endif
+}
 
-    case MSC_CMD_TEST_UNIT:
-      status = bot_scsi_test_unit(udev, pmsc->cbw_struct.bCBWLUN);
-      break;
+/**
+  * @brief  read the waiting chunk from disk, called from disk idle work
+  *         once its media can be read
+  * @param  none
+  * @retval none
+  */
+void bot_scsi_read_serve(void)
+{
+#if MSC_READ_PIPELINE && MSC_WRITE_BEHIND
+  if(bot_scsi_read_pending())
+  {
+    bot_scsi_read_pipe_task(idle_udev);
+  }
+#endif
+}
 
-    case MSC_CMD_VERIFY:
-      status = bot_scsi_verify(udev, pmsc->cbw_struct.bCBWLUN);
-      break;
+/**
+  * @brief scsi command table, searched on every cbw
+  */
+static const bot_scsi_cmd_type bot_scsi_cmd_table[] =
+{
+  {MSC_CMD_READ_10,                bot_scsi_read},
+  {MSC_CMD_WRITE_10,               bot_scsi_write},
+  {MSC_CMD_TEST_UNIT,              bot_scsi_test_unit},
+  {MSC_CMD_REQUEST_SENSE,          bot_scsi_request_sense},
+  {MSC_CMD_INQUIRY,                bot_scsi_inquiry},
+  {MSC_CMD_READ_CAPACITY,          bot_scsi_capacity},
+  {MSC_CMD_READ_FORMAT_CAPACITY,   bot_scsi_format_capacity},
+  {MSC_CMD_MODE_SENSE6,            bot_scsi_mode_sense6},
+  {MSC_CMD_MODE_SENSE10,           bot_scsi_mode_sense10},
+  {MSC_CMD_START_STOP,             bot_scsi_start_stop},
+  {MSC_CMD_ALLOW_MEDIUM_REMOVAL,   bot_scsi_allow_medium_removal},
+  {MSC_CMD_VERIFY,                 bot_scsi_verify},
+#if MSC_SCSI_CMD_12
+  {MSC_CMD_READ_12,                bot_scsi_read},
+  {MSC_CMD_WRITE_12,               bot_scsi_write},
+#endif
+#if MSC_SCSI_CMD_16
+  {MSC_CMD_READ_16,                bot_scsi_read},
+  {MSC_CMD_WRITE_16,               bot_scsi_write},
+  {MSC_CMD_SERVICE_ACTION_IN_16,   bot_scsi_capacity16},
+#endif
+#if MSC_SCSI_CMD_SYNC_CACHE
+  {MSC_CMD_SYNCHRONIZE_CACHE_10,   bot_scsi_sync_cache},
+#if MSC_SCSI_CMD_16
+  {MSC_CMD_SYNCHRONIZE_CACHE_16,   bot_scsi_sync_cache},
+#endif
+#endif
+#if MSC_SCSI_CMD_UNMAP
+  {MSC_CMD_UNMAP,                  bot_scsi_unmap},
+#endif
+};
 
-    case MSC_CMD_WRITE_10:
-      status = bot_scsi_write10(udev, pmsc->cbw_struct.bCBWLUN);
-      break;
+/**
+  * @brief  bulk-only transport scsi command process, the handler is looked
+  *         up when the cbw is decoded and reused on the data stage
+  * @param  udev: to the structure of usbd_core_type
+  * @retval status of usb_sts_type
+  */
+usb_sts_type bot_scsi_cmd_process(void *udev)
+{
+  usbd_core_type *pudev = (usbd_core_type *)udev;
+  msc_type *pmsc = (msc_type *)pudev->class_handler->pdata;
+  uint32_t idx;
 
-    case MSC_CMD_READ_FORMAT_CAPACITY:
-      status = bot_scsi_format_capacity(udev, pmsc->cbw_struct.bCBWLUN);
-      break;
+  if(pmsc->msc_state == MSC_STATE_MACHINE_IDLE)
+  {
+    pmsc->cmd_handler = NULL;
+    for(idx = 0; idx < sizeof(bot_scsi_cmd_table) / sizeof(bot_scsi_cmd_type); idx ++)
+    {
+      if(bot_scsi_cmd_table[idx].opcode == pmsc->cbw_struct.CBWCB[0])
+      {
+        pmsc->cmd_handler = bot_scsi_cmd_table[idx].handler;
+        break;
+      }
+    }
+  }
 
-    default:
-      bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
-      status = USB_FAIL;
-      break;
+  if(pmsc->cmd_handler == NULL)
+  {
+    bot_scsi_sense_code(udev, SENSE_KEY_ILLEGAL_REQUEST, INVALID_COMMAND);
+    return USB_FAIL;
   }
-  return status;
+  return pmsc->cmd_handler(udev, pmsc->cbw_struct.bCBWLUN);
 }
 
 /**
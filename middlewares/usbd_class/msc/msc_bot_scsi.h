@@ -30,8 +30,8 @@
 extern "C" {
 #endif
 
-#include "msc_class.h"
 #include "usbd_core.h"
+#include "msc_diskio.h"
 
 /** @addtogroup AT32F415_middlewares_usbd_class
   * @{
@@ -45,9 +45,66 @@ extern "C" {
   * @{
   */
 
-#define MSC_SUPPORT_MAX_LUN              1
+#ifndef MSC_SUPPORT_MAX_LUN
+#define MSC_SUPPORT_MAX_LUN              2
+#endif
 #define MSC_MAX_DATA_BUF_LEN             4096
 
+/**
+  * @brief read(10) ping-pong buffering, the next chunk is read from the
+  *        disk by bot_scsi_task() while the previous one is on bulk-in
+  */
+#ifndef MSC_READ_PIPELINE
+#define MSC_READ_PIPELINE                1
+#endif
+
+/**
+  * @brief write(10) write-behind, received chunks are committed to the
+  *        disk by bot_scsi_task() while the next one is received, csw
+  *        is held until the last chunk is committed
+  */
+#ifndef MSC_WRITE_BEHIND
+#define MSC_WRITE_BEHIND                 1
+#endif
+
+#define MSC_DATA_PIPE                    (MSC_READ_PIPELINE || MSC_WRITE_BEHIND)
+
+/**
+  * @brief largest bulk-in transfer sent straight from disk memory through
+  *        the disk direct hook, must be a multiple of block size and fit
+  *        the 16-bit endpoint transfer length
+  */
+#ifndef MSC_DIRECT_MAX_LEN
+#define MSC_DIRECT_MAX_LEN               0x8000
+#endif
+
+/**
+  * @brief optional scsi commands, entries left out of the command table
+  *        are rejected as invalid and their handlers are not linked
+  */
+#ifndef MSC_SCSI_CMD_12
+#define MSC_SCSI_CMD_12                  1     /*!< read(12), write(12) */
+#endif
+#ifndef MSC_SCSI_CMD_16
+#define MSC_SCSI_CMD_16                  1     /*!< read(16), write(16), read capacity(16) */
+#endif
+#ifndef MSC_SCSI_CMD_UNMAP
+#define MSC_SCSI_CMD_UNMAP               1     /*!< unmap */
+#endif
+#ifndef MSC_SCSI_CMD_SYNC_CACHE
+#define MSC_SCSI_CMD_SYNC_CACHE          1     /*!< synchronize cache(10), synchronize cache(16) */
+#endif
+
+/**
+  * @brief bulk endpoints, shared by msc and composite classes
+  */
+#ifndef USBD_MSC_BULK_IN_EPT
+#define USBD_MSC_BULK_IN_EPT             0x81
+#endif
+#ifndef USBD_MSC_BULK_OUT_EPT
+#define USBD_MSC_BULK_OUT_EPT            0x01
+#endif
+
 #define MSC_CMD_FORMAT_UNIT              0x04
 #define MSC_CMD_INQUIRY                  0x12
 #define MSC_CMD_START_STOP               0x1B
@@ -64,6 +121,36 @@ extern "C" {
 #define MSC_CMD_WRITE_10                 0x2A
 #define MSC_CMD_WRITE_12                 0xAA
 #define MSC_CMD_WRITE_VERIFY             0x2E
+#define MSC_CMD_READ_16                  0x88
+#define MSC_CMD_WRITE_16                 0x8A
+#define MSC_CMD_SERVICE_ACTION_IN_16     0x9E
+#define MSC_CMD_UNMAP                    0x42
+#define MSC_CMD_SYNCHRONIZE_CACHE_10     0x35
+#define MSC_CMD_SYNCHRONIZE_CACHE_16     0x91
+
+#define MSC_SAI_READ_CAPACITY_16         0x10
+#define MSC_CAPACITY16_DATA_LEN          32
+
+#define MSC_MODE_PAGE_CACHING            0x08
+#define MSC_MODE_PAGE_ALL                0x3F
+#define MSC_MODE_PAGE_CACHING_LEN        0x14
+
+#define MSC_VPD_SUPPORTED_PAGES          0x00
+#define MSC_VPD_BLOCK_LIMITS             0xB0
+#define MSC_VPD_LOGICAL_BLK_PROVISIONING 0xB2
+#define MSC_VPD_BLOCK_LIMITS_LEN         0x40
+#define MSC_VPD_LBP_LEN                  0x08
+
+/**
+  * @brief unmap limits reported on block limits vpd page, descriptors
+  *        must fit on a single data buffer
+  */
+#ifndef MSC_UNMAP_MAX_LBA_COUNT
+#define MSC_UNMAP_MAX_LBA_COUNT          0x800
+#endif
+#define MSC_UNMAP_HEADER_LEN             8
+#define MSC_UNMAP_DESCRIPTOR_LEN         16
+#define MSC_UNMAP_MAX_DESCRIPTORS        ((MSC_MAX_DATA_BUF_LEN - MSC_UNMAP_HEADER_LEN) / MSC_UNMAP_DESCRIPTOR_LEN)
 
 #define MSC_REQ_GET_MAX_LUN              0xFE  /*!< get max lun */
 #define MSC_REQ_BO_RESET                 0xFF  /*!< bulk only mass storage reset */
@@ -116,8 +203,11 @@ extern "C" {
 #define PARAMETER_LIST_LENGTH_ERROR      0x1A
 #define INVALID_FIELD_IN_PARAMETER_LIST  0x26
 #define ADDRESS_OUT_OF_RANGE             0x21
+#define WRITE_FAULT                      0x03
 #define MEDIUM_NOT_PRESENT               0x3A
 #define MEDIUM_HAVE_CHANGED              0x28
+#define LOGICAL_UNIT_NOT_READY           0x04
+#define OPERATION_IN_PROGRESS            0x07 /*!< ascq of LOGICAL_UNIT_NOT_READY */
 
 #define SCSI_INQUIRY_DATA_LENGTH         36
 
@@ -188,6 +278,36 @@ typedef struct
   uint32_t reserved3;
 }sense_type;
 
+/**
+  * @brief ping-pong data pipe between disk and bulk endpoint
+  */
+typedef struct
+{
+  uint8_t  *buf[2];
+  __IO uint32_t len[2];                  /*!< valid bytes on each buffer, zero when free */
+  __IO uint8_t fill;                     /*!< read: next buffer to fill from disk, write: buffer on bulk-out */
+  __IO uint8_t send;                     /*!< read: buffer on bulk-in, write: next buffer to commit to disk */
+  __IO uint8_t busy;                     /*!< bulk transfer in progress */
+  __IO uint8_t error;                    /*!< disk error status, fail command on next completion */
+  __IO uint8_t reading;                  /*!< read: asynchronous disk read in progress */
+  __IO uint8_t writing;                  /*!< write: asynchronous disk write in progress */
+  uint8_t  begin;                        /*!< write: range not yet announced to disk */
+  __IO uint8_t ending;                   /*!< write: all data written, disk write_end pending */
+  uint8_t  lun;
+  uint32_t tag;                          /*!< cbw tag of the command owning the pipe */
+  uint32_t remain;                       /*!< bytes still to be transferred on bulk endpoint */
+}msc_pipe_type;
+
+/**
+  * @brief scsi command handler
+  */
+typedef usb_sts_type (*bot_scsi_cmd_handler)(void *udev, uint8_t lun);
+
+typedef struct
+{
+  uint8_t opcode;
+  bot_scsi_cmd_handler handler;
+}bot_scsi_cmd_type;
 
 typedef struct
 {
@@ -195,14 +315,23 @@ typedef struct
   uint8_t bot_status;
   uint32_t max_lun;
 
-  uint32_t blk_nbr[MSC_SUPPORT_MAX_LUN];
+  const msc_disk_ops_type *disk[MSC_SUPPORT_MAX_LUN];
+  bot_scsi_cmd_handler cmd_handler;      /*!< handler of current cbw, kept for data stage */
+
+  uint64_t blk_nbr[MSC_SUPPORT_MAX_LUN];
   uint32_t blk_size[MSC_SUPPORT_MAX_LUN];
 
   uint64_t blk_addr;
   uint32_t blk_len;
+  __IO uint8_t sync_req;                 /*!< flush disk caches from bot_scsi_task */
+  __IO uint8_t read_direct;              /*!< bulk-in is sending straight from disk memory */
 
   uint32_t data_len;
   uint8_t data[MSC_MAX_DATA_BUF_LEN];
+#if MSC_DATA_PIPE
+  uint8_t data_pp[MSC_MAX_DATA_BUF_LEN];
+  msc_pipe_type pipe;
+#endif
 
   uint32_t alt_setting;
 
@@ -219,7 +348,7 @@ void bot_cbw_decode(void *udev);
 void bot_scsi_send_data(void *udev, uint8_t *buffer, uint32_t len);
 void bot_scsi_send_csw(void *udev, uint8_t status);
 void bot_scsi_sense_code(void *udev, uint8_t sense_key, uint8_t asc);
-usb_sts_type bot_scsi_check_address(void *udev, uint8_t lun, uint32_t blk_offset, uint32_t blk_count);
+usb_sts_type bot_scsi_check_address(void *udev, uint8_t lun, uint64_t blk_offset, uint32_t blk_count);
 void bot_scsi_stall(void *udev);
 usb_sts_type bot_scsi_cmd_process(void *udev);
 
@@ -229,13 +358,20 @@ usb_sts_type bot_scsi_start_stop(void *udev, uint8_t lun);
 usb_sts_type bot_scsi_allow_medium_removal(void *udev, uint8_t lun);
 usb_sts_type bot_scsi_mode_sense6(void *udev, uint8_t lun);
 usb_sts_type bot_scsi_mode_sense10(void *udev, uint8_t lun);
-usb_sts_type bot_scsi_read10(void *udev, uint8_t lun);
+usb_sts_type bot_scsi_read(void *udev, uint8_t lun);
 usb_sts_type bot_scsi_capacity(void *udev, uint8_t lun);
+usb_sts_type bot_scsi_capacity16(void *udev, uint8_t lun);
 usb_sts_type bot_scsi_format_capacity(void *udev, uint8_t lun);
 usb_sts_type bot_scsi_request_sense(void *udev, uint8_t lun);
 usb_sts_type bot_scsi_verify(void *udev, uint8_t lun);
-usb_sts_type bot_scsi_write10(void *udev, uint8_t lun);
+usb_sts_type bot_scsi_write(void *udev, uint8_t lun);
+usb_sts_type bot_scsi_unmap(void *udev, uint8_t lun);
+usb_sts_type bot_scsi_sync_cache(void *udev, uint8_t lun);
+void bot_scsi_suspend(void *udev);
 void bot_scsi_clear_feature(void *udev, uint8_t ept_num);
+void bot_scsi_task(void *udev);
+uint8_t bot_scsi_read_pending(void);
+void bot_scsi_read_serve(void);
 
 /**
   * @}
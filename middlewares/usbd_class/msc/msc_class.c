@@ -269,7 +269,8 @@ static usb_sts_type class_event_handler(void *udev, usbd_event_type event)
       break;
     case USBD_SUSPEND_EVENT:
 
-      /* ...user code... */
+      /* write back cached data, host may power down the device */
+      bot_scsi_suspend(udev);
 
       break;
     case USBD_WAKEUP_EVENT:
@@ -3,6 +3,7 @@
 #include "msc_class.h"
 #include "msc_desc.h"
 #include "msc_diskio.h"
+#include "msc_bot_scsi.h"
 #include "usbd_int.h"
 
 
@@ -125,6 +126,18 @@ void usb_config(void)
         );
 }
 
+/**
+  * @brief  usb background processing, call from main loop
+  * @param  none
+  * @retval none
+  */
+void usb_task(void)
+{
+    if(otg_core_struct.usb_reg){
+        bot_scsi_task(&otg_core_struct.dev);
+    }
+}
+
 void sw_reset(void){
     NVIC_SystemReset();
 }
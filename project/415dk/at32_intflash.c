@@ -0,0 +1,211 @@
+// =============================================================================
+/*!
+ * @file       at32_intflash.c
+ *
+ * This file contains the on-chip flash disk region implementation, the
+ * region is reserved by the linker script between _sintflash and _eintflash
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <string.h>
+#include "at32f415.h"
+#include "at32_intflash.h"
+
+extern uint8_t _sintflash[];
+extern uint8_t _eintflash[];
+
+static uint8_t page_buf[INTFLASH_PAGE_SIZE];
+/**
+ * @brief  Prepares flash controller for erase and program
+ * @retval None
+ */
+void intflash_init (void)
+{
+   flash_flag_clear (FLASH_ODF_FLAG | FLASH_PRGMERR_FLAG | FLASH_EPPERR_FLAG);
+}
+/**
+ * @brief  Size of disk region
+ * @retval size in bytes
+ */
+uint32_t intflash_get_size (void)
+{
+   return (uint32_t)(_eintflash - _sintflash);
+}
+/**
+ * @brief  Memory mapped address of disk region offset
+ * @param  addr: offset on disk region
+ * @retval pointer to flash contents
+ */
+uint8_t *intflash_get_ptr (uint32_t addr)
+{
+   return _sintflash + addr;
+}
+/**
+ * @brief  Programs halfwords that differ from flash, destination must be
+ *         erased or already hold the same data
+ * @param  buf: data to be written, halfword aligned length
+ * @param  dst: flash address
+ * @param  len: number of bytes
+ * @retval flash operation status
+ */
+static flash_status_type intflash_program (const uint8_t *buf, uint8_t *dst, uint32_t len)
+{
+   flash_status_type status = FLASH_OPERATE_DONE;
+   uint16_t data;
+   uint32_t i;
+
+   for (i = 0; i < len && status == FLASH_OPERATE_DONE; i += 2)
+   {
+      data = buf[i] | (buf[i + 1] << 8);
+      if (data != 0xFFFF && data != *(volatile uint16_t *)(dst + i))
+      {
+         status = flash_halfword_program ((uint32_t)(dst + i), data);
+      }
+   }
+
+   return status;
+}
+/**
+ * @brief  Checks if data can be programmed without erasing, that is
+ *         every halfword is either unchanged or still erased
+ * @param  buf: data to be written
+ * @param  dst: flash address
+ * @param  len: number of bytes
+ * @retval 1 if erase is needed
+ */
+static uint8_t intflash_need_erase (const uint8_t *buf, const uint8_t *dst, uint32_t len)
+{
+   uint16_t old;
+   uint32_t i;
+
+   for (i = 0; i < len; i += 2)
+   {
+      old = *(const volatile uint16_t *)(dst + i);
+      if (old != 0xFFFF && old != (buf[i] | (buf[i + 1] << 8)))
+      {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+/**
+ * @brief  Checks if flash range is erased
+ * @param  dst: flash address
+ * @param  len: number of bytes
+ * @retval 1 if all bytes are 0xFF
+ */
+static uint8_t intflash_is_erased (const uint8_t *dst, uint32_t len)
+{
+   const uint32_t *p = (const uint32_t *)dst;
+   uint32_t i;
+
+   for (i = 0; i < len / 4; i++)
+   {
+      if (p[i] != 0xFFFFFFFF)
+      {
+         return 0;
+      }
+   }
+
+   return 1;
+}
+/**
+ * @brief  Writes data to disk region. Pages are only erased when data
+ *         cannot be programmed over current contents, a partial page
+ *         that needs erasing is read-modified-written
+ * @param  buf: data to be written
+ * @param  addr: offset on disk region, halfword aligned
+ * @param  len: number of bytes, halfword aligned
+ * @retval flash operation status
+ */
+flash_status_type intflash_write (const uint8_t *buf, uint32_t addr, uint32_t len)
+{
+   flash_status_type status = FLASH_OPERATE_DONE;
+   uint8_t *page;
+   uint32_t offset, count;
+
+   if ((addr | len) & 1 || addr + len > intflash_get_size ())
+   {
+      return FLASH_PROGRAM_ERROR;
+   }
+
+   flash_unlock ();
+
+   while (len && status == FLASH_OPERATE_DONE)
+   {
+      offset = addr % INTFLASH_PAGE_SIZE;
+      count  = INTFLASH_PAGE_SIZE - offset;
+      if (count > len)
+      {
+         count = len;
+      }
+      page = _sintflash + addr - offset;
+
+      if (!intflash_need_erase (buf, page + offset, count))
+      {
+         status = intflash_program (buf, page + offset, count);
+      }
+      else if (count == INTFLASH_PAGE_SIZE)
+      {
+         status = flash_sector_erase ((uint32_t)page);
+         if (status == FLASH_OPERATE_DONE)
+         {
+            status = intflash_program (buf, page, count);
+         }
+      }
+      else
+      {
+         memcpy (page_buf, page, INTFLASH_PAGE_SIZE);
+         memcpy (page_buf + offset, buf, count);
+         status = flash_sector_erase ((uint32_t)page);
+         if (status == FLASH_OPERATE_DONE)
+         {
+            status = intflash_program (page_buf, page, INTFLASH_PAGE_SIZE);
+         }
+      }
+
+      buf  += count;
+      addr += count;
+      len  -= count;
+   }
+
+   flash_lock ();
+
+   return status;
+}
+/**
+ * @brief  Erases pages fully covered by range, pages that are
+ *         already erased are skipped
+ * @param  addr: offset on disk region
+ * @param  len: number of bytes
+ * @retval flash operation status
+ */
+flash_status_type intflash_erase_range (uint32_t addr, uint32_t len)
+{
+   flash_status_type status = FLASH_OPERATE_DONE;
+   uint32_t start = (addr + INTFLASH_PAGE_SIZE - 1) & ~(INTFLASH_PAGE_SIZE - 1);
+   uint32_t end   = (addr + len) & ~(INTFLASH_PAGE_SIZE - 1);
+
+   if (addr + len > intflash_get_size ())
+   {
+      return FLASH_PROGRAM_ERROR;
+   }
+
+   flash_unlock ();
+
+   for (; start < end && status == FLASH_OPERATE_DONE; start += INTFLASH_PAGE_SIZE)
+   {
+      if (!intflash_is_erased (_sintflash + start, INTFLASH_PAGE_SIZE))
+      {
+         status = flash_sector_erase ((uint32_t)(_sintflash + start));
+      }
+   }
+
+   flash_lock ();
+
+   return status;
+}
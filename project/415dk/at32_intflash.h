@@ -0,0 +1,24 @@
+// =============================================================================
+/*!
+ * @file       at32_intflash.h
+ *
+ * This file contains definitions for the on-chip flash disk region
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#ifndef __AT_INT_FLASH_H
+#define __AT_INT_FLASH_H
+#include <stdint.h>
+#include "at32f415.h"
+
+#define INTFLASH_PAGE_SIZE    2048
+
+void intflash_init (void);
+uint32_t intflash_get_size (void);
+uint8_t *intflash_get_ptr (uint32_t addr);
+flash_status_type intflash_write (const uint8_t *buf, uint32_t addr, uint32_t len);
+flash_status_type intflash_erase_range (uint32_t addr, uint32_t len);
+#endif
@@ -15,6 +15,7 @@ static sdio_error_t command_rsp7_error (void);
 static sdio_error_t mmc_switch (uint8_t set, uint8_t index, uint8_t value);
 static sdio_error_t sdio_switch_speed (uint32_t mode, uint32_t group, uint8_t value, uint8_t *rsp);
 static void sd_dma_config (uint32_t *mbuf, uint32_t buf_size, dma_dir_type dir);
+static void sd_transfer_stop (void);
 static void sd_card_info_parse(card_info_t *info);
 
 static sdio_command_struct_type sdio_command_init_struct;
@@ -29,6 +30,9 @@ static sd_data_transfer_mode_type device_mode =
 static uint8_t stop_flag             = 0;     /* transmit stop flag */
 volatile sdio_error_t transfer_error = SD_OK; /* transmit error flag */
 volatile uint8_t transfer_end        = 0;     /* transmit end flag */
+static volatile uint8_t transfer_busy = 0;    /* dma transfer in progress */
+static uint8_t program_wait          = 0;     /* card programming after async write */
+static void (*transfer_done)(sdio_error_t status) = NULL; /* async transfer callback */
 
 static card_info_t card_info;                 /* card information */
 
@@ -103,6 +107,7 @@ static sdio_error_t sdio_command_data_send (sdio_command_struct_type *sdio_cmd_i
          SDIOx->inten |= SDIO_INTR_STS_READ_MASK;
          transfer_error = SD_OK;
          transfer_end   = 0;
+         transfer_busy  = 1;
          sdio_dma_enable (SDIOx, TRUE);
       }
    }
@@ -115,6 +120,10 @@ static sdio_error_t sdio_command_data_send (sdio_command_struct_type *sdio_cmd_i
    status = command_rsp1_error (sdio_cmd_init_t->cmd_index);
    if (status != SD_OK)
    {
+      if (transfer_busy)
+      {
+         sd_transfer_stop ();
+      }
       return status;
    }
 
@@ -242,29 +251,29 @@ static sdio_error_t sdio_command_data_send (sdio_command_struct_type *sdio_cmd_i
          SDIOx->inten |= SDIO_INTR_STS_WRITE_MASK;
          transfer_error = SD_OK;
          transfer_end   = 0;
+         transfer_busy  = 1;
          sdio_dma_enable (SDIOx, TRUE);
       }
 
-      while (!(SDIOx->sts & SDIOx->inten) && timeout)
+      /* asynchronous transfer, end is reported from interrupt */
+      if (transfer_done != NULL)
       {
-         timeout--;
+         return SD_OK;
+      }
 
-         if (transfer_end)
-         {
-            break;
-         }
+      while (!transfer_end && timeout)
+      {
+         timeout--;
       }
 
       if (timeout == 0)
       {
+         sd_transfer_stop ();
          sd_init ();
          return SD_DATA_TIMEOUT;
       }
 
-      if (transfer_error != SD_OK)
-      {
-         status = transfer_error;
-      }
+      status = transfer_error;
    }
 
    return status;
@@ -586,6 +595,30 @@ static void sd_dma_config (uint32_t *mbuf, uint32_t buf_size, dma_dir_type dir)
    dma_channel_enable (DMA2_CHANNEL4, TRUE);
 }
 
+/**
+ * @brief  ends dma transfer. on successful reads, data still on
+ *         fifo is left to dma before it is disabled.
+ * @param  none
+ * @retval none
+ */
+static void sd_transfer_stop (void)
+{
+   uint32_t timeout = SD_FIFO_DRAIN_TIMEOUT;
+
+   while (transfer_end && (transfer_error == SD_OK) &&
+          (dma_data_number_get (DMA2_CHANNEL4) != 0) && timeout)
+   {
+      timeout--;
+   }
+
+   SDIOx->inten &= ~(SDIO_INTR_STS_READ_MASK | SDIO_INTR_STS_WRITE_MASK);
+   sdio_dma_enable (SDIOx, FALSE);
+   dma_channel_enable (DMA2_CHANNEL4, FALSE);
+   sdio_flag_clear (SDIOx, SDIO_STATIC_FLAGS);
+
+   transfer_busy = 0;
+}
+
 
 /**
  * @brief  read current card status.
@@ -812,6 +845,48 @@ static sdio_error_t sd_programming_status (uint8_t *p_status)
    return SD_OK;
 }
 
+/**
+ * @brief  waits while the card programs data received.
+ * @param  none
+ * @retval sdio_error_t: sd card error code.
+ */
+static sdio_error_t sd_programming_wait (void)
+{
+   sdio_error_t status;
+   uint8_t card_state = 0;
+
+   status = sd_programming_status (&card_state);
+
+   while ((status == SD_OK) && ((card_state == SD_CARD_PROGRAMMING) ||
+                                (card_state == SD_CARD_RECEIVING)))
+   {
+      status = sd_programming_status (&card_state);
+   }
+
+   return status;
+}
+
+/**
+ * @brief  waits for the end of an asynchronous transfer and, after
+ *         writes, for the card to leave programming state.
+ * @param  none
+ * @retval sdio_error_t: sd card error code.
+ */
+static sdio_error_t sd_ready_wait (void)
+{
+   while (transfer_busy)
+   {
+   }
+
+   if (program_wait)
+   {
+      program_wait = 0;
+      return sd_programming_wait ();
+   }
+
+   return SD_OK;
+}
+
 /**
  * @brief  enquires cards about their operating voltage and configures
  *         clock controls.
@@ -1266,6 +1341,12 @@ sdio_error_t sd_init (void)
 
     memset(&card_info, 0, sizeof(card_info));
 
+    /* card is initialized in polling mode */
+    device_mode   = SD_TRANSFER_POLLING_MODE;
+    transfer_busy = 0;
+    transfer_done = NULL;
+    program_wait  = 0;
+
     crm_periph_clock_enable (CRM_GPIOA_PERIPH_CLOCK, TRUE);
     crm_periph_clock_enable (CRM_SDIO1_PERIPH_CLOCK, TRUE);
     crm_periph_clock_enable (CRM_IOMUX_PERIPH_CLOCK, TRUE);
@@ -1608,6 +1689,13 @@ sdio_error_t sd_block_erase (uint64_t addr, uint32_t nblks)
       end_addr   = start_addr + (nblks - 1) * 512;
    }
 
+   status = sd_ready_wait ();
+
+   if (status != SD_OK)
+   {
+      return status;
+   }
+
    /* clear dcsm configuration */
    sdio_data_init_struct.block_size         = SDIO_DATA_BLOCK_SIZE_1B;
    sdio_data_init_struct.data_length        = 0;
@@ -1763,6 +1851,13 @@ sdio_error_t sd_block_read (uint8_t *buf, uint64_t addr, uint16_t blk_size)
       return SD_INVALID_PARAMETER;
    }
 
+   status = sd_ready_wait ();
+
+   if (status != SD_OK)
+   {
+      return status;
+   }
+
    SDIOx->dtctrl = 0x0;
 
    if (card_info.type == SDIO_HIGH_CAPACITY_SD_CARD)
@@ -1842,6 +1937,13 @@ sdio_error_t sd_block_multi_read (uint8_t *buf, long long addr,
    uint32_t response   = 0;
    uint8_t power;
 
+   status = sd_ready_wait ();
+
+   if (status != SD_OK)
+   {
+      return status;
+   }
+
    SDIOx->dtctrl = 0x0;
 
    if (card_type == SDIO_HIGH_CAPACITY_SD_CARD)
@@ -1931,7 +2033,7 @@ sdio_error_t sd_block_write (const uint8_t *buf, long long addr,
                              uint16_t blk_size)
 {
    sdio_error_t status = SD_OK;
-   uint8_t power = 0, card_state = 0;
+   uint8_t power = 0;
    uint32_t timeout = 0, card_status = 0, response = 0;
 
    if (buf == NULL)
@@ -1939,6 +2041,13 @@ sdio_error_t sd_block_write (const uint8_t *buf, long long addr,
       return SD_INVALID_PARAMETER;
    }
 
+   status = sd_ready_wait ();
+
+   if (status != SD_OK)
+   {
+      return status;
+   }
+
    SDIOx->dtctrl                            = 0x0;
 
    /* clear dcsm configuration */
@@ -2031,17 +2140,16 @@ sdio_error_t sd_block_write (const uint8_t *buf, long long addr,
       return status;
    }
 
-   sdio_flag_clear (SDIOx, SDIO_STATIC_FLAGS);
-
-   status = sd_programming_status (&card_state);
-
-   while ((status == SD_OK) && ((card_state == SD_CARD_PROGRAMMING) ||
-                                (card_state == SD_CARD_RECEIVING)))
+   /* programming is waited on by next transfer */
+   if (transfer_done != NULL)
    {
-      status = sd_programming_status (&card_state);
+      program_wait = 1;
+      return SD_OK;
    }
 
-   return status;
+   sdio_flag_clear (SDIOx, SDIO_STATIC_FLAGS);
+
+   return sd_programming_wait ();
 }
 
 /**
@@ -2057,7 +2165,7 @@ sdio_error_t sd_block_multi_write (const uint8_t *buf, long long addr,
                                    uint16_t blk_size, uint32_t nblks)
 {
    sdio_error_t status = SD_OK;
-   uint8_t power = 0, card_state = 0;
+   uint8_t power = 0;
    uint32_t timeout = 0, card_status = 0, response = 0;
 
    if (buf == NULL)
@@ -2065,6 +2173,13 @@ sdio_error_t sd_block_multi_write (const uint8_t *buf, long long addr,
       return SD_INVALID_PARAMETER;
    }
 
+   status = sd_ready_wait ();
+
+   if (status != SD_OK)
+   {
+      return status;
+   }
+
    SDIOx->dtctrl                            = 0x0;
 
    /* clear dcsm configuration */
@@ -2161,8 +2276,8 @@ sdio_error_t sd_block_multi_write (const uint8_t *buf, long long addr,
          return status;
       }
 
-      /* send cmd23, set block count */
-      sdio_command_init_struct.argument  = blk_size;
+      /* send acmd23, pre-erase blocks to be written */
+      sdio_command_init_struct.argument  = nblks;
       sdio_command_init_struct.cmd_index = SD_CMD_SET_BLOCK_COUNT;
       sdio_command_init_struct.rsp_type  = SDIO_RESPONSE_SHORT;
       sdio_command_init_struct.wait_type = SDIO_WAIT_FOR_NO;
@@ -2202,17 +2317,16 @@ sdio_error_t sd_block_multi_write (const uint8_t *buf, long long addr,
       return status;
    }
 
-   sdio_flag_clear (SDIOx, SDIO_STATIC_FLAGS);
-
-   status = sd_programming_status (&card_state);
-
-   while ((status == SD_OK) && ((card_state == SD_CARD_PROGRAMMING) ||
-                                (card_state == SD_CARD_RECEIVING)))
+   /* programming is waited on by next transfer */
+   if (transfer_done != NULL)
    {
-      status = sd_programming_status (&card_state);
+      program_wait = 1;
+      return SD_OK;
    }
 
-   return status;
+   sdio_flag_clear (SDIOx, SDIO_STATIC_FLAGS);
+
+   return sd_programming_wait ();
 }
 
 /**
@@ -2819,11 +2933,136 @@ sdio_error_t sd_write_disk (const uint8_t *buf, uint32_t sector, uint8_t cnt)
 }
 
 /**
- * @brief  sdio1 isr.
+ * @brief  starts a dma transfer of sd card sectors.
+ * @param  buf: data buf, word aligned
+ * @param  sector: sector address
+ * @param  cnt: sector count
+ * @param  done: completion callback
+ * @param  write: 1 to write sectors, 0 to read
+ * @retval sdio_error_t: sd card error code.
+ */
+static sdio_error_t sd_disk_start (uint8_t *buf, uint32_t sector, uint8_t cnt,
+                                   void (*done)(sdio_error_t status), uint8_t write)
+{
+   sdio_error_t sta;
+   uint64_t lsector = sector;
+   uint32_t block_size = card_info.block_size;
+
+   if ((device_mode != SD_TRANSFER_DMA_MODE) || ((uint32_t) buf % 4 != 0) ||
+       (cnt == 0) || (done == NULL))
+   {
+      return SD_INVALID_PARAMETER;
+   }
+
+   /* previous transfer owns the callback until it ends */
+   sta = sd_ready_wait ();
+
+   if (sta != SD_OK)
+   {
+      return sta;
+   }
+
+   /* data address is in block units. */
+   lsector *= block_size;
+
+   transfer_done = done;
+
+   if (write)
+   {
+      if (cnt == 1)
+      {
+         sta = sd_block_write (buf, lsector, block_size);
+      }
+      else
+      {
+         sta = sd_block_multi_write (buf, lsector, block_size, cnt);
+      }
+   }
+   else
+   {
+      if (cnt == 1)
+      {
+         sta = sd_block_read (buf, lsector, block_size);
+      }
+      else
+      {
+         sta = sd_block_multi_read (buf, lsector, block_size, cnt);
+      }
+   }
+
+   if (sta != SD_OK)
+   {
+      transfer_done = NULL;
+   }
+
+   return sta;
+}
+
+/**
+ * @brief  starts reading sd card sectors on dma and returns
+ * @param  buf: read data buf, word aligned
+ * @param  sector: sector address
+ * @param  cnt: sector count
+ * @param  done: called from SDIOx_IRQHandler with transfer status
+ * @retval sdio_error_t: SD_OK if transfer started, done is not called
+ *         on other codes.
+ */
+sdio_error_t sd_read_disk_async (uint8_t *buf, uint32_t sector, uint8_t cnt,
+                                 void (*done)(sdio_error_t status))
+{
+   return sd_disk_start (buf, sector, cnt, done, 0);
+}
+
+/**
+ * @brief  starts writing sd card sectors on dma and returns, card
+ *         programming is waited on by the next transfer
+ * @param  buf: write data buf, word aligned
+ * @param  sector: sector address
+ * @param  cnt: sector count
+ * @param  done: called from SDIOx_IRQHandler with transfer status
+ * @retval sdio_error_t: SD_OK if transfer started, done is not called
+ *         on other codes.
+ */
+sdio_error_t sd_write_disk_async (const uint8_t *buf, uint32_t sector, uint8_t cnt,
+                                  void (*done)(sdio_error_t status))
+{
+   return sd_disk_start ((uint8_t *) buf, sector, cnt, done, 1);
+}
+
+/**
+ * @brief  waits for the end of an asynchronous transfer and for the
+ *         card to program data of an asynchronous write
+ * @param  none
+ * @retval sdio_error_t: sd card error code, programming failure of
+ *         last asynchronous write included.
+ */
+sdio_error_t sd_wait_ready (void)
+{
+   return sd_ready_wait ();
+}
+
+/**
+ * @brief  sdio1 isr, ends dma transfers and calls completion
+ *         callback of asynchronous ones.
  * @param  none.
  * @retval none.
  */
 void SDIOx_IRQHandler (void)
 {
+   void (*done)(sdio_error_t status);
+
    sd_irq_service ();
+
+   if (transfer_busy && transfer_end)
+   {
+      sd_transfer_stop ();
+
+      done          = transfer_done;
+      transfer_done = NULL;
+
+      if (done != NULL)
+      {
+         done (transfer_error);
+      }
+   }
 }
@@ -7,7 +7,7 @@
 #define SDIOx                            SDIO1
 //#define DMAMUX_SDIOx                     DMAMUX_DMAREQ_ID_SDIO1
 #define SDIOx_IRQHandler                 SDIO_IRQHandler
-#define SDIOx_TRANSFER_MODE              0  //SD_TRANSFER_DMA_MODE
+#define SDIOx_TRANSFER_MODE              SD_TRANSFER_DMA_MODE
 #define ALIGNED(x) __attribute__ ((aligned (x)))
 
 /**
@@ -171,6 +171,7 @@
 #define SD_16TO23BITS                    ((uint32_t)0x00FF0000)
 #define SD_24TO31BITS                    ((uint32_t)0xFF000000)
 #define SD_MAX_DATA_LENGTH               ((uint32_t)0x01FFFFFF)
+#define SD_FIFO_DRAIN_TIMEOUT            ((uint32_t)0x0000FFFF)
 #define SD_HALFFIFO                      ((uint32_t)0x00000008)
 #define SD_HALFFIFOBYTES                 ((uint32_t)0x00000020)
 
@@ -455,6 +456,9 @@ sdio_error_t sd_block_write(const uint8_t *buf, long long addr, uint16_t blk_siz
 sdio_error_t sd_block_multi_write(const uint8_t *buf, long long addr, uint16_t blk_size, uint32_t nblks);
 sdio_error_t sd_read_disk(uint8_t *buf, uint32_t sector, uint8_t cnt);
 sdio_error_t sd_write_disk(const uint8_t *buf, uint32_t sector, uint8_t cnt);
+sdio_error_t sd_read_disk_async(uint8_t *buf, uint32_t sector, uint8_t cnt, void (*done)(sdio_error_t status));
+sdio_error_t sd_write_disk_async(const uint8_t *buf, uint32_t sector, uint8_t cnt, void (*done)(sdio_error_t status));
+sdio_error_t sd_wait_ready(void);
 sdio_error_t mmc_stream_read(uint8_t *buf, long long addr, uint32_t len);
 sdio_error_t mmc_stream_write(uint8_t *buf, long long addr, uint32_t len);
 sd_card_state_type sd_state_get(void);
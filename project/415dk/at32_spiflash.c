@@ -14,8 +14,25 @@
 #include "board.h"
 #define SPI_DMA_RX_FLAG  (SPIFLASH_PERIPHERAL == 1) ? DMA1_FDT2_FLAG : DMA1_FDT4_FLAG
 #define SPI_DMA_TX_FLAG  (SPIFLASH_PERIPHERAL == 1) ? DMA1_FDT3_FLAG : DMA1_FDT5_FLAG
+#if SPIFLASH_PERIPHERAL == 1
+#define SPI_DMA_ERR_FLAGS           (DMA1_DTERR2_FLAG | DMA1_DTERR3_FLAG)
+#define SPI_DMA_RX_IRQn             DMA1_Channel2_IRQn
+#define SPI_DMA_TX_IRQn             DMA1_Channel3_IRQn
+#define SPIFLASH_DMA_RX_IRQHandler  DMA1_Channel2_IRQHandler
+#define SPIFLASH_DMA_TX_IRQHandler  DMA1_Channel3_IRQHandler
+#else
+#define SPI_DMA_ERR_FLAGS           (DMA1_DTERR4_FLAG | DMA1_DTERR5_FLAG)
+#define SPI_DMA_RX_IRQn             DMA1_Channel4_IRQn
+#define SPI_DMA_TX_IRQn             DMA1_Channel5_IRQn
+#define SPIFLASH_DMA_RX_IRQHandler  DMA1_Channel4_IRQHandler
+#define SPIFLASH_DMA_TX_IRQHandler  DMA1_Channel5_IRQHandler
+#endif
 static dma_channel_type *spi_dma_rx;
 static dma_channel_type *spi_dma_tx;
+static volatile uint8_t dma_busy;
+static uint8_t dma_rx;
+static uint32_t dma_len;
+static void (*dma_done)(uint32_t count);
 /**
  * @brief  Enables disables spi flash
  * @param  state: 0 - selected, deselected otherwise
@@ -23,6 +40,12 @@ static dma_channel_type *spi_dma_tx;
  */
 void spiflash_cs (uint8_t state)
 {
+   if (!state)
+   {
+      /* bus is kept by a transfer in progress until its end */
+      while (dma_busy);
+   }
+
    if (state)
       SPIFLASH_CS_GPIO->scr = SPIFLASH_CS_PIN;
    else
@@ -98,9 +121,45 @@ void spiflash_init (void)
    dma_init(spi_dma_tx, &dma_init_struct);
    dma_init_struct.direction = DMA_DIR_PERIPHERAL_TO_MEMORY;
    dma_init(spi_dma_rx, &dma_init_struct);
+   /* same priority as usb, completion callbacks may start usb transfers */
+   nvic_irq_enable(SPI_DMA_RX_IRQn, 0, 0);
+   nvic_irq_enable(SPI_DMA_TX_IRQn, 0, 0);
    /*Enable SPI*/
    spi_enable (SPIFLASH, TRUE);
 }
+/**
+ * @brief  Sets spi clock to the fastest division not above
+ *         requested frequency and board limit.
+ * @param  freq: maximum clock frequency in Hz
+ * @retval Clock frequency set
+ */
+uint32_t spiflash_set_clock (uint32_t freq)
+{
+   crm_clocks_freq_type clocks;
+   uint32_t pclk, div;
+
+   crm_clocks_freq_get(&clocks);
+   pclk = (SPIFLASH_PERIPHERAL == 1) ? clocks.apb2_freq : clocks.apb1_freq;
+
+   if (freq > SPIFLASH_MAX_CLOCK)
+      freq = SPIFLASH_MAX_CLOCK;
+
+   /* division is 2^(div + 1) */
+   for (div = SPI_MCLK_DIV_2; div < SPI_MCLK_DIV_256; div++)
+   {
+      if ((pclk >> (div + 1)) <= freq)
+         break;
+   }
+
+   /* wait for any transfer end before changing clock */
+   while (spi_i2s_flag_get (SPIFLASH, SPI_I2S_BF_FLAG) == SET);
+   spi_enable (SPIFLASH, FALSE);
+   SPIFLASH->ctrl2_bit.mdiv_h = 0;
+   SPIFLASH->ctrl1_bit.mdiv_l = div;
+   spi_enable (SPIFLASH, TRUE);
+
+   return pclk >> (div + 1);
+}
 /**
  * @brief
  *
@@ -134,6 +193,44 @@ uint8_t spiflash_xchbyte (uint8_t byte)
    while (spi_i2s_flag_get (SPIFLASH, SPI_I2S_RDBF_FLAG) == RESET);
    return spi_i2s_data_receive (SPIFLASH);
 }
+/**
+ * @brief  Sends a block of bytes without reading them back, bytes
+ *         received meanwhile are dropped
+ * @param  txbuf  Data to send
+ * @param  len  Length of data
+ * @retval None
+ */
+static void spiflash_send (const uint8_t *txbuf, uint32_t len)
+{
+   if (!len)
+      return;
+
+   while (len--)
+   {
+      while (spi_i2s_flag_get (SPIFLASH, SPI_I2S_TDBE_FLAG) == RESET);
+      spi_i2s_data_transmit (SPIFLASH, *(txbuf++));
+   }
+   while (spi_i2s_flag_get (SPIFLASH, SPI_I2S_BF_FLAG) == SET);
+   /* drop last byte received, then clear overrun */
+   (void) spi_i2s_data_receive (SPIFLASH);
+   spiflash_check_errors ();
+}
+/**
+ * @brief  Receives a block of bytes, one at a time
+ * @param  rxbuf  Destination of read data
+ * @param  len  Length of data
+ * @retval None
+ */
+static void spiflash_receive (uint8_t *rxbuf, uint32_t len)
+{
+   while (len--)
+   {
+      while (spi_i2s_flag_get (SPIFLASH, SPI_I2S_TDBE_FLAG) == RESET);
+      spi_i2s_data_transmit (SPIFLASH, FLASH_DUMMY_BYTE);
+      while (spi_i2s_flag_get (SPIFLASH, SPI_I2S_RDBF_FLAG) == RESET);
+      *(rxbuf++) = spi_i2s_data_receive (SPIFLASH);
+   }
+}
 /**
  * @brief  Sends a byte through the SPI interface and return the byte received
  *         from the SPI bus.
@@ -156,64 +253,103 @@ uint8_t spiflash_receivebyte (void)
    return spiflash_xchbyte (FLASH_DUMMY_BYTE);
 }
 /**
- * @brief  Reads a block of data using DMA
- * @param  pbuffer  Destination of read data
- * @param  len  Length of data to be read
- * @retval Number of bytes read
+ * @brief  Starts a dma transfer, rx channel is only used on reads
+ *         and tx sends a dummy byte repeatedly then
+ * @param  txbuf  Data to send, NULL on reads
+ * @param  rxbuf  Destination of read data, NULL on writes
+ * @param  len  Length of data
+ * @param  irq  Signal end of transfer by interrupt
+ * @retval None
  */
-uint32_t spiflash_read (uint8_t *pbuffer, uint32_t len)
+static void spiflash_dma_start (const uint8_t *txbuf, uint8_t *rxbuf, uint32_t len, uint8_t irq)
 {
-   uint8_t dummy_data = FLASH_DUMMY_BYTE;
-   /* Don't support transfers larger than 64k
-    * Because DMA is limited to 64k and read byte by byte
-    * is too slow
-    */
-   if(len >= 0x10000){
-      return 0;
-   }
-   /* for small transfers just read one by one */
-   if(len < 10)
-   {
-      uint32_t loop = len;
-      while (loop--)
-      {
-         *pbuffer = spiflash_receivebyte ();
-         pbuffer++;
-      }
-      return len;
-   }
-   /* Larger transfers, use DMA */
-   dma_data_number_set(spi_dma_rx, len);
-   spi_dma_rx->maddr = (uint32_t)pbuffer;
-   /* RX DMA only works if a TX DMA is also set */
-   dma_data_number_set(spi_dma_tx, len);
-   spi_dma_tx->maddr = (uint32_t)&dummy_data;
+   static const uint8_t dummy_data = FLASH_DUMMY_BYTE;
+
+   dma_len = len;
+   dma_rx  = rxbuf != NULL;
+   dma_busy = 1;
 
-   /* Copy same data byte */
-   spi_dma_tx->ctrl_bit.mincm = FALSE;
+   dma_data_number_set(spi_dma_tx, len);
+   if(dma_rx){
+      dma_data_number_set(spi_dma_rx, len);
+      spi_dma_rx->maddr = (uint32_t)rxbuf;
+      /* RX DMA only works if a TX DMA is also set, copy same data byte */
+      spi_dma_tx->maddr = (uint32_t)&dummy_data;
+      spi_dma_tx->ctrl_bit.mincm = FALSE;
+      spi_i2s_dma_receiver_enable(SPIFLASH, TRUE);
+   }else{
+      spi_dma_tx->maddr = (uint32_t)txbuf;
+   }
 
-   spi_i2s_dma_receiver_enable(SPIFLASH, TRUE);
    spi_i2s_dma_transmitter_enable(SPIFLASH, TRUE);
    dma_flag_clear(SPI_DMA_TX_FLAG);
    dma_flag_clear(SPI_DMA_RX_FLAG);
-   dma_channel_enable(spi_dma_rx, TRUE);
+   dma_flag_clear(SPI_DMA_ERR_FLAGS);
+   /* transfer ends when last byte is received, or sent on writes */
+   dma_interrupt_enable(dma_rx ? spi_dma_rx : spi_dma_tx,
+                        DMA_FDT_INT | DMA_DTERR_INT, irq ? TRUE : FALSE);
+   if(dma_rx){
+      dma_channel_enable(spi_dma_rx, TRUE);
+   }
    dma_channel_enable(spi_dma_tx, TRUE);
-   while(dma_flag_get(SPI_DMA_RX_FLAG) == RESET);
+}
+
+/**
+ * @brief  Ends a dma transfer, releases chip select and calls
+ *         completion callback of asynchronous transfers
+ * @param  None
+ * @retval Number of bytes transferred
+ */
+static uint32_t spiflash_dma_end (void)
+{
+   dma_channel_type *ch = dma_rx ? spi_dma_rx : spi_dma_tx;
+   void (*done)(uint32_t count) = dma_done;
+   uint32_t count;
+   flag_status err = dma_flag_get(SPI_DMA_ERR_FLAGS);
+
+   dma_interrupt_enable(ch, DMA_FDT_INT | DMA_DTERR_INT, FALSE);
+   dma_flag_clear(SPI_DMA_TX_FLAG);
+   dma_flag_clear(SPI_DMA_RX_FLAG);
+   dma_flag_clear(SPI_DMA_ERR_FLAGS);
    dma_channel_enable(spi_dma_rx, FALSE);
    dma_channel_enable(spi_dma_tx, FALSE);
    spi_dma_tx->ctrl_bit.mincm = TRUE;
    spi_i2s_dma_receiver_enable(SPIFLASH, FALSE);
    spi_i2s_dma_transmitter_enable(SPIFLASH, FALSE);
+
+   if(!dma_rx){
+      /* last byte leaves shift register after dma is done */
+      while (spi_i2s_flag_get (SPIFLASH, SPI_I2S_BF_FLAG) == SET);
+   }
+   // An overrun error (ROERR flag) will occur on writes because we are
+   // only transmitting data without reading from spi_dt,
+   // leading to the receive buffer overflow.
    spiflash_check_errors ();
-   return len - dma_data_number_get(spi_dma_rx);
+
+   count = (err == RESET) ? dma_len - dma_data_number_get(ch) : 0;
+
+   dma_done = NULL;
+   if(done){
+      spiflash_cs (CS_HIGH);
+   }
+   dma_busy = 0;
+
+   if(done){
+      done (count);
+   }
+
+   return count;
 }
+
 /**
- * @brief  Reads a block of data using DMA
- * @param  pbuffer  Destination of read data
- * @param  len  Length of data to be read
- * @retval Number of bytes read
+ * @brief  Runs a transfer, small ones byte by byte and larger
+ *         ones with dma
+ * @param  txbuf  Data to send, NULL on reads
+ * @param  rxbuf  Destination of read data, NULL on writes
+ * @param  len  Length of data
+ * @retval Number of bytes transferred
  */
-uint32_t spiflash_write (const uint8_t *pbuffer, uint32_t len)
+static uint32_t spiflash_transfer (const uint8_t *txbuf, uint8_t *rxbuf, uint32_t len)
 {
    /* Don't support transfers larger than 64k
     * Because DMA is limited to 64k and read byte by byte
@@ -222,28 +358,154 @@ uint32_t spiflash_write (const uint8_t *pbuffer, uint32_t len)
    if(len >= 0x10000){
       return 0;
    }
-   /* for small transfers just write one by one */
+   /* for small transfers just exchange one by one */
    if(len < 10)
    {
-      uint32_t loop = len;
-      while (loop--)
-      {
-         spiflash_sendbyte (*(pbuffer++));
-      }
+      if(rxbuf)
+         spiflash_receive (rxbuf, len);
+      else if(txbuf)
+         spiflash_send (txbuf, len);
       return len;
    }
    /* Larger transfers, use DMA */
-   dma_data_number_set(spi_dma_tx, len);
-   spi_dma_tx->maddr = (uint32_t)pbuffer;
-   spi_i2s_dma_transmitter_enable(SPIFLASH, TRUE);
-   dma_flag_clear(SPI_DMA_TX_FLAG);
-   dma_channel_enable(spi_dma_tx, TRUE);
-   while(dma_flag_get(SPI_DMA_TX_FLAG) == RESET);
-   spi_i2s_dma_transmitter_enable(SPIFLASH, FALSE);
-   dma_channel_enable(spi_dma_tx, FALSE);
-   // An overrun error (ROERR flag) will occur because we are only
-   // transmitting data without reading from spi_dt,
-   // leading to the receive buffer overflow.
-   spiflash_check_errors ();
-   return len - dma_data_number_get(spi_dma_tx);
-}
\ No newline at end of file
+   spiflash_dma_start(txbuf, rxbuf, len, 0);
+   while(dma_flag_get(rxbuf ? SPI_DMA_RX_FLAG : SPI_DMA_TX_FLAG) == RESET &&
+         dma_flag_get(SPI_DMA_ERR_FLAGS) == RESET);
+   return spiflash_dma_end();
+}
+
+/**
+ * @brief  Reads a block of data using DMA
+ * @param  pbuffer  Destination of read data
+ * @param  len  Length of data to be read
+ * @retval Number of bytes read
+ */
+uint32_t spiflash_read (uint8_t *pbuffer, uint32_t len)
+{
+   return spiflash_transfer (NULL, pbuffer, len);
+}
+
+/**
+ * @brief  Writes a block of data using DMA
+ * @param  pbuffer  Data to be written
+ * @param  len  Length of data to be written
+ * @retval Number of bytes written
+ */
+uint32_t spiflash_write (const uint8_t *pbuffer, uint32_t len)
+{
+   return spiflash_transfer (pbuffer, NULL, len);
+}
+
+/**
+ * @brief  Starts a read that ends on dma interrupt, chip select is
+ *         released at the end and done is called from interrupt with
+ *         the number of bytes read. Small or too large transfers are
+ *         done at once and done is called before returning.
+ * @param  pbuffer  Destination of read data
+ * @param  len  Length of data to be read
+ * @param  done  Completion callback
+ * @retval None
+ */
+void spiflash_read_async (uint8_t *pbuffer, uint32_t len, void (*done)(uint32_t count))
+{
+   if(len < 10 || len >= 0x10000){
+      len = spiflash_transfer (NULL, pbuffer, len);
+      spiflash_cs (CS_HIGH);
+      done (len);
+      return;
+   }
+
+   dma_done = done;
+   spiflash_dma_start(NULL, pbuffer, len, 1);
+}
+
+/**
+ * @brief  Starts a write that ends on dma interrupt, see
+ *         spiflash_read_async
+ * @param  pbuffer  Data to be written, kept until done
+ * @param  len  Length of data to be written
+ * @param  done  Completion callback
+ * @retval None
+ */
+void spiflash_write_async (const uint8_t *pbuffer, uint32_t len, void (*done)(uint32_t count))
+{
+   if(len < 10 || len >= 0x10000){
+      len = spiflash_transfer (pbuffer, NULL, len);
+      spiflash_cs (CS_HIGH);
+      done (len);
+      return;
+   }
+
+   dma_done = done;
+   spiflash_dma_start(pbuffer, NULL, len, 1);
+}
+
+/**
+ * @brief  Runs a whole flash transaction, chip select, header with
+ *         instruction, address and dummy bytes, and data phase
+ * @param  hdr  Header bytes
+ * @param  hlen  Header length
+ * @param  txbuf  Data to send, NULL if none
+ * @param  rxbuf  Destination of read data, NULL if none
+ * @param  len  Length of data
+ * @retval Number of data bytes transferred
+ */
+uint32_t spiflash_command (const uint8_t *hdr, uint32_t hlen, const uint8_t *txbuf,
+                           uint8_t *rxbuf, uint32_t len)
+{
+   spiflash_cs (CS_LOW);
+   spiflash_send (hdr, hlen);
+   len = spiflash_transfer (txbuf, rxbuf, len);
+   spiflash_cs (CS_HIGH);
+   return len;
+}
+
+/**
+ * @brief  Starts a flash transaction whose data phase ends on dma
+ *         interrupt, see spiflash_command and spiflash_read_async
+ * @param  hdr  Header bytes, sent before returning
+ * @param  hlen  Header length
+ * @param  txbuf  Data to send, NULL on reads
+ * @param  rxbuf  Destination of read data, NULL on writes
+ * @param  len  Length of data
+ * @param  done  Completion callback
+ * @retval None
+ */
+void spiflash_command_async (const uint8_t *hdr, uint32_t hlen, const uint8_t *txbuf,
+                             uint8_t *rxbuf, uint32_t len, void (*done)(uint32_t count))
+{
+   spiflash_cs (CS_LOW);
+   spiflash_send (hdr, hlen);
+   if(rxbuf)
+      spiflash_read_async (rxbuf, len, done);
+   else
+      spiflash_write_async (txbuf, len, done);
+}
+
+/**
+ * @brief  Checks for a dma transfer in progress
+ * @param  None
+ * @retval 1 if busy, 0 otherwise
+ */
+uint8_t spiflash_busy (void)
+{
+   return dma_busy;
+}
+
+/**
+ * @brief  Spi flash dma channels isr, a single channel has
+ *         interrupts enabled at a time.
+ * @param  None
+ * @retval None
+ */
+void SPIFLASH_DMA_RX_IRQHandler (void)
+{
+   if (dma_busy && dma_done)
+      spiflash_dma_end ();
+}
+
+void SPIFLASH_DMA_TX_IRQHandler (void)
+{
+   if (dma_busy && dma_done)
+      spiflash_dma_end ();
+}
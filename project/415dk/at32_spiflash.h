@@ -15,9 +15,15 @@
 #include <stdint.h>
 void spiflash_cs(uint8_t state);
 void spiflash_init(void);
+uint32_t spiflash_set_clock(uint32_t freq);
 void spiflash_sendbyte (uint8_t byte);
 uint8_t spiflash_receivebyte (void);
 uint8_t spiflash_xchbyte (uint8_t byte);
 uint32_t spiflash_read (uint8_t *pbuffer, uint32_t len);
 uint32_t spiflash_write (const uint8_t *pbuffer, uint32_t len);
+void spiflash_read_async (uint8_t *pbuffer, uint32_t len, void (*done)(uint32_t count));
+void spiflash_write_async (const uint8_t *pbuffer, uint32_t len, void (*done)(uint32_t count));
+uint8_t spiflash_busy (void);
+uint32_t spiflash_command (const uint8_t *hdr, uint32_t hlen, const uint8_t *txbuf, uint8_t *rxbuf, uint32_t len);
+void spiflash_command_async (const uint8_t *hdr, uint32_t hlen, const uint8_t *txbuf, uint8_t *rxbuf, uint32_t len, void (*done)(uint32_t count));
 #endif
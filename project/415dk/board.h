@@ -34,8 +34,14 @@
 // ================================================
 // Spi Configuration
 // ================================================
+#ifdef ENABLE_DISK_SDCARD
+/* sdio1 uses PA2..PA7, spi flash is moved to spi2 */
+#define SPIFLASH_PERIPHERAL         2
+#else
 #define SPIFLASH_PERIPHERAL         1
+#endif
 #define SPIFLASH                    ((SPIFLASH_PERIPHERAL == 1)? SPI1 : SPI2)
+#if SPIFLASH_PERIPHERAL == 1
 /*SCK Pin*/
 #define SPIFLASH_SCK_PIN            GPIO_PINS_5
 #define SPIFLASH_SCK_GPIO           GPIOA
@@ -48,6 +54,21 @@
 /*CS Pin*/
 #define SPIFLASH_CS_PIN             GPIO_PINS_4
 #define SPIFLASH_CS_GPIO            GPIOA
+#else
+/*SCK Pin*/
+#define SPIFLASH_SCK_PIN            GPIO_PINS_13
+#define SPIFLASH_SCK_GPIO           GPIOB
+/*MISO Pin*/
+#define SPIFLASH_MISO_PIN           GPIO_PINS_14
+#define SPIFLASH_MISO_GPIO          GPIOB
+/*MOSI Pin*/
+#define SPIFLASH_MOSI_PIN           GPIO_PINS_15
+#define SPIFLASH_MOSI_GPIO          GPIOB
+/*CS Pin*/
+#define SPIFLASH_CS_PIN             GPIO_PINS_12
+#define SPIFLASH_CS_GPIO            GPIOB
+#endif
+#define SPIFLASH_MAX_CLOCK          36000000    /* board wiring limit (Hz) */
 #define CS_LOW                      0
 #define CS_HIGH                     1
 #define FLASH_DUMMY_BYTE            0xff
@@ -98,6 +119,7 @@ void usb_clock48m_select(usb_clk48_s clk_s);
 void usb_config(void);
 void usb_gpio_deinit(void);
 void usb_unplug(void);
+void usb_task(void);
 void sw_reset(void);
 uint8_t usb_isConnected(void);
 void button_init(void);
@@ -0,0 +1,30 @@
+// =============================================================================
+/*!
+ * @file       core_cm4.h
+ *
+ * Host replacement of the cmsis core header, provides the register
+ * qualifiers and interrupt intrinsics used by the sources under test.
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#ifndef __CORE_CM4_H
+#define __CORE_CM4_H
+
+#include <stdint.h>
+
+#define __I     volatile const
+#define __O     volatile
+#define __IO    volatile
+#define __IM    volatile const
+#define __OM    volatile
+#define __IOM   volatile
+
+static inline void __disable_irq (void) {}
+static inline void __enable_irq (void) {}
+static inline void __DSB (void) {}
+static inline void __ISB (void) {}
+
+#endif
@@ -0,0 +1,440 @@
+// =============================================================================
+/*!
+ * @file       nor_model.c
+ *
+ * This file contains a spi nor flash model for host tests, it replaces
+ * the at32_spiflash driver and decodes instructions as a W25Q64 would.
+ *
+ * Page program and erase take effect when chip select is released, they
+ * need a write enable first and program can only clear bits. The device
+ * is never busy. No SFDP table is exposed so the driver uses its device
+ * table entry.
+ *
+ * A power cut can be armed to happen on a given program or erase, that
+ * operation is left torn, a random part of the page programmed or the
+ * sector half erased, and later program and erase instructions are
+ * ignored until nor_power_on().
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "board.h"
+#include "flashspi.h"
+#include "nor_model.h"
+
+#define NOR_JEDEC_ID            0xEF4017
+#define NOR_REMS_ID             0xEF16
+#define NOR_MAX_CLOCK           36000000
+#define NOR_PCLK                72000000
+
+#define NOR_CMD_WRDI            0x04
+#define NOR_CMD_RDSR2           0x35
+#define NOR_CMD_CE2             0x60
+
+uint8_t nor_mem[NOR_SIZE];
+nor_stats_t nor_stats;
+uint32_t nor_tick;
+
+static struct {
+   uint8_t cs;                         /* chip selected */
+   uint8_t cmd;
+   uint8_t wel;                        /* write enable latch */
+   uint32_t pos;                       /* byte index in transaction */
+   uint32_t addr;
+   uint8_t page[NOR_PAGE_SIZE];        /* page program data */
+   uint32_t plen;
+   uint8_t cut;                        /* power cut armed */
+   uint32_t cut_ops;                   /* program/erase before cut */
+   uint8_t dead;                       /* power lost */
+}nor;
+
+/**
+ * @brief  Stops the test on an instruction sequence a real device
+ *         would not accept
+ * @param  msg: reason
+ */
+static void nor_fail (const char *msg)
+{
+   printf ("FAIL nor model: %s, cmd %02x addr %06x\n", msg, nor.cmd, nor.addr);
+   exit (1);
+}
+
+/**
+ * @brief  Checks power cut on a program or erase about to execute
+ * @retval 1 if operation must be left torn
+ */
+static uint8_t nor_torn (void)
+{
+   if (!nor.cut)
+   {
+      return 0;
+   }
+   if (nor.cut_ops != 0)
+   {
+      nor.cut_ops--;
+      return 0;
+   }
+   nor.cut = 0;
+   nor.dead = 1;
+   return 1;
+}
+
+/**
+ * @brief  Erases a region, a torn erase sets a random part of the bits
+ * @param  addr: region start, aligned to size
+ * @param  size: region size
+ */
+static void nor_erase (uint32_t addr, uint32_t size)
+{
+   uint32_t i;
+
+   if (addr % size)
+   {
+      nor_fail ("unaligned erase");
+   }
+
+   if (nor_torn ())
+   {
+      for (i = 0; i < size; i++)
+      {
+         nor_mem[addr + i] |= rand ();
+      }
+      return;
+   }
+
+   memset (nor_mem + addr, 0xFF, size);
+}
+
+/**
+ * @brief  Programs buffered page data, a torn program writes a
+ *         random number of the first bytes only
+ */
+static void nor_program (void)
+{
+   uint32_t i, len = nor.plen;
+
+   if (nor_torn ())
+   {
+      len = rand () % (len + 1);
+   }
+
+   for (i = 0; i < len; i++)
+   {
+      nor_mem[(nor.addr & ~(NOR_PAGE_SIZE - 1)) | ((nor.addr + i) & (NOR_PAGE_SIZE - 1))] &= nor.page[i];
+   }
+
+   nor_stats.page_program++;
+   nor_stats.program_bytes += nor.plen;
+}
+
+/**
+ * @brief  Executes program and erase instructions on chip select release
+ */
+static void nor_end (void)
+{
+   uint8_t write = 1;
+
+   if (nor.cmd == FLASHSPI_CMD_PP && nor.pos > 4)
+   {
+      if (!nor.dead) nor_program ();
+   }
+   else if (nor.cmd == FLASHSPI_CMD_SE && nor.pos == 4)
+   {
+      if (!nor.dead) nor_erase (nor.addr & ~(NOR_SECTOR_SIZE - 1), NOR_SECTOR_SIZE);
+      nor_stats.erase4k++;
+   }
+   else if (nor.cmd == FLASHSPI_CMD_BE32 && nor.pos == 4)
+   {
+      if (!nor.dead) nor_erase (nor.addr, FLASHSPI_BE32_SIZE);
+      nor_stats.erase32k++;
+   }
+   else if (nor.cmd == FLASHSPI_CMD_BE64 && nor.pos == 4)
+   {
+      if (!nor.dead) nor_erase (nor.addr, FLASHSPI_BE64_SIZE);
+      nor_stats.erase64k++;
+   }
+   else if ((nor.cmd == FLASHSPI_CMD_CE || nor.cmd == NOR_CMD_CE2) && nor.pos == 1)
+   {
+      nor.addr = 0;
+      if (!nor.dead) nor_erase (0, NOR_SIZE);
+      nor_stats.chip_erase++;
+   }
+   else
+   {
+      write = 0;
+   }
+
+   if (write)
+   {
+      if (!nor.wel)
+      {
+         nor_fail ("program or erase without write enable");
+      }
+      nor.wel = 0;
+   }
+}
+
+/**
+ * @brief  Exchanges one byte of the current transaction
+ * @param  byte: byte sent by the driver
+ * @retval byte sent by the device
+ */
+static uint8_t nor_xch (uint8_t byte)
+{
+   uint8_t rx = 0xFF;
+   uint32_t pos = nor.pos++;
+
+   if (!nor.cs)
+   {
+      nor_fail ("transfer without chip select");
+   }
+
+   if (pos == 0)
+   {
+      nor.cmd = byte;
+      nor.addr = 0;
+      nor.plen = 0;
+      if (byte == FLASHSPI_CMD_WREN)
+      {
+         nor.wel = 1;
+      }
+      else if (byte == NOR_CMD_WRDI)
+      {
+         nor.wel = 0;
+      }
+      return rx;
+   }
+
+   switch (nor.cmd)
+   {
+      case FLASHSPI_CMD_READ:
+      case FLASHSPI_CMD_FAST_READ:
+      case FLASHSPI_CMD_PP:
+      case FLASHSPI_CMD_SE:
+      case FLASHSPI_CMD_BE32:
+      case FLASHSPI_CMD_BE64:
+      case FLASHSPI_CMD_RDSFDP:
+      case FLASHSPI_CMD_REMS:
+         if (pos <= 3)
+         {
+            nor.addr = ((nor.addr << 8) | byte) % NOR_SIZE;
+            break;
+         }
+         /* dummy byte */
+         if ((nor.cmd == FLASHSPI_CMD_FAST_READ || nor.cmd == FLASHSPI_CMD_RDSFDP) && pos == 4)
+         {
+            break;
+         }
+         if (nor.cmd == FLASHSPI_CMD_READ || nor.cmd == FLASHSPI_CMD_FAST_READ)
+         {
+            rx = nor_mem[nor.addr];
+            nor.addr = (nor.addr + 1) % NOR_SIZE;
+            nor_stats.read_bytes++;
+         }
+         else if (nor.cmd == FLASHSPI_CMD_PP)
+         {
+            if (nor.plen == NOR_PAGE_SIZE)
+            {
+               nor_fail ("page program over page size");
+            }
+            nor.page[nor.plen++] = byte;
+         }
+         else if (nor.cmd == FLASHSPI_CMD_REMS)
+         {
+            rx = ((pos - 4) & 1) ? NOR_REMS_ID & 0xFF : NOR_REMS_ID >> 8;
+         }
+         else if (nor.cmd == FLASHSPI_CMD_SE || nor.cmd == FLASHSPI_CMD_BE32 ||
+                  nor.cmd == FLASHSPI_CMD_BE64)
+         {
+            nor_fail ("erase with data");
+         }
+         break;
+
+      case FLASHSPI_CMD_RDID:
+         rx = (pos <= 3) ? (uint8_t)(NOR_JEDEC_ID >> (8 * (3 - pos))) : 0xFF;
+         break;
+
+      case FLASHSPI_CMD_RDSR:
+         rx = nor.wel << 1;
+         break;
+
+      case NOR_CMD_RDSR2:
+         rx = 0;
+         break;
+
+      default:
+         break;
+   }
+
+   return rx;
+}
+
+void nor_reset_stats (void)
+{
+   memset (&nor_stats, 0, sizeof (nor_stats));
+}
+
+/**
+ * @brief  Arms a power cut
+ * @param  ops: program or erase operations completed before the torn one
+ */
+void nor_power_cut (uint32_t ops)
+{
+   nor.cut = 1;
+   nor.cut_ops = ops;
+}
+
+uint8_t nor_power_lost (void)
+{
+   return nor.dead;
+}
+
+/**
+ * @brief  Restores power, device comes up with write enable clear
+ */
+void nor_power_on (void)
+{
+   nor.cut = 0;
+   nor.dead = 0;
+   nor.wel = 0;
+}
+
+/* --------------------------------------------------------------------------- */
+/* at32_spiflash interface                                                     */
+/* --------------------------------------------------------------------------- */
+
+uint32_t GetTick (void)
+{
+   return nor_tick;
+}
+
+void spiflash_init (void)
+{
+   nor.cs = 0;
+}
+
+uint32_t spiflash_set_clock (uint32_t freq)
+{
+   uint32_t div;
+
+   if (freq > NOR_MAX_CLOCK)
+   {
+      freq = NOR_MAX_CLOCK;
+   }
+   for (div = 0; div < 7; div++)
+   {
+      if ((NOR_PCLK >> (div + 1)) <= freq)
+      {
+         break;
+      }
+   }
+   return NOR_PCLK >> (div + 1);
+}
+
+void spiflash_cs (uint8_t state)
+{
+   if (state == CS_LOW)
+   {
+      nor.cs = 1;
+      nor.pos = 0;
+   }
+   else if (nor.cs)
+   {
+      nor.cs = 0;
+      nor_end ();
+   }
+}
+
+void spiflash_sendbyte (uint8_t byte)
+{
+   nor_xch (byte);
+}
+
+uint8_t spiflash_receivebyte (void)
+{
+   return nor_xch (FLASH_DUMMY_BYTE);
+}
+
+uint8_t spiflash_xchbyte (uint8_t byte)
+{
+   return nor_xch (byte);
+}
+
+uint32_t spiflash_read (uint8_t *pbuffer, uint32_t len)
+{
+   uint32_t i;
+
+   for (i = 0; i < len; i++)
+   {
+      pbuffer[i] = nor_xch (FLASH_DUMMY_BYTE);
+   }
+   return len;
+}
+
+uint32_t spiflash_write (const uint8_t *pbuffer, uint32_t len)
+{
+   uint32_t i;
+
+   for (i = 0; i < len; i++)
+   {
+      nor_xch (pbuffer[i]);
+   }
+   return len;
+}
+
+/* transfers complete at once, chip select is released before done */
+void spiflash_read_async (uint8_t *pbuffer, uint32_t len, void (*done)(uint32_t count))
+{
+   len = spiflash_read (pbuffer, len);
+   spiflash_cs (CS_HIGH);
+   done (len);
+}
+
+void spiflash_write_async (const uint8_t *pbuffer, uint32_t len, void (*done)(uint32_t count))
+{
+   len = spiflash_write (pbuffer, len);
+   spiflash_cs (CS_HIGH);
+   done (len);
+}
+
+uint8_t spiflash_busy (void)
+{
+   return 0;
+}
+
+uint32_t spiflash_command (const uint8_t *hdr, uint32_t hlen, const uint8_t *txbuf,
+                           uint8_t *rxbuf, uint32_t len)
+{
+   spiflash_cs (CS_LOW);
+   spiflash_write (hdr, hlen);
+   if (rxbuf)
+   {
+      spiflash_read (rxbuf, len);
+   }
+   else if (txbuf)
+   {
+      spiflash_write (txbuf, len);
+   }
+   spiflash_cs (CS_HIGH);
+   return len;
+}
+
+void spiflash_command_async (const uint8_t *hdr, uint32_t hlen, const uint8_t *txbuf,
+                             uint8_t *rxbuf, uint32_t len, void (*done)(uint32_t count))
+{
+   spiflash_cs (CS_LOW);
+   spiflash_write (hdr, hlen);
+   if (rxbuf)
+   {
+      spiflash_read_async (rxbuf, len, done);
+   }
+   else
+   {
+      spiflash_write_async (txbuf, len, done);
+   }
+}
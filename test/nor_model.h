@@ -0,0 +1,40 @@
+// =============================================================================
+/*!
+ * @file       nor_model.h
+ *
+ * This file contains the interface of the spi nor flash model used by
+ * host tests in place of the at32_spiflash driver
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#ifndef __NOR_MODEL_H
+#define __NOR_MODEL_H
+#include <stdint.h>
+
+#define NOR_SIZE                0x800000    /*!< W25Q64, 8MB */
+#define NOR_SECTOR_SIZE         0x1000
+#define NOR_PAGE_SIZE           0x100
+
+typedef struct {
+   uint32_t erase4k;
+   uint32_t erase32k;
+   uint32_t erase64k;
+   uint32_t chip_erase;
+   uint32_t page_program;
+   uint32_t program_bytes;
+   uint32_t read_bytes;
+}nor_stats_t;
+
+extern uint8_t nor_mem[NOR_SIZE];
+extern nor_stats_t nor_stats;
+extern uint32_t nor_tick;
+
+void nor_reset_stats (void);
+void nor_power_cut (uint32_t ops);
+uint8_t nor_power_lost (void);
+void nor_power_on (void);
+
+#endif
@@ -0,0 +1,153 @@
+// =============================================================================
+/*!
+ * @file       test_diskio.c
+ *
+ * Host test of the RAM disk lun, built as in the bench firmware with the
+ * RAM disk as only lun. It is checked through the usb block device
+ * operations and through the FatFs disk interface.
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "diskio.h"
+#include "msc_diskio.h"
+
+#define SECTORS                 (RAMDISK_SIZE / FF_MIN_SS)
+
+#define CHECK(cond, ...) \
+   do { if (!(cond)) { printf ("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf (__VA_ARGS__); printf ("\n"); exit (1); } } while (0)
+
+static uint8_t ref[RAMDISK_SIZE];
+
+static void test_init (void)
+{
+   const msc_disk_ops_type *ops = msc_disk_get_ops (RAMDISK_LUN);
+   uint64_t blk_nbr;
+   uint32_t blk_size;
+   uint8_t lun;
+
+   CHECK (ops != NULL && ops->read && ops->write && ops->capacity, "ram disk ops");
+   CHECK (disk_status (RAMDISK_LUN) & STA_NOINIT, "ready before init");
+   CHECK (ops->capacity (&blk_nbr, &blk_size) != USB_OK, "capacity before init");
+
+   CHECK (msc_disk_init (RAMDISK_LUN) == USB_OK, "msc init");
+   CHECK (disk_status (RAMDISK_LUN) == 0, "not ready after init");
+   CHECK (ops->capacity (&blk_nbr, &blk_size) == USB_OK && blk_nbr == SECTORS &&
+          blk_size == FF_MIN_SS, "capacity %u x %u", (uint32_t)blk_nbr, blk_size);
+
+   /* no other lun is built in */
+   for (lun = 0; lun < 4; lun++)
+   {
+      if (lun == RAMDISK_LUN)
+      {
+         continue;
+      }
+      CHECK (msc_disk_get_ops (lun) == NULL, "ops on lun %u", lun);
+      CHECK (msc_disk_init (lun) != USB_OK, "init of lun %u", lun);
+      CHECK (disk_status (lun) & STA_NOINIT, "drive %u ready", lun);
+      CHECK (disk_read (lun, ref, 0, 1) == RES_PARERR, "read of drive %u", lun);
+   }
+}
+
+static void test_ioctl (void)
+{
+   LBA_t count = 0;
+   WORD size = 0;
+   DWORD block = 0;
+
+   CHECK (disk_ioctl (RAMDISK_LUN, CTRL_SYNC, NULL) == RES_OK, "sync");
+   CHECK (disk_ioctl (RAMDISK_LUN, GET_SECTOR_COUNT, &count) == RES_OK && count == SECTORS,
+          "sector count %u", (uint32_t)count);
+   CHECK (disk_ioctl (RAMDISK_LUN, GET_SECTOR_SIZE, &size) == RES_OK && size == FF_MIN_SS,
+          "sector size %u", size);
+   CHECK (disk_ioctl (RAMDISK_LUN, GET_BLOCK_SIZE, &block) == RES_OK && block == 1,
+          "block size %u", block);
+   CHECK (disk_ioctl (RAMDISK_LUN, 0xFF, NULL) == RES_PARERR, "unknown ioctl");
+}
+
+static void test_data (void)
+{
+   const msc_disk_ops_type *ops = msc_disk_get_ops (RAMDISK_LUN);
+   static uint8_t buf[RAMDISK_SIZE];
+   uint32_t i, sector, count, len;
+   uint8_t *p;
+   int t;
+
+   for (i = 0; i < RAMDISK_SIZE; i++)
+   {
+      ref[i] = rand ();
+   }
+   CHECK (disk_write (RAMDISK_LUN, ref, 0, SECTORS) == RES_OK, "fill");
+
+   for (t = 0; t < 1000; t++)
+   {
+      count = 1 + rand () % 16;
+      sector = rand () % (SECTORS - count);
+      for (i = 0; i < count * FF_MIN_SS; i++)
+      {
+         buf[i] = rand ();
+      }
+
+      /* written on one interface, read back on the other */
+      if (t & 1)
+      {
+         CHECK (disk_write (RAMDISK_LUN, buf, sector, count) == RES_OK, "disk write %u", sector);
+      }
+      else
+      {
+         CHECK (ops->write ((uint64_t)sector * FF_MIN_SS, buf, count * FF_MIN_SS) == USB_OK,
+                "ops write %u", sector);
+      }
+      memcpy (ref + sector * FF_MIN_SS, buf, count * FF_MIN_SS);
+
+      memset (buf, 0, count * FF_MIN_SS);
+      if (t & 1)
+      {
+         CHECK (ops->read ((uint64_t)sector * FF_MIN_SS, buf, count * FF_MIN_SS) == USB_OK,
+                "ops read %u", sector);
+      }
+      else
+      {
+         CHECK (disk_read (RAMDISK_LUN, buf, sector, count) == RES_OK, "disk read %u", sector);
+      }
+      CHECK (memcmp (buf, ref + sector * FF_MIN_SS, count * FF_MIN_SS) == 0,
+             "data mismatch sector %u count %u", sector, count);
+   }
+
+   /* whole disk is memory mapped */
+   len = 4096;
+   p = ops->direct (FF_MIN_SS, &len);
+   CHECK (p != NULL && len == 4096 && memcmp (p, ref + FF_MIN_SS, len) == 0, "direct read");
+   len = 4096;
+   p = ops->direct (RAMDISK_SIZE - FF_MIN_SS, &len);
+   CHECK (p != NULL && len == FF_MIN_SS, "direct read clipped to %u", len);
+   len = FF_MIN_SS;
+   CHECK (ops->direct (RAMDISK_SIZE, &len) == NULL, "direct read past end");
+
+   /* out of range leaves disk untouched */
+   CHECK (disk_write (RAMDISK_LUN, buf, SECTORS - 1, 2) == RES_ERROR, "write past end");
+   CHECK (disk_read (RAMDISK_LUN, buf, SECTORS - 1, 2) == RES_ERROR, "read past end");
+   CHECK (ops->write (RAMDISK_SIZE, buf, FF_MIN_SS) != USB_OK, "ops write past end");
+   CHECK (disk_write (RAMDISK_LUN, buf, 0, 0) == RES_PARERR, "empty write");
+
+   /* FatFs initialize keeps contents written over usb */
+   CHECK (disk_initialize (RAMDISK_LUN) == 0, "initialize");
+   CHECK (disk_read (RAMDISK_LUN, buf, 0, SECTORS) == RES_OK &&
+          memcmp (buf, ref, RAMDISK_SIZE) == 0, "contents lost on initialize");
+}
+
+int main (void)
+{
+   test_init ();
+   test_ioctl ();
+   test_data ();
+
+   printf ("test_diskio: OK\n");
+   return 0;
+}
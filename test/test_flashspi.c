@@ -0,0 +1,274 @@
+// =============================================================================
+/*!
+ * @file       test_flashspi.c
+ *
+ * Host test of the spi flash driver write paths over the nor flash model.
+ *
+ * Each write is checked against a reference image and the erase and
+ * program counts of the model are checked for the write paths: unchanged
+ * data is skipped, data that only clears bits is programmed in place and
+ * a covered erase block is erased with a single instruction only when
+ * enough of its sectors need an erase. Writes made of sequential chunks
+ * erase a block the whole write covers on its first chunk.
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flashspi.h"
+#include "nor_model.h"
+
+#define SECTOR                  NOR_SECTOR_SIZE
+#define BLOCK                   FLASHSPI_BE32_SIZE
+#define AREA                    0x100000
+
+#define CHECK(cond, ...) \
+   do { if (!(cond)) { printf ("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf (__VA_ARGS__); printf ("\n"); exit (1); } } while (0)
+
+#define CHECK_STATS(what, e4k, e32k, pp) \
+   CHECK (nor_stats.erase4k == (e4k) && nor_stats.erase32k == (e32k) && \
+          nor_stats.erase64k == 0 && nor_stats.page_program == (pp), \
+          "%s: %u/%u/%u erases, %u programs", what, nor_stats.erase4k, \
+          nor_stats.erase32k, nor_stats.erase64k, nor_stats.page_program)
+
+static uint8_t ref[NOR_SIZE];
+static uint8_t buf[BLOCK];
+
+static void write_ref (uint32_t addr, uint32_t len)
+{
+   CHECK (flashspi_write (buf, addr, len) == FLASHSPI_OK, "write %x+%u", addr, len);
+   memcpy (ref + addr, buf, len);
+   CHECK (memcmp (nor_mem, ref, NOR_SIZE) == 0, "flash mismatch after write %x+%u", addr, len);
+}
+
+static void random_fill (uint32_t len)
+{
+   uint32_t i;
+
+   for (i = 0; i < len; i++)
+   {
+      buf[i] = rand ();
+   }
+}
+
+static void test_init (void)
+{
+   memset (nor_mem, 0xFF, NOR_SIZE);
+   memset (ref, 0xFF, NOR_SIZE);
+
+   CHECK (flashspi_init () == FLASHSPI_OK, "init");
+   CHECK (flashspi_get_size () == NOR_SIZE && flashspi_get_sector_size () == SECTOR &&
+          flashspi_get_page_size () == NOR_PAGE_SIZE, "geometry");
+   CHECK (flashspi_get_device ()->be32_cmd == FLASHSPI_CMD_BE32, "no 32kB block erase");
+}
+
+static void test_blank (void)
+{
+   uint32_t addr;
+
+   /* erased flash is programmed without erase */
+   nor_reset_stats ();
+   for (addr = 0; addr < AREA; addr += BLOCK)
+   {
+      random_fill (BLOCK);
+      write_ref (addr, BLOCK);
+   }
+   CHECK_STATS ("blank", 0, 0, AREA / NOR_PAGE_SIZE);
+}
+
+static void test_same (void)
+{
+   uint32_t addr;
+
+   /* unchanged data, e.g. fat copies rewritten, is neither erased
+      nor programmed */
+   nor_reset_stats ();
+   for (addr = 0; addr < AREA; addr += BLOCK)
+   {
+      memcpy (buf, ref + addr, BLOCK);
+      write_ref (addr, BLOCK);
+   }
+   memcpy (buf, ref + SECTOR + 512, 512);
+   write_ref (SECTOR + 512, 512);
+   CHECK_STATS ("same", 0, 0, 0);
+}
+
+static void test_clear_bits (void)
+{
+   uint32_t addr, i, j;
+
+   /* one byte per sector is cleared, only its page is programmed */
+   nor_reset_stats ();
+   for (addr = 0; addr < AREA; addr += BLOCK)
+   {
+      memcpy (buf, ref + addr, BLOCK);
+      for (i = 0; i < BLOCK; i += SECTOR)
+      {
+         for (j = i; buf[j] == 0; j++);
+         buf[j] = 0;
+      }
+      write_ref (addr, BLOCK);
+   }
+   CHECK_STATS ("clear bits", 0, 0, AREA / SECTOR);
+}
+
+static void test_overwrite (void)
+{
+   uint32_t addr, n, i;
+
+   /* new data over whole blocks, one block erase each */
+   nor_reset_stats ();
+   for (addr = 0; addr < AREA; addr += BLOCK)
+   {
+      random_fill (BLOCK);
+      write_ref (addr, BLOCK);
+   }
+   CHECK_STATS ("overwrite", 0, AREA / BLOCK, AREA / NOR_PAGE_SIZE);
+
+   /* few sectors needing erase are erased alone, the others of the
+      block are left untouched. Sectors start with a zero byte that
+      needs an erase to be set back */
+   for (n = 1; n <= BLOCK / SECTOR; n++)
+   {
+      memcpy (buf, ref, BLOCK);
+      for (i = 0; i < BLOCK; i += SECTOR)
+      {
+         buf[i] = 0;
+      }
+      write_ref (0, BLOCK);
+
+      for (i = 0; i < n; i++)
+      {
+         buf[i * SECTOR] = 0xFF;
+      }
+      nor_reset_stats ();
+      write_ref (0, BLOCK);
+
+      /* w25q64 erases a 32kB block in the maximum time of 4 sectors */
+      if (n < 4)
+      {
+         CHECK_STATS ("partial overwrite", n, 0, n * SECTOR / NOR_PAGE_SIZE);
+      }
+      else
+      {
+         CHECK_STATS ("partial overwrite", 0, 1, BLOCK / NOR_PAGE_SIZE);
+      }
+   }
+
+   /* unaligned write covers no block, sectors are erased one by one */
+   random_fill (BLOCK);
+   nor_reset_stats ();
+   write_ref (AREA + SECTOR, BLOCK);
+   CHECK (nor_stats.erase32k == 0 && nor_stats.erase4k == 0, "unaligned on blank flash erased");
+   random_fill (BLOCK);
+   nor_reset_stats ();
+   write_ref (AREA + SECTOR, BLOCK);
+   CHECK_STATS ("unaligned overwrite", BLOCK / SECTOR, 0, BLOCK / NOR_PAGE_SIZE);
+}
+
+static void write_run (uint32_t addr, uint32_t len, uint32_t chunk)
+{
+   uint32_t pos;
+
+   /* sequential chunks of one write, as usb data arrives */
+   for (pos = 0; pos < len; pos += chunk)
+   {
+      CHECK (flashspi_write_run (buf + pos, addr + pos, chunk, addr + len) == FLASHSPI_OK,
+             "write run %x+%u", addr + pos, chunk);
+   }
+   memcpy (ref + addr, buf, len);
+   CHECK (memcmp (nor_mem, ref, NOR_SIZE) == 0, "flash mismatch after write run %x+%u", addr, len);
+}
+
+static void test_run (void)
+{
+   /* block covered by a run of sector chunks with new data is erased
+      once on its first chunk */
+   random_fill (BLOCK);
+   nor_reset_stats ();
+   write_run (0, BLOCK, SECTOR);
+   CHECK_STATS ("new data run", 0, 1, BLOCK / NOR_PAGE_SIZE);
+
+   /* unchanged first sector leaves the block to sector writes */
+   random_fill (BLOCK);
+   memcpy (buf, ref, SECTOR);
+   nor_reset_stats ();
+   write_run (0, BLOCK, SECTOR);
+   CHECK_STATS ("run with same start", BLOCK / SECTOR - 1, 0, (BLOCK - SECTOR) / NOR_PAGE_SIZE);
+
+   /* run not covering an aligned block erases sectors only */
+   random_fill (BLOCK);
+   nor_reset_stats ();
+   write_run (SECTOR, BLOCK - SECTOR, SECTOR);
+   CHECK_STATS ("short run", BLOCK / SECTOR - 1, 0, (BLOCK - SECTOR) / NOR_PAGE_SIZE);
+}
+
+static void test_random (void)
+{
+   uint32_t addr, len, i;
+   int t;
+
+   for (t = 0; t < 3000; t++)
+   {
+      len  = 1 + rand () % BLOCK;
+      addr = rand () % (AREA * 2 - len);
+      switch (rand () % 3)
+      {
+         case 0:
+            random_fill (len);
+            break;
+         case 1:
+            /* clears bits */
+            for (i = 0; i < len; i++)
+            {
+               buf[i] = ref[addr + i] & (rand () | rand ());
+            }
+            break;
+         default:
+            /* mostly unchanged */
+            for (i = 0; i < len; i++)
+            {
+               buf[i] = (rand () % 16) ? ref[addr + i] : rand ();
+            }
+            break;
+      }
+      write_ref (addr, len);
+   }
+}
+
+static void test_erase_range (void)
+{
+   /* only sectors fully covered by range are erased */
+   nor_reset_stats ();
+   CHECK (flashspi_erase_range (SECTOR / 2, BLOCK + 2 * SECTOR) == FLASHSPI_OK, "erase range");
+   memset (ref + SECTOR, 0xFF, BLOCK + SECTOR);
+   CHECK (memcmp (nor_mem, ref, NOR_SIZE) == 0, "flash mismatch after erase range");
+   CHECK (nor_stats.erase32k + nor_stats.erase4k > 0, "nothing erased");
+
+   /* erased sectors are skipped */
+   nor_reset_stats ();
+   CHECK (flashspi_erase_range (SECTOR, BLOCK + SECTOR) == FLASHSPI_OK, "erase range");
+   CHECK_STATS ("erased range", 0, 0, 0);
+}
+
+int main (void)
+{
+   srand (1);
+
+   test_init ();
+   test_blank ();
+   test_same ();
+   test_clear_bits ();
+   test_overwrite ();
+   test_run ();
+   test_random ();
+   test_erase_range ();
+
+   printf ("test_flashspi: OK\n");
+   return 0;
+}
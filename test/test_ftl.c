@@ -0,0 +1,197 @@
+// =============================================================================
+/*!
+ * @file       test_ftl.c
+ *
+ * Host test of the flash translation layer over the spi flash driver and
+ * the nor flash model.
+ *
+ * Data written is checked against a reference across remounts. Power is
+ * then cut on random program and erase operations of writes and of
+ * background work, after power on the driver and ftl are initialized
+ * again and every sector of the interrupted write must read as its old
+ * or its new data.
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ftl.h"
+#include "nor_model.h"
+
+#define SECTOR                  FTL_SECTOR_SIZE
+#define MAX_SECTORS             8
+
+#define CHECK(cond, ...) \
+   do { if (!(cond)) { printf ("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf (__VA_ARGS__); printf ("\n"); exit (1); } } while (0)
+
+static uint8_t ref[FTL_MAX_SIZE];
+static uint8_t buf[MAX_SECTORS * SECTOR];
+static uint8_t rbuf[4096];
+static uint32_t nsect;
+
+static void check_all (const char *what)
+{
+   uint32_t addr, len, size = ftl_get_size ();
+
+   for (addr = 0; addr < size; addr += len)
+   {
+      len = (size - addr < sizeof (rbuf)) ? size - addr : sizeof (rbuf);
+      CHECK (ftl_read (rbuf, addr, len) == FLASHSPI_OK, "%s: read %u", what, addr);
+      CHECK (memcmp (rbuf, ref + addr, len) == 0, "%s: mismatch at %u", what, addr);
+   }
+}
+
+static void remount (void)
+{
+   nor_power_on ();
+   CHECK (flashspi_init () == FLASHSPI_OK, "flashspi init");
+   CHECK (ftl_mount () == FLASHSPI_OK, "mount");
+   CHECK (ftl_get_size () == nsect * SECTOR, "size %u after mount", ftl_get_size ());
+}
+
+static void random_write (uint32_t *lba, uint32_t *count)
+{
+   uint32_t i;
+
+   *count = 1 + rand () % MAX_SECTORS;
+   /* most writes go to a few hot sectors, as file system metadata */
+   *lba = (rand () % 10 < 8) ? rand () % 32 : rand () % (nsect - *count);
+   for (i = 0; i < *count * SECTOR; i++)
+   {
+      buf[i] = rand ();
+   }
+}
+
+static void idle (uint32_t steps)
+{
+   nor_tick += FTL_IDLE_MS;
+   while (steps--)
+   {
+      ftl_idle ();
+   }
+}
+
+static void test_mount (void)
+{
+   /* contents left by other use of the flash */
+   memset (nor_mem, 0x5A, NOR_SIZE);
+   memset (ref, 0xFF, sizeof (ref));
+
+   CHECK (flashspi_init () == FLASHSPI_OK, "flashspi init");
+   CHECK (ftl_mount () == FLASHSPI_OK, "mount");
+   nsect = ftl_get_size () / SECTOR;
+   CHECK (nsect > 0 && nsect * SECTOR <= FTL_MAX_SIZE, "size %u", ftl_get_size ());
+   check_all ("unwritten");
+}
+
+static void test_data (void)
+{
+   uint32_t lba, count;
+   int t;
+
+   /* fill */
+   for (lba = 0; lba < nsect; lba += count)
+   {
+      count = (nsect - lba < MAX_SECTORS) ? nsect - lba : MAX_SECTORS;
+      for (t = 0; t < count * SECTOR; t++)
+      {
+         buf[t] = rand ();
+      }
+      CHECK (ftl_write (buf, lba * SECTOR, count * SECTOR) == FLASHSPI_OK, "fill %u", lba);
+      memcpy (ref + lba * SECTOR, buf, count * SECTOR);
+   }
+   check_all ("fill");
+
+   for (t = 0; t < 20000; t++)
+   {
+      random_write (&lba, &count);
+      CHECK (ftl_write (buf, lba * SECTOR, count * SECTOR) == FLASHSPI_OK, "write %u", lba);
+      memcpy (ref + lba * SECTOR, buf, count * SECTOR);
+
+      if (t % 1000 == 0)
+      {
+         idle (20);
+      }
+      if (t % 5000 == 0)
+      {
+         remount ();
+         check_all ("remount");
+      }
+   }
+   check_all ("random writes");
+
+   /* discarded sectors read erased until next mount */
+   CHECK (ftl_discard (SECTOR / 2, 16 * SECTOR) == FLASHSPI_OK, "discard");
+   memset (ref + SECTOR, 0xFF, 15 * SECTOR);
+   check_all ("discard");
+
+   /* previous data may reappear after mount */
+   remount ();
+   CHECK (ftl_read (ref + SECTOR, SECTOR, 15 * SECTOR) == FLASHSPI_OK, "read");
+   check_all ("discard remount");
+}
+
+static void test_power_cut (void)
+{
+   uint32_t lba, count, i, cuts = 0;
+   uint8_t *p;
+   int t;
+
+   for (t = 0; t < 2000; t++)
+   {
+      random_write (&lba, &count);
+
+      nor_power_cut (rand () % (8 * count + 16));
+      ftl_write (buf, lba * SECTOR, count * SECTOR);
+
+      if (!nor_power_lost ())
+      {
+         memcpy (ref + lba * SECTOR, buf, count * SECTOR);
+      }
+      else
+      {
+         cuts++;
+      }
+      remount ();
+
+      for (i = 0; i < count; i++)
+      {
+         p = ref + (lba + i) * SECTOR;
+         CHECK (ftl_read (rbuf, (lba + i) * SECTOR, SECTOR) == FLASHSPI_OK, "read");
+         if (memcmp (rbuf, p, SECTOR) != 0)
+         {
+            CHECK (memcmp (rbuf, buf + i * SECTOR, SECTOR) == 0,
+                   "sector %u neither old nor new after cut, trial %d", lba + i, t);
+            memcpy (p, rbuf, SECTOR);
+         }
+      }
+
+      /* power cut on background gc, formatting and wear leveling */
+      if (t % 50 == 0)
+      {
+         nor_power_cut (rand () % 64);
+         idle (20);
+         remount ();
+         check_all ("idle cut");
+      }
+   }
+   check_all ("power cut");
+   CHECK (cuts > 1000, "only %u writes interrupted", cuts);
+}
+
+int main (void)
+{
+   srand (1);
+
+   test_mount ();
+   test_data ();
+   test_power_cut ();
+
+   printf ("test_ftl: OK\n");
+   return 0;
+}
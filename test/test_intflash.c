@@ -0,0 +1,266 @@
+// =============================================================================
+/*!
+ * @file       test_intflash.c
+ *
+ * Host test of the on-chip flash disk region.
+ *
+ * The flash controller is replaced by a model that keeps the disk region
+ * in a host array, refuses to program halfwords that are not erased and
+ * counts page erases and halfword programs. The region symbols of the
+ * linker script are provided by the test makefile.
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "at32_intflash.h"
+
+#define REGION_SIZE             INTFLASH_TEST_SIZE
+#define PAGE                    INTFLASH_PAGE_SIZE
+#define SECTOR                  512
+
+#define CHECK(cond, ...) \
+   do { if (!(cond)) { printf ("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf (__VA_ARGS__); printf ("\n"); exit (1); } } while (0)
+
+uint8_t _sintflash[REGION_SIZE] __attribute__ ((aligned (PAGE)));
+
+static uint8_t ref[REGION_SIZE];
+static uint8_t locked = 1;
+static uint32_t erases, programs;
+
+/* --------------------------------------------------------------------------- */
+/* Flash controller model                                                      */
+/* --------------------------------------------------------------------------- */
+
+void flash_flag_clear (uint32_t flag)
+{
+}
+
+void flash_unlock (void)
+{
+   locked = 0;
+}
+
+void flash_lock (void)
+{
+   locked = 1;
+}
+
+flash_status_type flash_sector_erase (uint32_t sector_address)
+{
+   uint8_t *page = (uint8_t *)(uintptr_t)sector_address;
+
+   CHECK (!locked, "erase while locked");
+   CHECK (page >= _sintflash && page < _sintflash + REGION_SIZE &&
+          (page - _sintflash) % PAGE == 0, "erase of %p outside region", page);
+   memset (page, 0xFF, PAGE);
+   erases++;
+   return FLASH_OPERATE_DONE;
+}
+
+flash_status_type flash_halfword_program (uint32_t address, uint16_t data)
+{
+   uint16_t *p = (uint16_t *)(uintptr_t)address;
+
+   CHECK (!locked, "program while locked");
+   CHECK ((uint8_t *)p >= _sintflash && (uint8_t *)p < _sintflash + REGION_SIZE &&
+          (address & 1) == 0, "program of %p outside region", p);
+   CHECK (*p == 0xFFFF, "program of %04x over %04x at offset %u", data, *p,
+          (uint32_t)((uint8_t *)p - _sintflash));
+   *p = data;
+   programs++;
+   return FLASH_OPERATE_DONE;
+}
+
+/* --------------------------------------------------------------------------- */
+/* Tests                                                                       */
+/* --------------------------------------------------------------------------- */
+
+static void reset_stats (void)
+{
+   erases = 0;
+   programs = 0;
+}
+
+static void write_ref (const uint8_t *buf, uint32_t addr, uint32_t len)
+{
+   CHECK (intflash_write (buf, addr, len) == FLASH_OPERATE_DONE, "write %u+%u", addr, len);
+   memcpy (ref + addr, buf, len);
+   CHECK (memcmp (_sintflash, ref, REGION_SIZE) == 0, "region mismatch after write %u+%u", addr, len);
+}
+
+static void test_skip_erase (void)
+{
+   uint8_t buf[PAGE];
+
+   memset (_sintflash, 0xFF, REGION_SIZE);
+   memset (ref, 0xFF, REGION_SIZE);
+
+   /* sectors of an erased page are programmed in place */
+   memset (buf, 0xA5, 2 * SECTOR);
+   reset_stats ();
+   write_ref (buf, 0, SECTOR);
+   write_ref (buf, SECTOR, SECTOR);
+   write_ref (buf, 3 * SECTOR, SECTOR);
+   CHECK (erases == 0 && programs == 3 * SECTOR / 2, "erased page: %u erases %u programs",
+          erases, programs);
+
+   /* unchanged data is neither erased nor programmed */
+   reset_stats ();
+   write_ref (buf, 0, 2 * SECTOR);
+   CHECK (erases == 0 && programs == 0, "same data: %u erases %u programs", erases, programs);
+
+   /* erased halfwords are left alone, only differing ones are programmed */
+   memset (buf, 0xFF, SECTOR);
+   buf[10] = 0x12;
+   buf[11] = 0x34;
+   reset_stats ();
+   write_ref (buf, 2 * SECTOR, SECTOR);
+   CHECK (erases == 0 && programs == 1, "blank halfwords: %u erases %u programs", erases, programs);
+}
+
+static void test_read_modify_write (void)
+{
+   uint8_t buf[PAGE];
+   uint32_t i;
+
+   for (i = 0; i < REGION_SIZE; i++)
+   {
+      ref[i] = rand ();
+   }
+   memcpy (_sintflash, ref, REGION_SIZE);
+
+   /* partial page over programmed data erases once and keeps the rest */
+   for (i = 0; i < SECTOR; i++)
+   {
+      buf[i] = ~ref[PAGE + SECTOR + i];
+   }
+   reset_stats ();
+   write_ref (buf, PAGE + SECTOR, SECTOR);
+   CHECK (erases == 1, "partial page: %u erases", erases);
+
+   /* write spanning two pages erases both */
+   reset_stats ();
+   write_ref (buf, 2 * PAGE - SECTOR / 2, SECTOR);
+   CHECK (erases == 2, "page crossing: %u erases", erases);
+
+   /* whole page is erased and programmed without read back */
+   for (i = 0; i < PAGE; i++)
+   {
+      buf[i] = ~ref[3 * PAGE + i];
+   }
+   reset_stats ();
+   write_ref (buf, 3 * PAGE, PAGE);
+   CHECK (erases == 1, "whole page: %u erases", erases);
+}
+
+static void test_erase_range (void)
+{
+   uint32_t i;
+
+   for (i = 0; i < REGION_SIZE; i++)
+   {
+      ref[i] = rand ();
+   }
+   memcpy (_sintflash, ref, REGION_SIZE);
+
+   /* only pages fully covered by the range are erased */
+   reset_stats ();
+   CHECK (intflash_erase_range (SECTOR, 3 * PAGE) == FLASH_OPERATE_DONE, "erase range");
+   memset (ref + PAGE, 0xFF, 2 * PAGE);
+   CHECK (erases == 2, "unaligned range: %u erases", erases);
+   CHECK (memcmp (_sintflash, ref, REGION_SIZE) == 0, "region mismatch after erase range");
+
+   /* pages already erased are skipped */
+   reset_stats ();
+   CHECK (intflash_erase_range (0, 4 * PAGE) == FLASH_OPERATE_DONE, "erase range");
+   memset (ref, 0xFF, 4 * PAGE);
+   CHECK (erases == 2, "partly erased range: %u erases", erases);
+   CHECK (memcmp (_sintflash, ref, REGION_SIZE) == 0, "region mismatch after erase range");
+
+   /* range smaller than a page erases nothing */
+   reset_stats ();
+   CHECK (intflash_erase_range (4 * PAGE + SECTOR, SECTOR) == FLASH_OPERATE_DONE, "erase range");
+   CHECK (erases == 0, "sub page range: %u erases", erases);
+
+   CHECK (intflash_erase_range (REGION_SIZE - PAGE, 2 * PAGE) != FLASH_OPERATE_DONE,
+          "erase past end accepted");
+}
+
+static void test_invalid (void)
+{
+   uint8_t buf[4] = {0};
+
+   CHECK (intflash_write (buf, 1, 2) != FLASH_OPERATE_DONE, "odd address accepted");
+   CHECK (intflash_write (buf, 0, 3) != FLASH_OPERATE_DONE, "odd length accepted");
+   CHECK (intflash_write (buf, REGION_SIZE - 2, 4) != FLASH_OPERATE_DONE, "write past end accepted");
+}
+
+static void test_random (void)
+{
+   static uint8_t buf[8 * SECTOR];
+   uint32_t addr, len, i, s, e;
+   int t, op;
+
+   memset (_sintflash, 0xFF, REGION_SIZE);
+   memset (ref, 0xFF, REGION_SIZE);
+
+   for (t = 0; t < 20000; t++)
+   {
+      len = SECTOR * (1 + rand () % 8);
+      addr = SECTOR * (rand () % (REGION_SIZE / SECTOR - 8));
+      op = rand () % 4;
+
+      if (op < 2)
+      {
+         for (i = 0; i < len; i++)
+         {
+            buf[i] = rand () % 3 ? rand () : 0xFF;
+         }
+         write_ref (buf, addr, len);
+      }
+      else if (op == 2)
+      {
+         /* clears bits only */
+         for (i = 0; i < len; i++)
+         {
+            buf[i] = ref[addr + i] & rand ();
+         }
+         write_ref (buf, addr, len);
+      }
+      else
+      {
+         CHECK (intflash_erase_range (addr, len) == FLASH_OPERATE_DONE, "erase range");
+         s = (addr + PAGE - 1) & ~(PAGE - 1);
+         e = (addr + len) & ~(PAGE - 1);
+         if (s < e)
+         {
+            memset (ref + s, 0xFF, e - s);
+         }
+         CHECK (memcmp (_sintflash, ref, REGION_SIZE) == 0, "region mismatch after erase %u+%u",
+                addr, len);
+      }
+   }
+}
+
+int main (void)
+{
+   intflash_init ();
+   CHECK (intflash_get_size () == REGION_SIZE, "region size %u", intflash_get_size ());
+   CHECK (intflash_get_ptr (PAGE) == _sintflash + PAGE, "region pointer");
+
+   test_skip_erase ();
+   test_read_modify_write ();
+   test_erase_range ();
+   test_invalid ();
+   test_random ();
+   CHECK (locked, "flash left unlocked");
+
+   printf ("test_intflash: OK\n");
+   return 0;
+}
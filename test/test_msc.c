@@ -0,0 +1,613 @@
+// =============================================================================
+/*!
+ * @file       test_msc.c
+ *
+ * Host test of the bulk-only transport read and write pipelines.
+ *
+ * The bot engine is driven with a ram backed disk and a fake bulk endpoint
+ * pair. Time is simulated, bulk transfers take USB_NS_PER_BYTE and run in
+ * parallel with the main loop, disk accesses take the disk cost and block
+ * the main loop, asynchronous reads and writes complete on their own, write
+ * data is taken from the pipe buffer on completion. Data is checked
+ * against the ram disk and throughput is printed for each disk model,
+ * unmap parameter lists are checked against the advertised limits.
+ *
+ * @version    x.x.x
+ *
+ * @copyright  Copyright &copy; &nbsp; 2024 Bithium S.A.
+ */
+// =============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "msc_bot_scsi.h"
+#include "msc_diskio.h"
+
+#define DISK_BLOCKS             2048
+#define DISK_BLOCK_SIZE         512
+#define USB_NS_PER_BYTE         820         /* ~1.2MB/s full speed bulk */
+#define MAX_XFER_BLOCKS         128
+#define MAX_LOOPS               1000000
+
+#define CHECK(cond, ...) \
+   do { if (!(cond)) { printf ("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf (__VA_ARGS__); printf ("\n"); exit (1); } } while (0)
+
+typedef struct {
+   const char *name;
+   uint32_t read_ns;          /* disk cost per byte */
+   uint32_t write_ns;
+   uint8_t async;             /* reads and writes complete in background */
+}disk_model_t;
+
+static const disk_model_t models[] = {
+   {"ram",             0,    0, 0},
+   {"spi flash",     100, 1500, 0},
+   {"spi flash dma", 100, 1500, 1},
+};
+
+static uint8_t disk[DISK_BLOCKS * DISK_BLOCK_SIZE];
+static const disk_model_t *model;
+static uint64_t now;                      /* simulated time, ns */
+static uint32_t disk_ops;
+
+static usbd_core_type dev;
+static usbd_class_handler handler;
+static msc_type msc;
+
+/* bulk in, device to host */
+static uint8_t *in_buf;
+static uint32_t in_len;
+static uint8_t in_pending;
+static uint64_t in_done;
+static uint8_t in_stall;
+
+/* bulk out, host to device */
+static uint8_t *out_buf;
+static uint32_t out_len;
+static uint8_t out_armed;
+static uint32_t out_recv;
+static uint8_t out_stall;
+static uint64_t out_done;
+
+/* background disk read */
+static void (*rd_done)(usb_sts_type status);
+static uint64_t rd_at;
+
+/* background disk write */
+static void (*wr_done)(usb_sts_type status);
+static uint64_t wr_at;
+static uint8_t *wr_buf;
+static uint64_t wr_addr;
+static uint32_t wr_len;
+
+static uint32_t unmaps, syncs;
+static uint8_t disk_busy;                 /* long operation, accesses fail with USB_WAIT */
+static uint32_t write_ends;
+static uint8_t program_fail;              /* write_end reports data not programmed */
+
+/* --------------------------------------------------------------------------- */
+/* Fake usb device driver                                                      */
+/* --------------------------------------------------------------------------- */
+
+void usbd_ept_send (usbd_core_type *udev, uint8_t ept_addr, uint8_t *buffer, uint16_t len)
+{
+   CHECK (!in_pending, "bulk in armed twice");
+   in_buf = buffer;
+   in_len = len;
+   in_pending = 1;
+   in_done = now + (uint64_t)len * USB_NS_PER_BYTE;
+}
+
+void usbd_ept_recv (usbd_core_type *udev, uint8_t ept_addr, uint8_t *buffer, uint16_t len)
+{
+   out_buf = buffer;
+   out_len = len;
+   out_armed = 1;
+   out_done = now + (uint64_t)len * USB_NS_PER_BYTE;
+}
+
+uint32_t usbd_get_recv_len (usbd_core_type *udev, uint8_t ept_addr)
+{
+   return out_recv;
+}
+
+void usbd_set_stall (usbd_core_type *udev, uint8_t ept_addr)
+{
+   if (ept_addr & 0x80)
+   {
+      in_stall = 1;
+   }
+   else
+   {
+      out_stall = 1;
+   }
+}
+
+void usbd_flush_tx_fifo (usbd_core_type *udev, uint8_t fifo_num)
+{
+}
+
+/* --------------------------------------------------------------------------- */
+/* Ram disk                                                                    */
+/* --------------------------------------------------------------------------- */
+
+static usb_sts_type ram_read (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   if (disk_busy)
+   {
+      return USB_WAIT;
+   }
+   memcpy (buf, disk + addr, len);
+   now += (uint64_t)len * model->read_ns;
+   disk_ops++;
+   return USB_OK;
+}
+
+static usb_sts_type ram_write (uint64_t addr, uint8_t *buf, uint32_t len)
+{
+   if (disk_busy)
+   {
+      return USB_WAIT;
+   }
+   memcpy (disk + addr, buf, len);
+   now += (uint64_t)len * model->write_ns;
+   disk_ops++;
+   return USB_OK;
+}
+
+static void ram_read_start (uint64_t addr, uint8_t *buf, uint32_t len,
+                            void (*done)(usb_sts_type status))
+{
+   if (!model->async || disk_busy)
+   {
+      done (ram_read (addr, buf, len));
+      return;
+   }
+
+   CHECK (rd_done == NULL, "read started twice");
+   memcpy (buf, disk + addr, len);
+   rd_done = done;
+   rd_at = now + (uint64_t)len * model->read_ns;
+   disk_ops++;
+}
+
+static void ram_write_start (uint64_t addr, uint8_t *buf, uint32_t len,
+                             void (*done)(usb_sts_type status))
+{
+   if (!model->async || disk_busy)
+   {
+      done (ram_write (addr, buf, len));
+      return;
+   }
+
+   CHECK (wr_done == NULL, "write started twice");
+   wr_done = done;
+   wr_buf = buf;
+   wr_addr = addr;
+   wr_len = len;
+   wr_at = now + (uint64_t)len * model->write_ns;
+   disk_ops++;
+}
+
+static usb_sts_type ram_write_end (void)
+{
+   CHECK (wr_done == NULL, "write end before write done");
+   write_ends++;
+   return program_fail ? USB_FAIL : USB_OK;
+}
+
+static usb_sts_type ram_capacity (uint64_t *blk_nbr, uint32_t *blk_size)
+{
+   if (disk_busy)
+   {
+      return USB_WAIT;
+   }
+   *blk_nbr = DISK_BLOCKS;
+   *blk_size = DISK_BLOCK_SIZE;
+   return USB_OK;
+}
+
+static usb_sts_type ram_unmap (uint64_t addr, uint64_t len)
+{
+   memset (disk + addr, 0xFF, len);
+   unmaps++;
+   return USB_OK;
+}
+
+static usb_sts_type ram_sync (void)
+{
+   syncs++;
+   return USB_OK;
+}
+
+static const msc_disk_ops_type ram_ops = {
+   .read = ram_read,
+   .write = ram_write,
+   .capacity = ram_capacity,
+   .unmap = ram_unmap,
+   .sync = ram_sync,
+   .read_start = ram_read_start,
+   .write_start = ram_write_start,
+   .write_end = ram_write_end,
+};
+
+const msc_disk_ops_type *msc_disk_get_ops (uint8_t lun)
+{
+   return lun == 0 ? &ram_ops : NULL;
+}
+
+uint8_t *get_inquiry (uint8_t lun)
+{
+   static uint8_t inquiry[36];
+   return inquiry;
+}
+
+/* --------------------------------------------------------------------------- */
+/* Host side                                                                   */
+/* --------------------------------------------------------------------------- */
+
+/**
+ * @brief  Sends a cbw, bulk out must be armed for it
+ * @param  cb: command block
+ * @param  cb_len: command block length
+ * @param  xfer_len: data stage length
+ * @param  in: data stage direction is device to host
+ */
+static void host_send_cbw (const uint8_t *cb, uint8_t cb_len, uint32_t xfer_len, uint8_t in)
+{
+   static uint32_t tag;
+   cbw_type *cbw = (cbw_type *)out_buf;
+
+   CHECK (out_armed && out_len == CBW_CMD_LENGTH, "bulk out not armed for cbw");
+   memset (cbw, 0, CBW_CMD_LENGTH);
+   cbw->dCBWSignature = CBW_DCBWSIGNATURE;
+   cbw->dCBWTage = ++tag;
+   cbw->dCBWDataTransferLength = xfer_len;
+   cbw->bmCBWFlags = in ? 0x80 : 0;
+   cbw->bCBWCBLength = cb_len;
+   memcpy (cbw->CBWCB, cb, cb_len);
+
+   out_armed = 0;
+   out_recv = CBW_CMD_LENGTH;
+   now += CBW_CMD_LENGTH * USB_NS_PER_BYTE;
+   bot_scsi_dataout_handler (&dev, USBD_MSC_BULK_OUT_EPT);
+}
+
+/**
+ * @brief  Runs main loop and bulk transfers until the csw is received
+ * @param  in: buffer for data in stage or NULL
+ * @param  out: data for data out stage or NULL
+ * @param  len: data stage length
+ * @retval csw status
+ */
+static uint8_t host_run (uint8_t *in, const uint8_t *out, uint32_t len)
+{
+   uint32_t done = 0;
+   uint32_t ops;
+   uint64_t next;
+   csw_type *csw;
+   int loops;
+
+   for (loops = 0; loops < MAX_LOOPS; loops++)
+   {
+      /* host clears halted endpoints and reads the csw */
+      if (in_stall)
+      {
+         in_stall = 0;
+         out_stall = 0;
+         bot_scsi_clear_feature (&dev, USBD_MSC_BULK_OUT_EPT);
+         bot_scsi_clear_feature (&dev, USBD_MSC_BULK_IN_EPT);
+      }
+
+      ops = disk_ops;
+      bot_scsi_task (&dev);
+
+      /* nothing to do on main loop, wait for next event */
+      if (disk_ops == ops)
+      {
+         next = UINT64_MAX;
+         if (in_pending && in_done < next) next = in_done;
+         if (out != NULL && out_armed && !out_stall && done < len && out_done < next) next = out_done;
+         if (rd_done != NULL && rd_at < next) next = rd_at;
+         if (wr_done != NULL && wr_at < next) next = wr_at;
+         CHECK (next != UINT64_MAX || in_stall, "device stalled, %u of %u bytes", done, len);
+         if (next > now) now = next;
+      }
+
+      if (rd_done != NULL && rd_at <= now)
+      {
+         void (*cb)(usb_sts_type) = rd_done;
+         rd_done = NULL;
+         cb (USB_OK);
+      }
+
+      if (wr_done != NULL && wr_at <= now)
+      {
+         void (*cb)(usb_sts_type) = wr_done;
+         wr_done = NULL;
+         memcpy (disk + wr_addr, wr_buf, wr_len);
+         cb (USB_OK);
+      }
+
+      /* host sends data as soon as the endpoint is armed */
+      if (out != NULL && out_armed && !out_stall && done < len && out_done <= now)
+      {
+         CHECK (done + out_len <= len, "bulk out past data stage");
+         memcpy (out_buf, out + done, out_len);
+         done += out_len;
+         out_recv = out_len;
+         out_armed = 0;
+         bot_scsi_dataout_handler (&dev, USBD_MSC_BULK_OUT_EPT);
+      }
+
+      if (in_pending && in_done <= now)
+      {
+         in_pending = 0;
+         csw = (csw_type *)in_buf;
+         if (in_len == CSW_CMD_LENGTH && csw->dCSWSignature == CSW_DCSWSIGNATURE &&
+             (in == NULL || done == len || csw->bCSWStatus != CSW_BCSWSTATUS_PASS))
+         {
+            bot_scsi_datain_handler (&dev, USBD_MSC_BULK_IN_EPT);
+            return csw->bCSWStatus;
+         }
+         CHECK (in != NULL && done + in_len <= len, "bulk in past data stage");
+         memcpy (in + done, in_buf, in_len);
+         done += in_len;
+         bot_scsi_datain_handler (&dev, USBD_MSC_BULK_IN_EPT);
+      }
+   }
+
+   CHECK (0, "command did not complete");
+   return 0xFF;
+}
+
+static void put_be32 (uint8_t *p, uint32_t v)
+{
+   p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint8_t host_read (uint32_t lba, uint16_t count, uint8_t *buf)
+{
+   uint8_t cb[10] = {MSC_CMD_READ_10};
+
+   put_be32 (cb + 2, lba);
+   cb[7] = count >> 8;
+   cb[8] = count;
+   host_send_cbw (cb, sizeof (cb), count * DISK_BLOCK_SIZE, 1);
+   return host_run (buf, NULL, count * DISK_BLOCK_SIZE);
+}
+
+static uint8_t host_write (uint32_t lba, uint16_t count, const uint8_t *buf)
+{
+   uint8_t cb[10] = {MSC_CMD_WRITE_10};
+
+   put_be32 (cb + 2, lba);
+   cb[7] = count >> 8;
+   cb[8] = count;
+   host_send_cbw (cb, sizeof (cb), count * DISK_BLOCK_SIZE, 0);
+   return host_run (NULL, buf, count * DISK_BLOCK_SIZE);
+}
+
+static uint8_t host_unmap (const uint8_t *param, uint16_t len)
+{
+   uint8_t cb[10] = {MSC_CMD_UNMAP};
+
+   cb[7] = len >> 8;
+   cb[8] = len;
+   host_send_cbw (cb, sizeof (cb), len, 0);
+   return host_run (NULL, param, len);
+}
+
+static void host_sense (uint8_t *key, uint8_t *asc)
+{
+   uint8_t cb[6] = {MSC_CMD_REQUEST_SENSE, 0, 0, 0, REQ_SENSE_STANDARD_DATA_LEN};
+   uint8_t buf[REQ_SENSE_STANDARD_DATA_LEN];
+
+   host_send_cbw (cb, sizeof (cb), sizeof (buf), 1);
+   CHECK (host_run (buf, NULL, sizeof (buf)) == CSW_BCSWSTATUS_PASS, "request sense");
+   *key = ((sense_type *)buf)->sense_key;
+   *asc = ((sense_type *)buf)->asc;
+}
+
+static uint8_t host_test_unit (void)
+{
+   uint8_t cb[6] = {MSC_CMD_TEST_UNIT};
+
+   host_send_cbw (cb, sizeof (cb), 0, 0);
+   return host_run (NULL, NULL, 0);
+}
+
+static void unmap_descriptor (uint8_t *p, uint32_t lba, uint32_t count)
+{
+   memset (p, 0, MSC_UNMAP_DESCRIPTOR_LEN);
+   put_be32 (p + 4, lba);
+   put_be32 (p + 8, count);
+}
+
+static double mbps (uint64_t bytes, uint64_t ns)
+{
+   return ns ? (double)bytes * 1000.0 / ns : 0;
+}
+
+/* --------------------------------------------------------------------------- */
+/* Tests                                                                       */
+/* --------------------------------------------------------------------------- */
+
+static void test_integrity (void)
+{
+   static uint8_t buf[MAX_XFER_BLOCKS * DISK_BLOCK_SIZE];
+   static uint8_t ref[sizeof (disk)];
+   uint32_t lba, n, i;
+   int t;
+
+   for (i = 0; i < sizeof (disk); i++)
+   {
+      disk[i] = rand ();
+   }
+   memcpy (ref, disk, sizeof (disk));
+
+   for (t = 0; t < 200; t++)
+   {
+      n = 1 + rand () % MAX_XFER_BLOCKS;
+      lba = rand () % (DISK_BLOCKS - n);
+
+      if (t & 1)
+      {
+         for (i = 0; i < n * DISK_BLOCK_SIZE; i++)
+         {
+            buf[i] = rand ();
+         }
+         memcpy (ref + lba * DISK_BLOCK_SIZE, buf, n * DISK_BLOCK_SIZE);
+         CHECK (host_write (lba, n, buf) == CSW_BCSWSTATUS_PASS, "write lba %u n %u", lba, n);
+         CHECK (memcmp (disk, ref, sizeof (disk)) == 0, "disk mismatch after write lba %u n %u", lba, n);
+      }
+
+      memset (buf, 0, n * DISK_BLOCK_SIZE);
+      CHECK (host_read (lba, n, buf) == CSW_BCSWSTATUS_PASS, "read lba %u n %u", lba, n);
+      CHECK (memcmp (buf, ref + lba * DISK_BLOCK_SIZE, n * DISK_BLOCK_SIZE) == 0,
+             "read data mismatch lba %u n %u", lba, n);
+   }
+
+   /* out of range fails without touching the disk */
+   CHECK (host_write (DISK_BLOCKS - 1, 2, buf) != CSW_BCSWSTATUS_PASS, "write past end passed");
+   CHECK (memcmp (disk, ref, sizeof (disk)) == 0, "disk changed by failed write");
+   CHECK (host_read (DISK_BLOCKS - 1, 2, buf) != CSW_BCSWSTATUS_PASS, "read past end passed");
+
+   /* zero length has no data stage */
+   CHECK (host_read (0, 0, buf) == CSW_BCSWSTATUS_PASS, "zero length read");
+   CHECK (host_write (0, 0, buf) == CSW_BCSWSTATUS_PASS, "zero length write");
+   CHECK (memcmp (disk, ref, sizeof (disk)) == 0, "disk changed by zero length write");
+}
+
+static void test_not_ready (void)
+{
+   static uint8_t buf[16 * DISK_BLOCK_SIZE];
+   uint8_t key, asc;
+
+   /* disk busy with a long operation, host is told to retry */
+   disk_busy = 1;
+   CHECK (host_test_unit () == CSW_BCSWSTATUS_FAILED, "test unit ready passed while busy");
+   host_sense (&key, &asc);
+   CHECK (key == SENSE_KEY_NOT_READY && asc == LOGICAL_UNIT_NOT_READY, "sense %02x/%02x", key, asc);
+   CHECK (host_read (0, 16, buf) == CSW_BCSWSTATUS_FAILED, "read passed while busy");
+   host_sense (&key, &asc);
+   CHECK (key == SENSE_KEY_NOT_READY && asc == LOGICAL_UNIT_NOT_READY, "sense %02x/%02x", key, asc);
+   CHECK (host_write (0, 16, buf) == CSW_BCSWSTATUS_FAILED, "write passed while busy");
+   host_sense (&key, &asc);
+   CHECK (key == SENSE_KEY_NOT_READY && asc == LOGICAL_UNIT_NOT_READY, "sense %02x/%02x", key, asc);
+
+   disk_busy = 0;
+   CHECK (host_test_unit () == CSW_BCSWSTATUS_PASS, "test unit ready");
+   CHECK (host_read (0, 16, buf) == CSW_BCSWSTATUS_PASS, "read");
+   CHECK (memcmp (buf, disk, sizeof (buf)) == 0, "read data mismatch");
+}
+
+static void test_write_end (void)
+{
+   static uint8_t buf[16 * DISK_BLOCK_SIZE];
+   uint8_t key, asc;
+
+   /* status of a write is known once data is on media */
+   memcpy (buf, disk, sizeof (buf));
+   write_ends = 0;
+   CHECK (host_write (0, 16, buf) == CSW_BCSWSTATUS_PASS, "write");
+   CHECK (write_ends == 1, "write end called %u times", write_ends);
+
+   program_fail = 1;
+   CHECK (host_write (0, 16, buf) == CSW_BCSWSTATUS_FAILED, "write passed with programming error");
+   program_fail = 0;
+   host_sense (&key, &asc);
+   CHECK (key == SENSE_KEY_HARDWARE_ERROR, "sense %02x/%02x", key, asc);
+   CHECK (host_read (0, 16, buf) == CSW_BCSWSTATUS_PASS, "read after failed write");
+}
+
+static void test_unmap (void)
+{
+   uint8_t param[MSC_UNMAP_HEADER_LEN + 2 * MSC_UNMAP_DESCRIPTOR_LEN] = {0};
+   uint8_t key, asc;
+   uint32_t i;
+
+   param[1] = sizeof (param) - 2;
+   param[3] = sizeof (param) - MSC_UNMAP_HEADER_LEN;
+   unmap_descriptor (param + MSC_UNMAP_HEADER_LEN, 16, 8);
+   unmap_descriptor (param + MSC_UNMAP_HEADER_LEN + MSC_UNMAP_DESCRIPTOR_LEN,
+                     DISK_BLOCKS - MSC_UNMAP_MAX_LBA_COUNT, MSC_UNMAP_MAX_LBA_COUNT);
+   memset (disk, 0, sizeof (disk));
+   unmaps = 0;
+
+   CHECK (host_unmap (param, sizeof (param)) == CSW_BCSWSTATUS_PASS, "unmap");
+   CHECK (unmaps == 2, "unmap called %u times", unmaps);
+   for (i = 0; i < sizeof (disk); i++)
+   {
+      uint32_t lba = i / DISK_BLOCK_SIZE;
+      uint8_t mapped = !(lba >= 16 && lba < 24) && lba < DISK_BLOCKS - MSC_UNMAP_MAX_LBA_COUNT;
+      CHECK (disk[i] == (mapped ? 0 : 0xFF), "unmap byte %u", i);
+   }
+
+   /* a descriptor over the advertised maximum fails the whole list */
+   memset (disk, 0, sizeof (disk));
+   unmaps = 0;
+   unmap_descriptor (param + MSC_UNMAP_HEADER_LEN + MSC_UNMAP_DESCRIPTOR_LEN,
+                     0, MSC_UNMAP_MAX_LBA_COUNT + 1);
+   CHECK (host_unmap (param, sizeof (param)) == CSW_BCSWSTATUS_FAILED, "unmap over maximum passed");
+   CHECK (unmaps == 0, "unmap called %u times for failed list", unmaps);
+   host_sense (&key, &asc);
+   CHECK (key == SENSE_KEY_ILLEGAL_REQUEST && asc == INVALID_FIELD_IN_PARAMETER_LIST,
+          "sense %02x/%02x", key, asc);
+}
+
+static void test_throughput (void)
+{
+   static uint8_t buf[MAX_XFER_BLOCKS * DISK_BLOCK_SIZE];
+   const uint32_t total = sizeof (disk);
+   uint64_t t0;
+   clock_t c0;
+   double wall;
+   uint32_t lba;
+
+   t0 = now;
+   c0 = clock ();
+   for (lba = 0; lba < DISK_BLOCKS; lba += MAX_XFER_BLOCKS)
+   {
+      CHECK (host_read (lba, MAX_XFER_BLOCKS, buf) == CSW_BCSWSTATUS_PASS, "read lba %u", lba);
+   }
+   wall = (double)(clock () - c0) / CLOCKS_PER_SEC;
+   printf ("  %-14s read  %6.3f MB/s simulated, %8.1f MB/s host cpu\n", model->name,
+           mbps (total, now - t0), wall > 0 ? total / wall / 1e6 : 0);
+
+   t0 = now;
+   c0 = clock ();
+   for (lba = 0; lba < DISK_BLOCKS; lba += MAX_XFER_BLOCKS)
+   {
+      CHECK (host_write (lba, MAX_XFER_BLOCKS, disk + lba * DISK_BLOCK_SIZE) == CSW_BCSWSTATUS_PASS,
+             "write lba %u", lba);
+   }
+   wall = (double)(clock () - c0) / CLOCKS_PER_SEC;
+   printf ("  %-14s write %6.3f MB/s simulated, %8.1f MB/s host cpu\n", model->name,
+           mbps (total, now - t0), wall > 0 ? total / wall / 1e6 : 0);
+}
+
+int main (void)
+{
+   uint32_t i;
+
+   handler.pdata = &msc;
+   dev.class_handler = &handler;
+
+   printf ("usb bulk %.3f MB/s\n", mbps (1, USB_NS_PER_BYTE));
+   for (i = 0; i < sizeof (models) / sizeof (models[0]); i++)
+   {
+      model = &models[i];
+      bot_scsi_init (&dev);
+      test_integrity ();
+      test_not_ready ();
+      test_write_end ();
+      test_unmap ();
+      test_throughput ();
+   }
+
+   printf ("test_msc: OK\n");
+   return 0;
+}